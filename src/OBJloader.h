@@ -2,89 +2,251 @@
 #define OBJLOADER_H
 
 #include "vec3.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <thread>
 #include <vector>
-#include <iostream>
-#include <fstream>
-#include <sstream>
-#include <string>
 
 
-static std::vector<point3> load_obj(const char* filename) {
-    // Vertices for locations
-    std::vector<point3> positions;
-    std::vector<point3> normals;
+// Indices of one face corner into the mesh's attribute arrays. Missing attributes are -1.
+struct obj_index {
+    int position = -1;
+    int texcoord = -1;
+    int normal   = -1;
+};
+
+// Indexed triangle mesh as read from an OBJ file. Every three entries of `indices` make one
+// triangle; polygons are fan-triangulated around their first corner. Every triangle refers to
+// valid positions; texcoord and normal indices are kept as written in the file.
+struct obj_mesh {
+    std::vector<point3>    positions;
+    std::vector<vec3>      texcoords;
+    std::vector<vec3>      normals;
+    std::vector<obj_index> indices;
+
+    size_t triangle_count() const { return indices.size() / 3; }
+};
+
+
+namespace obj_detail {
+
+    // Everything parsed from one chunk of the file. Relative (negative) indices can only be
+    // resolved once the attribute counts of the earlier chunks are known, so their slots are
+    // remembered in `relative` as (index into `indices`) * 3 + attribute.
+    struct chunk {
+        std::vector<point3>    positions;
+        std::vector<vec3>      texcoords;
+        std::vector<vec3>      normals;
+        std::vector<obj_index> indices;
+        std::vector<size_t>    relative;
+    };
+
+    inline const char* skip_spaces(const char* p, const char* end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+        return p;
+    }
+
+    inline const char* parse_double(const char* p, const char* end, double& value) {
+        p = skip_spaces(p, end);
+        if (p < end && *p == '+') p++;  // from_chars does not accept a leading plus sign
+        auto result = std::from_chars(p, end, value);
+        return result.ec == std::errc() ? result.ptr : nullptr;
+    }
 
-    // Faces
-    std::vector<int> vertex_position_indices;
-    std::vector<int> vertex_normal_indices;
+    inline const char* parse_vec3(const char* p, const char* end, vec3& v) {
+        // Parses up to three components; missing trailing components stay zero.
+        for (int i = 0; i < 3; i++) {
+            auto next = parse_double(p, end, v.e[i]);
+            if (next == nullptr) break;
+            p = next;
+        }
+        return p;
+    }
 
-    // All vertices
-    std::vector<point3> vertices;
+    inline int resolve(int raw, size_t local_count, int attr, int& relative_bits) {
+        // OBJ indices are 1-based, or relative to the end of the list when negative. Relative
+        // indices are resolved against this chunk's count here and fixed up after merging.
+        if (raw > 0) return raw - 1;
+        if (raw < 0) {
+            relative_bits |= 1 << attr;
+            return static_cast<int>(local_count) + raw;
+        }
+        return -1;
+    }
 
-    std::ifstream ifs(filename);
-    std::string line = "";
+    // One parsed face corner, with a bit per attribute that still needs the chunk offset.
+    struct corner {
+        obj_index index;
+        int       relative_bits = 0;
+    };
+
+    inline const char* parse_corner(const char* p, const char* end, const chunk& c, corner& out) {
+        // Parses one face corner: v, v/vt, v//vn or v/vt/vn.
+        int raw[3] = { 0, 0, 0 };
+        for (int attr = 0; attr < 3; attr++) {
+            if (p < end && *p != '/') {
+                auto result = std::from_chars(p, end, raw[attr]);
+                if (result.ec != std::errc()) return nullptr;
+                p = result.ptr;
+            }
+            if (p >= end || *p != '/') break;
+            p++;
+        }
 
-    if (!ifs.is_open()) {
-        throw std::invalid_argument("Cannot open file");
+        out.index.position = resolve(raw[0], c.positions.size(), 0, out.relative_bits);
+        out.index.texcoord = resolve(raw[1], c.texcoords.size(), 1, out.relative_bits);
+        out.index.normal   = resolve(raw[2], c.normals.size(),   2, out.relative_bits);
+        return p;
     }
 
-    while (std::getline(ifs, line)) {
-        std::stringstream ss(line);
-        std::string prefix;
-        ss >> prefix;
+    inline void emit(chunk& c, const corner& v) {
+        auto slot = c.indices.size() * 3;
+        for (int attr = 0; attr < 3; attr++)
+            if (v.relative_bits & (1 << attr))
+                c.relative.push_back(slot + attr);
 
-        if (prefix == "v") { //vertex
-            vec3 temp_vec3;
-            ss >> temp_vec3.e[0] >> temp_vec3.e[1] >> temp_vec3.e[2];
-            positions.push_back(temp_vec3);
-        }
-        else if (prefix == "vn") { // vertex normal
-            vec3 temp_vec3;
-            ss >> temp_vec3.e[0] >> temp_vec3.e[1] >> temp_vec3.e[2];
-            normals.push_back(temp_vec3);
-        }
-        else if (prefix == "f") { //face
-            // Face formats
-            // f v1 v2 v3
-            // f v1/vt1 v2/vt2 v3/vt3
-            // f v1/vt1/vn1 v2/vt2/vn2 v3/vt3/vn3
-            // f v1//vn1 v2//vn2 v3//vn3
-
-            std::string vertex_data;
-            std::vector<int> face_indices;
-
-            while (ss >> vertex_data) {
-                // Replace slashes with spaces
-                for (auto& c : vertex_data) {
-                    if (c == '/') c = ' ';
-                }
+        c.indices.push_back(v.index);
+    }
 
-                std::stringstream vertex_ss(vertex_data);
-                int pos_idx = 0;
-                vertex_ss >> pos_idx;
+    inline void parse_chunk(const char* p, const char* end, chunk& c) {
+        std::vector<corner> face;
+
+        while (p < end) {
+            const char* line_end = static_cast<const char*>(std::memchr(p, '\n', end - p));
+            if (line_end == nullptr) line_end = end;
+
+            p = skip_spaces(p, line_end);
+
+            if (line_end - p >= 2 && p[0] == 'v' && p[1] == ' ') {
+                vec3 v;
+                parse_vec3(p + 2, line_end, v);
+                c.positions.push_back(v);
+            } else if (line_end - p >= 3 && p[0] == 'v' && p[1] == 't' && p[2] == ' ') {
+                vec3 v;
+                parse_vec3(p + 3, line_end, v);
+                c.texcoords.push_back(v);
+            } else if (line_end - p >= 3 && p[0] == 'v' && p[1] == 'n' && p[2] == ' ') {
+                vec3 v;
+                parse_vec3(p + 3, line_end, v);
+                c.normals.push_back(v);
+            } else if (line_end - p >= 2 && p[0] == 'f' && p[1] == ' ') {
+                // Face formats
+                // f v1 v2 v3
+                // f v1/vt1 v2/vt2 v3/vt3
+                // f v1/vt1/vn1 v2/vt2/vn2 v3/vt3/vn3
+                // f v1//vn1 v2//vn2 v3//vn3
+
+                face.clear();
+                const char* q = skip_spaces(p + 2, line_end);
+                while (q < line_end) {
+                    corner v;
+                    q = parse_corner(q, line_end, c, v);
+                    if (q == nullptr) break;
+                    face.push_back(v);
+                    q = skip_spaces(q, line_end);
+                }
 
-                face_indices.push_back(pos_idx - 1);
+                // Triangulate
+                // Connecting each vertex starting from the first one in
+                for (size_t i = 1; i + 1 < face.size(); i++) {
+                    emit(c, face[0]);
+                    emit(c, face[i]);
+                    emit(c, face[i + 1]);
+                }
             }
 
-            // Triangulate
-            // Connecting each vertex starting from the first one in
-            for (size_t i = 1; i + 1 < face_indices.size(); i++) {
-                vertex_position_indices.push_back(face_indices[0]);
-                vertex_position_indices.push_back(face_indices[i]);
-                vertex_position_indices.push_back(face_indices[i + 1]);
-            }
+            p = line_end + 1;
         }
     }
 
-    ifs.close();
+}
 
-    for (int idx : vertex_position_indices) {
-        if (idx >= 0 && idx < static_cast<int>(positions.size())) {
-            vertices.push_back(positions[idx]);
+static obj_mesh load_obj_mesh(const char* filename) {
+    // Loads an indexed triangle mesh from an OBJ file. The file is memory-mapped, split into
+    // chunks at line boundaries, and the chunks are parsed in parallel. Throws
+    // std::invalid_argument if the file cannot be opened.
+
+    mapped_file file(filename);
+    const char* begin = file.data();
+    const char* end = begin + file.size();
+
+    // Aim for chunks of at least a megabyte so small files are not split needlessly.
+    const size_t min_chunk_bytes = 1 << 20;
+    size_t chunk_count = std::max<size_t>(1, std::thread::hardware_concurrency());
+    chunk_count = std::min(chunk_count, file.size() / min_chunk_bytes + 1);
+
+    std::vector<const char*> bounds(chunk_count + 1, end);
+    bounds[0] = begin;
+    for (size_t i = 1; i < chunk_count; i++) {
+        const char* p = std::max(bounds[i-1], begin + file.size() * i / chunk_count);
+        auto newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        bounds[i] = (newline == nullptr) ? end : newline + 1;
+    }
+
+    std::vector<obj_detail::chunk> chunks(chunk_count);
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < chunk_count; i++)
+        workers.emplace_back(obj_detail::parse_chunk, bounds[i], bounds[i+1], std::ref(chunks[i]));
+    obj_detail::parse_chunk(bounds[0], bounds[1], chunks[0]);
+    for (auto& worker : workers)
+        worker.join();
+
+    // Merge the chunks in file order, shifting relative indices by the attribute counts of
+    // all the chunks before them.
+    obj_mesh mesh;
+    size_t positions = 0, texcoords = 0, normals = 0, indices = 0;
+    for (const auto& c : chunks) {
+        positions += c.positions.size();
+        texcoords += c.texcoords.size();
+        normals   += c.normals.size();
+        indices   += c.indices.size();
+    }
+    mesh.positions.reserve(positions);
+    mesh.texcoords.reserve(texcoords);
+    mesh.normals.reserve(normals);
+    mesh.indices.reserve(indices);
+
+    for (auto& c : chunks) {
+        int offsets[3] = {
+            static_cast<int>(mesh.positions.size()),
+            static_cast<int>(mesh.texcoords.size()),
+            static_cast<int>(mesh.normals.size())
+        };
+        for (auto slot : c.relative) {
+            auto& corner = c.indices[slot / 3];
+            int* attr = (slot % 3 == 0) ? &corner.position
+                      : (slot % 3 == 1) ? &corner.texcoord
+                                        : &corner.normal;
+            *attr += offsets[slot % 3];
         }
+
+        mesh.positions.insert(mesh.positions.end(), c.positions.begin(), c.positions.end());
+        mesh.texcoords.insert(mesh.texcoords.end(), c.texcoords.begin(), c.texcoords.end());
+        mesh.normals.insert(mesh.normals.end(), c.normals.begin(), c.normals.end());
+        mesh.indices.insert(mesh.indices.end(), c.indices.begin(), c.indices.end());
+    }
+
+    // Drop triangles that reference positions the file never defined.
+    auto count = static_cast<int>(mesh.positions.size());
+    size_t kept = 0;
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+        bool valid = true;
+        for (size_t k = i; k < i + 3; k++)
+            valid = valid && mesh.indices[k].position >= 0 && mesh.indices[k].position < count;
+        if (!valid) continue;
+
+        for (size_t k = i; k < i + 3; k++)
+            mesh.indices[kept++] = mesh.indices[k];
     }
+    mesh.indices.resize(kept);
 
-    return vertices;
+    return mesh;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -1,6 +1,8 @@
 #ifndef AABB_H
 #define AABB_H
 
+#include "ray_packet.h"
+
 
 class aabb {
     public:
@@ -55,6 +57,150 @@ class aabb {
         }
         return true;
     }
+
+    bool may_hit(const ray_packet& packet) const {
+        // Conservative test of the whole packet against the box, using interval arithmetic over
+        // the packet's origin and inverse direction ranges. Returns false only when no live ray
+        // in the packet can hit the box. Axes whose directions differ in sign across the packet
+        // cannot be bounded this way and are skipped.
+
+        double t_enter = packet.t_min;
+        double t_exit  = infinity;  // Lanes' own t_max limits are left to the per-lane test
+
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& inv = packet.inv_dir_range[axis];
+            if (!(inv.min > 0 || inv.max < 0) || !std::isfinite(inv.min) || !std::isfinite(inv.max))
+                continue;
+
+            const interval& ax = axis_interval(axis);
+            const interval& orig = packet.orig_range[axis];
+
+            // Every lane shares a direction sign, so every lane enters through the same slab plane.
+            double near_plane = (inv.min > 0) ? ax.min : ax.max;
+            double far_plane  = (inv.min > 0) ? ax.max : ax.min;
+
+            auto near_t = product(interval(near_plane - orig.max, near_plane - orig.min), inv);
+            auto far_t  = product(interval(far_plane - orig.max, far_plane - orig.min), inv);
+
+            if (near_t.min > t_enter) t_enter = near_t.min;
+            if (far_t.max < t_exit) t_exit = far_t.max;
+
+            if (t_exit <= t_enter)
+                return false;
+        }
+        return true;
+    }
+
+    packet_mask hit(const ray_packet& packet, packet_mask active) const {
+        // Slab test of every lane in the packet, returning the active lanes that hit the box.
+        // The loops are branch-free over structure-of-arrays data so the compiler can map the
+        // lanes onto SIMD registers.
+
+        double t0[ray_packet::size];
+        double t1[ray_packet::size];
+
+        for (int lane = 0; lane < ray_packet::size; lane++) {
+            t0[lane] = packet.t_min;
+            t1[lane] = packet.t_max[lane];
+        }
+
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& ax = axis_interval(axis);
+            const double* orig = packet.orig[axis];
+            const double* inv_dir = packet.inv_dir[axis];
+
+            for (int lane = 0; lane < ray_packet::size; lane++) {
+                auto ta = (ax.min - orig[lane]) * inv_dir[lane];
+                auto tb = (ax.max - orig[lane]) * inv_dir[lane];
+                auto lo = ta < tb ? ta : tb;
+                auto hi = ta < tb ? tb : ta;
+                t0[lane] = lo > t0[lane] ? lo : t0[lane];
+                t1[lane] = hi < t1[lane] ? hi : t1[lane];
+            }
+        }
+
+        packet_mask result = 0;
+        for (int lane = 0; lane < ray_packet::size; lane++)
+            if (t0[lane] < t1[lane])
+                result |= ray_packet::lane_bit(lane);
+
+        return result & active;
+    }
+
+    static aabb interpolate(const aabb& a, const aabb& b, double t) {
+        // The box part way from a (t = 0) to b (t = 1). An object moving linearly from inside
+        // a to inside b stays inside it at every t.
+        return aabb(interpolate(a.x, b.x, t), interpolate(a.y, b.y, t), interpolate(a.z, b.z, t));
+    }
+
+    bool hit(const ray& r, interval ray_t, const aabb& end_box) const {
+        // Slab test against the box moving from this one at time 0 to end_box at time 1, as it
+        // is at the ray's time. Both boxes are padded already, and the interpolated slabs are
+        // formed one axis at a time inside the test.
+        const point3& ray_orig = r.origin();
+        const vec3&   ray_dir  = r.direction();
+        const double  time     = r.time();
+
+        for (int axis = 0; axis < 3; axis++) {
+            const interval ax = interpolate(axis_interval(axis), end_box.axis_interval(axis), time);
+            const double adinv = 1.0 / ray_dir[axis];
+
+            auto t0 = (ax.min - ray_orig[axis]) * adinv;
+            auto t1 = (ax.max - ray_orig[axis]) * adinv;
+
+            if (t0 < t1) {
+                if (t0 > ray_t.min) ray_t.min = t0;
+                if (t1 < ray_t.max) ray_t.max = t1;
+            } else {
+                if (t1 > ray_t.min) ray_t.min = t1;
+                if (t0 < ray_t.max) ray_t.max = t0;
+            }
+
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
+    packet_mask hit(const ray_packet& packet, packet_mask active, const aabb& end_box) const {
+        // The packet slab test against the box moving from this one at time 0 to end_box at
+        // time 1, each lane seeing it as it is at that lane's time.
+
+        double t0[ray_packet::size];
+        double t1[ray_packet::size];
+
+        for (int lane = 0; lane < ray_packet::size; lane++) {
+            t0[lane] = packet.t_min;
+            t1[lane] = packet.t_max[lane];
+        }
+
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& start = axis_interval(axis);
+            const interval& end = end_box.axis_interval(axis);
+            const double min_delta = end.min - start.min;
+            const double max_delta = end.max - start.max;
+            const double* orig = packet.orig[axis];
+            const double* inv_dir = packet.inv_dir[axis];
+            const double* time = packet.time;
+
+            for (int lane = 0; lane < ray_packet::size; lane++) {
+                auto ta = (start.min + time[lane] * min_delta - orig[lane]) * inv_dir[lane];
+                auto tb = (start.max + time[lane] * max_delta - orig[lane]) * inv_dir[lane];
+                auto lo = ta < tb ? ta : tb;
+                auto hi = ta < tb ? tb : ta;
+                t0[lane] = lo > t0[lane] ? lo : t0[lane];
+                t1[lane] = hi < t1[lane] ? hi : t1[lane];
+            }
+        }
+
+        packet_mask result = 0;
+        for (int lane = 0; lane < ray_packet::size; lane++)
+            if (t0[lane] < t1[lane])
+                result |= ray_packet::lane_bit(lane);
+
+        return result & active;
+    }
+
     int longest_axis() const {
             // Returns the index of the longest axis of the bounding box.
 
@@ -75,6 +221,18 @@ private:
         if (y.size() < delta) y = y.expand(delta);
         if (z.size() < delta) z = z.expand(delta);
     }
+
+    static interval interpolate(const interval& a, const interval& b, double t) {
+        return interval(a.min + t * (b.min - a.min), a.max + t * (b.max - a.max));
+    }
+
+    static interval product(const interval& a, const interval& b) {
+        // Returns the interval holding every product of a value in `a` with a value in `b`.
+        double p0 = a.min * b.min, p1 = a.min * b.max;
+        double p2 = a.max * b.min, p3 = a.max * b.max;
+        return interval(std::fmin(std::fmin(p0, p1), std::fmin(p2, p3)),
+                        std::fmax(std::fmax(p0, p1), std::fmax(p2, p3)));
+    }
 };
 
 const aabb aabb::empty    = aabb(interval::empty,    interval::empty,    interval::empty);
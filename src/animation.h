@@ -0,0 +1,103 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "hittable.h"
+#include "scene_arena.h"
+#include "sphere.h"
+
+#include <functional>
+#include <vector>
+
+// One transform of an animated object: a turn about the y axis by `angle` degrees, or a move
+// by `offset`. Animated steps play out over the whole animation; the others hold throughout.
+struct animation_step {
+    bool   rotate   = false;
+    bool   animated = false;
+    double angle    = 0;
+    vec3   offset;
+};
+
+// An object placed in the world by transforms that play out over an animation, applied in
+// order as `instance` applies them. set_time(t) applies t times each animated transform, so
+// they start from nothing at t = 0 and are complete at t = 1. Only the transform wrappers
+// change from frame to frame; the object itself, with its meshes and textures, is shared with
+// every frame.
+//
+// A sphere that only moves is copied and has its center changed instead, without wrappers,
+// whether or not it also moves over the shutter interval.
+class animated_instance {
+  public:
+    animated_instance(shared_ptr<hittable> object, const std::vector<animation_step>& steps,
+                      scene_arena* arena)
+      : steps(steps)
+    {
+        bool moves_only = true;
+        for (const auto& step : steps)
+            moves_only = moves_only && !step.rotate;
+
+        if (!(moves_only && (copy_sphere<sphere>(object, arena)
+                             || copy_sphere<moving_sphere>(object, arena)))) {
+            top = object;
+            for (const auto& step : steps) {
+                if (step.rotate) {
+                    auto wrapper = make_in<rotate_y>(arena, top, 0.0);
+                    rotations.push_back(wrapper);
+                    top = wrapper;
+                } else {
+                    auto wrapper = make_in<translate>(arena, top, vec3(0,0,0));
+                    translations.push_back(wrapper);
+                    top = wrapper;
+                }
+            }
+        }
+
+        set_time(0);
+    }
+
+    // The object to place in the world.
+    shared_ptr<hittable> root() const { return top; }
+
+    void set_time(double t) {
+        // Wrappers are updated from the inside out, since each takes its bounds from the
+        // object it wraps.
+        if (move_sphere) {
+            auto offset = vec3(0,0,0);
+            for (const auto& step : steps)
+                offset += step.animated ? t * step.offset : step.offset;
+            move_sphere(start_center + offset);
+            return;
+        }
+
+        size_t rotation = 0, translation = 0;
+        for (const auto& step : steps) {
+            auto amount = step.animated ? t : 1.0;
+            if (step.rotate)
+                rotations[rotation++]->set_angle(amount * step.angle);
+            else
+                translations[translation++]->set_offset(amount * step.offset);
+        }
+    }
+
+  private:
+    std::vector<animation_step> steps;
+    shared_ptr<hittable> top;
+    std::vector<shared_ptr<rotate_y>> rotations;
+    std::vector<shared_ptr<translate>> translations;
+    std::function<void(const point3&)> move_sphere;  // Sets the center of the copied sphere
+    point3 start_center;
+
+    template <typename Sphere>
+    bool copy_sphere(const shared_ptr<hittable>& object, scene_arena* arena) {
+        // Places a copy of `object` in the world if it is a Sphere, static or moving.
+        auto sph = std::dynamic_pointer_cast<Sphere>(object);
+        if (!sph)
+            return false;
+        auto copy = make_in<Sphere>(arena, *sph);
+        move_sphere = [copy](const point3& center) { copy->set_center(center); };
+        start_center = sph->center();
+        top = copy;
+        return true;
+    }
+};
+
+#endif
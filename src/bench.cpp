@@ -0,0 +1,232 @@
+#include "rtweekend.h"
+
+#include "scene.h"
+#include "scene_loader.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Usage: renderer_bench [options]
+//
+// Renders each benchmark scene at fixed settings and seed, and prints the results as JSON.
+// Every scene runs in its own child process so its peak memory is measured on its own.
+//
+//   --width N       Image width in pixels (default 320)
+//   --spp N         Samples per pixel (default 16)
+//   --threads N     Render threads (default 0, every hardware thread)
+//   --seed N        Random seed (default 1)
+//   --scenes DIR    Directory holding the scene files
+//   --output FILE   Write the JSON report to FILE instead of standard output
+
+#ifndef RTW_SCENE_DIR
+#define RTW_SCENE_DIR "scenes"
+#endif
+
+#ifndef RTW_IMAGE_DIR
+#define RTW_IMAGE_DIR "images"
+#endif
+
+struct bench_scene {
+    const char* name;
+    const char* file;
+};
+
+const bench_scene bench_scenes[] = {
+    { "bouncing_spheres", "bouncing_spheres.scene" },
+    { "cornell_box",      "cornell_box.scene" },
+    { "cornell_smoke",    "cornell_smoke.scene" },
+    { "final_scene",      "final_scene.scene" },
+    { "many_lights",      "many_lights.scene" },
+    { "obj_cloud",        "test_obj_loader.scene" },
+};
+
+struct bench_options {
+    int width = 320;
+    int samples_per_pixel = 16;
+    int threads = 0;
+    std::uint64_t seed = 1;
+    std::string scene_dir = RTW_SCENE_DIR;
+    std::string output;
+};
+
+class null_buffer : public std::streambuf {
+  protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+std::string json_string(const std::string& text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') quoted += '\\';
+        if (static_cast<unsigned char>(c) < 0x20) continue;
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+std::string run_scene(const bench_scene& entry, const bench_options& options) {
+    // Loads and renders one scene in the calling process, returning its JSON result object.
+
+    auto wall_start = std::chrono::steady_clock::now();
+
+    seed_random(options.seed);
+    scene s = load_scene(options.scene_dir + "/" + entry.file);
+    s.cam.image_width = options.width;
+    s.cam.samples_per_pixel = options.samples_per_pixel;
+    s.cam.threads = options.threads;
+    s.cam.seed = options.seed;
+
+    null_buffer discard;
+    std::ostream image(&discard);
+    s.render(image);
+
+    double wall_seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long long peak_bytes = static_cast<long long>(usage.ru_maxrss) * 1024;  // ru_maxrss is in KiB
+
+    const auto& stats = s.cam.stats;
+    int height = std::max(1, int(s.cam.image_width / s.cam.aspect_ratio));
+
+    std::ostringstream json;
+    json.precision(6);
+    json << "{\"name\": " << json_string(entry.name)
+         << ", \"scene\": " << json_string(entry.file)
+         << ", \"width\": " << s.cam.image_width
+         << ", \"height\": " << height
+         << ", \"spp\": " << s.cam.samples_per_pixel
+         << ", \"max_depth\": " << s.cam.max_depth
+         << ", \"load_seconds\": " << s.load_seconds
+         << ", \"bvh_build_seconds\": " << s.bvh_build_seconds
+         << ", \"render_seconds\": " << stats.seconds
+         << ", \"wall_seconds\": " << wall_seconds
+         << ", \"primary_rays\": " << stats.primary_rays
+         << ", \"total_rays\": " << stats.total_rays
+         << ", \"primary_rays_per_second\": " << stats.primary_rays / stats.seconds
+         << ", \"total_rays_per_second\": " << stats.total_rays / stats.seconds
+         << ", \"texture_bytes\": " << texture_manager::resident_bytes()
+         << ", \"peak_rss_bytes\": " << peak_bytes
+         << "}";
+    return json.str();
+}
+
+std::string run_scene_isolated(const bench_scene& entry, const bench_options& options) {
+    // Runs one scene in a child process and returns the JSON it reports, or an error object
+    // if the child fails.
+
+    int fds[2];
+    if (pipe(fds) != 0)
+        return "{\"name\": " + json_string(entry.name) + ", \"error\": \"pipe failed\"}";
+
+    std::cout.flush();
+    std::clog.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        std::string result;
+        int code = 0;
+        try {
+            result = run_scene(entry, options);
+        } catch (const std::exception& e) {
+            result = "{\"name\": " + json_string(entry.name) + ", \"error\": " + json_string(e.what()) + "}";
+            code = 1;
+        }
+        auto written = write(fds[1], result.data(), result.size());
+        (void)written;
+        close(fds[1]);
+        _exit(code);
+    }
+
+    close(fds[1]);
+    std::string result;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0)
+        result.append(buffer, size_t(n));
+    close(fds[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (result.empty())
+        result = "{\"name\": " + json_string(entry.name) + ", \"error\": \"benchmark process crashed\"}";
+    return result;
+}
+
+bool parse_options(int argc, char* argv[], bench_options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            std::cout << "Usage: renderer_bench [--width N] [--spp N] [--threads N] [--seed N]\n"
+                      << "                      [--scenes DIR] [--output FILE]\n";
+            return false;
+        }
+        if (i + 1 >= argc)
+            throw std::invalid_argument(arg + " needs a value");
+
+        std::string value = argv[++i];
+        if      (arg == "--width")   options.width = std::stoi(value);
+        else if (arg == "--spp")     options.samples_per_pixel = std::stoi(value);
+        else if (arg == "--threads") options.threads = std::stoi(value);
+        else if (arg == "--seed")    options.seed = std::stoull(value);
+        else if (arg == "--scenes")  options.scene_dir = value;
+        else if (arg == "--output")  options.output = value;
+        else throw std::invalid_argument("unknown option " + arg);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    bench_options options;
+    try {
+        if (!parse_options(argc, argv, options))
+            return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 2;
+    }
+
+    // Let rtw_image find the textures wherever the benchmark is run from.
+    setenv("RTW_IMAGES", RTW_IMAGE_DIR, 0);
+
+    std::ostringstream report;
+    report << "{\n  \"settings\": {\"width\": " << options.width
+           << ", \"spp\": " << options.samples_per_pixel
+           << ", \"threads\": " << options.threads
+           << ", \"hardware_threads\": " << std::thread::hardware_concurrency()
+           << ", \"seed\": " << options.seed
+           << ", \"compiler\": " << json_string(__VERSION__) << "},\n"
+           << "  \"scenes\": [\n";
+
+    bool failed = false;
+    bool first = true;
+    for (const auto& entry : bench_scenes) {
+        std::clog << "Benchmarking " << entry.name << "\n";
+        auto result = run_scene_isolated(entry, options);
+        failed = failed || result.find("\"error\"") != std::string::npos;
+
+        report << (first ? "" : ",\n") << "    " << result;
+        first = false;
+    }
+    report << "\n  ]\n}\n";
+
+    if (options.output.empty()) {
+        std::cout << report.str();
+    } else {
+        std::ofstream out(options.output);
+        out << report.str();
+    }
+
+    return failed ? 1 : 0;
+}
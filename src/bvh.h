@@ -4,19 +4,164 @@
 #include "aabb.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "scene_arena.h"
 #include <algorithm>
 
+// Nodes over moving objects keep their bounds at times 0 and 1 as well as over the whole
+// shutter interval, and test each ray against the box interpolated to the ray's time, so a
+// ray only visits the objects near where they are at that instant.
 class bvh_node : public hittable {
 public:
-    bvh_node(hittable_list list) : bvh_node(list.objects, 0, list.objects.size()){
+    // With an arena, the child nodes are allocated from it instead of with make_shared.
+    bvh_node(hittable_list list, scene_arena* arena = nullptr)
+      : bvh_node(list.objects, 0, list.objects.size(), arena) {
 
     }
 
-    bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end) {
-        // Build the bounding box of the span of source objects.
-        bbox = aabb::empty;
-        for (size_t object_index=start; object_index < end; object_index++)
-            bbox = aabb(bbox, objects[object_index]->bounding_box());
+    bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end,
+             scene_arena* arena = nullptr) {
+        build(objects, start, end, arena);
+    }
+
+    void refit() {
+        // Updates the bounds of this hierarchy's nodes, bottom up, after the objects it holds
+        // have moved, keeping every object in the node it was built into. The objects' own
+        // bounds must already be up to date.
+        if (inner) {
+            as_node(left)->refit();
+            as_node(right)->refit();
+        }
+        fit_bounds(aabb(left->bounding_box(), right->bounding_box()),
+                   aabb(left->bounding_box_at(0), right->bounding_box_at(0)),
+                   aabb(left->bounding_box_at(1), right->bounding_box_at(1)));
+    }
+
+    int rebuild_degraded(double max_growth = 2) {
+        // Rebuilds the subtrees that refitting has left much worse than a fresh build. The
+        // chance that a ray visits a node goes with its surface area, so a node whose area
+        // has grown past max_growth times its area when built is rebuilt from the objects
+        // below it, and its own subtree is then up to date. Returns the number of subtrees
+        // rebuilt. Rebuilt nodes are owned by their parents rather than by a scene arena.
+        if (!inner)
+            return 0;
+
+        if (half_area(bbox) > max_growth * built_area) {
+            std::vector<shared_ptr<hittable>> objects;
+            collect_objects(objects);
+            build(objects, 0, objects.size(), nullptr);
+            return 1;
+        }
+
+        return as_node(left)->rebuild_degraded(max_growth)
+             + as_node(right)->rebuild_degraded(max_growth);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        RTW_COUNT(boxes_tested);
+        if (!(moving ? start_bbox.hit(r, ray_t, end_bbox) : bbox.hit(r, ray_t))) {
+            return false;
+        }
+        RTW_COUNT(nodes_visited);
+
+        bool hit_l = left->hit(r, ray_t, rec);
+        bool hit_r = right->hit(r, interval(ray_t.min, hit_l ? rec.t : ray_t.max), rec);
+
+        return hit_l || hit_r;
+    }
+
+    packet_mask hit_packet(ray_packet& packet, packet_mask active, hit_record recs[]) const override {
+        // Cull the whole packet first, then narrow it down to the lanes that hit this box.
+        if (!bbox.may_hit(packet))
+            return 0;
+
+        active = moving ? start_bbox.hit(packet, active, end_bbox) : bbox.hit(packet, active);
+        if (!active)
+            return 0;
+
+        // Once the packet has thinned out to a single ray, the scalar path is cheaper.
+        if (!(active & (active - 1)))
+            return hittable::hit_packet(packet, active, recs);
+
+        // Lanes that hit the left child have already shrunk their t_max for the right child.
+        packet_mask hits = left->hit_packet(packet, active, recs);
+        hits |= right->hit_packet(packet, active, recs);
+
+        return hits;
+    }
+
+    bool hit_span(const ray& r, interval& span) const override {
+        RTW_COUNT(boxes_tested);
+        if (!(moving ? start_bbox.hit(r, interval::universe, end_bbox) : bbox.hit(r, interval::universe)))
+            return false;
+        RTW_COUNT(nodes_visited);
+
+        interval left_span, right_span;
+        bool hit_l = left->hit_span(r, left_span);
+        bool hit_r = right != left && right->hit_span(r, right_span);
+
+        if (hit_l && hit_r)
+            span = interval(left_span, right_span);
+        else if (hit_l || hit_r)
+            span = hit_l ? left_span : right_span;
+
+        return hit_l || hit_r;
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        // Children are tried in order, without looking for the nearer one, and a blocker in
+        // the left child skips the right one altogether.
+        RTW_COUNT(boxes_tested);
+        if (!(moving ? start_bbox.hit(r, ray_t, end_bbox) : bbox.hit(r, ray_t)))
+            return false;
+        RTW_COUNT(nodes_visited);
+
+        return left->occluded(r, ray_t) || (right != left && right->occluded(r, ray_t));
+    }
+
+    double transmittance(const ray& r, interval ray_t) const override {
+        // Children in order, as occluded tries them; a left child that blocks the ray outright
+        // skips the right one.
+        RTW_COUNT(boxes_tested);
+        if (!(moving ? start_bbox.hit(r, ray_t, end_bbox) : bbox.hit(r, ray_t)))
+            return 1;
+        RTW_COUNT(nodes_visited);
+
+        auto fraction = left->transmittance(r, ray_t);
+        if (fraction > 0 && right != left)
+            fraction *= right->transmittance(r, ray_t);
+        return fraction;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    aabb bounding_box_at(double time) const override {
+        return time <= 0 ? start_bbox : time >= 1 ? end_bbox
+                         : aabb::interpolate(start_bbox, end_bbox, time);
+    }
+
+private:
+    shared_ptr<hittable> left;
+    shared_ptr<hittable> right;
+    aabb bbox;
+    aabb start_bbox;      // Bounds at time 0
+    aabb end_bbox;        // Bounds at time 1
+    bool moving = false;  // Whether rays test the box interpolated between the two
+    bool inner = false;   // Whether the children are nodes of this hierarchy
+    double built_area;    // Surface area measure of bbox when the node was built
+
+    void build(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end,
+               scene_arena* arena) {
+        // Build the bounding boxes of the span of source objects, over all time and at the
+        // start and end of the shutter interval.
+        aabb span_bbox = aabb::empty, span_start = aabb::empty, span_end = aabb::empty;
+        for (size_t object_index=start; object_index < end; object_index++) {
+            const auto& object = objects[object_index];
+            span_bbox = aabb(span_bbox, object->bounding_box());
+            span_start = aabb(span_start, object->bounding_box_at(0));
+            span_end = aabb(span_end, object->bounding_box_at(1));
+        }
+        fit_bounds(span_bbox, span_start, span_end);
+        built_area = half_area(bbox);
 
         int axis = bbox.longest_axis();
 
@@ -25,6 +170,7 @@ public:
                                       : box_z_compare;
 
         size_t object_span = end - start;
+        inner = object_span > 2;
 
         if (object_span == 1) {
             left = right = objects[start];
@@ -35,27 +181,42 @@ public:
             std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
 
             auto mid = start + object_span/2;
-            left = make_shared<bvh_node>(objects, start, mid);
-            right = make_shared<bvh_node>(objects, mid, end);
+            left = make_in<bvh_node>(arena, objects, start, mid, arena);
+            right = make_in<bvh_node>(arena, objects, mid, end, arena);
         }
     }
 
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        if (!bbox.hit(r, ray_t)) {
-            return false;
-        }
+    void fit_bounds(const aabb& box, const aabb& box_at_start, const aabb& box_at_end) {
+        bbox = box;
+        start_bbox = box_at_start;
+        end_bbox = box_at_end;
 
-        bool hit_l = left->hit(r, ray_t, rec);
-        bool hit_r = right->hit(r, interval(ray_t.min, hit_l ? rec.t : ray_t.max), rec);
+        // Interpolating only pays off where the motion noticeably enlarges the node's box;
+        // nodes over mostly static contents, such as the root of a scene with a huge ground
+        // sphere, keep the cheaper test against their box over all time.
+        moving = half_area(bbox) > 1.01 * std::fmax(half_area(start_bbox), half_area(end_bbox));
+    }
 
-        return hit_l || hit_r;
+    void collect_objects(std::vector<shared_ptr<hittable>>& objects) const {
+        if (inner) {
+            as_node(left)->collect_objects(objects);
+            as_node(right)->collect_objects(objects);
+        } else {
+            objects.push_back(left);
+            if (right != left)
+                objects.push_back(right);
+        }
     }
 
-    aabb bounding_box() const override { return bbox; }
-private:
-    shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
-    aabb bbox;
+    static bvh_node* as_node(const shared_ptr<hittable>& child) {
+        // Children of inner nodes are always nodes.
+        return static_cast<bvh_node*>(child.get());
+    }
+
+    static double half_area(const aabb& box) {
+        auto x = box.x.size(), y = box.y.size(), z = box.z.size();
+        return x*y + y*z + z*x;
+    }
 
     static bool box_compare(
        const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index
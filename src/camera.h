@@ -2,8 +2,134 @@
 #define CAMERA_H
 
 #include "hittable.h"
+#include "light_tree.h"
 #include "material.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <functional>
+#include <istream>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Counters gathered over one call to camera::render.
+struct render_stats {
+    std::uint64_t primary_rays    = 0;  // Rays leaving the camera
+    std::uint64_t total_rays      = 0;  // Primary rays plus every scattered ray traced
+    double        seconds         = 0;  // Wall time spent tracing, excluding image output
+    double        prepass_seconds = 0;  // Part of `seconds` spent predicting tile costs
+    double        tail_seconds    = 0;  // From the first thread running out of work to the end
+};
+
+// A rectangle of pixels: columns x up to x + width and rows y up to y + height.
+struct pixel_rect {
+    int x = 0, y = 0, width = 0, height = 0;
+
+    bool empty() const { return width <= 0 || height <= 0; }
+
+    pixel_rect intersect(const pixel_rect& other) const {
+        auto x0 = std::max(x, other.x), y0 = std::max(y, other.y);
+        auto x1 = std::min(x + width, other.x + other.width);
+        auto y1 = std::min(y + height, other.y + other.height);
+        return { x0, y0, std::max(0, x1 - x0), std::max(0, y1 - y0) };
+    }
+};
+
+// The predicted and measured cost of one tile of a render. Predictions are the times of a
+// prepass, so only their proportions mean anything.
+struct tile_timing {
+    pixel_rect rect;
+    double     predicted = 0;  // Prepass seconds, or 0 for renders in raster order
+    double     seconds   = 0;  // Thread time spent tracing the tile
+};
+
+inline std::vector<pixel_rect> selected_regions(int width, int height, const pixel_rect& window,
+                                               const std::vector<pixel_rect>& regions) {
+    // The parts of a `width` by `height` image picked out by a window and a list of regions:
+    // the regions clipped to the window, or the window if there are no regions, or else the
+    // whole image. An empty window stands for the whole image. The parts may overlap.
+    pixel_rect area = { 0, 0, width, height };
+    if (!window.empty())
+        area = window.intersect(area);
+    if (regions.empty())
+        return { area };
+
+    std::vector<pixel_rect> parts;
+    for (const auto& region : regions) {
+        auto part = region.intersect(area);
+        if (!part.empty())
+            parts.push_back(part);
+    }
+    return parts;
+}
+
+// A finished rectangle of the image: the pixels whose columns start at x and rows at y, as
+// linear colors averaged over their samples, row by row.
+struct image_tile {
+    int x, y, width, height;
+    std::vector<color> pixels;
+};
+
+using tile_callback = std::function<void(const image_tile&)>;
+
+inline void paste_tile(std::vector<color>& pixels, int width, const image_tile& tile) {
+    // Copies the tile into an image `width` pixels wide, held row by row in `pixels`.
+    for (int j = 0; j < tile.height; j++)
+        std::copy_n(tile.pixels.begin() + size_t(j) * tile.width, tile.width,
+                    pixels.begin() + size_t(tile.y + j) * width + tile.x);
+}
+
+inline void write_ppm(std::ostream& out, int width, int height, const std::vector<color>& pixels) {
+    // Writes linear pixel colors, row by row, as a PPM image.
+    out << "P3\n" << width << ' ' << height << "\n255\n";
+    for (const auto& pixel_color : pixels)
+        write_color(out, pixel_color);
+}
+
+inline bool read_ppm(std::istream& in, int& width, int& height, std::vector<color>& pixels) {
+    // Reads a plain (P3) or binary (P6) PPM image with 8-bit components as linear pixel
+    // colors, row by row. Each byte maps to the middle of the range of colors that
+    // write_color writes as that byte, so writing the pixels back gives the same bytes.
+    // Returns false if the image is malformed.
+    auto skip_space = [&] {
+        while (in && (std::isspace(in.peek()) || in.peek() == '#')) {
+            if (in.get() == '#')
+                in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        }
+    };
+
+    std::string magic;
+    int max_value = 0;
+    in >> magic;
+    skip_space(); in >> width;
+    skip_space(); in >> height;
+    skip_space(); in >> max_value;
+    if (!in || (magic != "P3" && magic != "P6") || width <= 0 || height <= 0 || max_value != 255)
+        return false;
+
+    pixels.resize(size_t(width) * height);
+    if (magic == "P6")
+        in.get();
+    for (auto& pixel_color : pixels) {
+        int bytes[3];
+        for (auto& byte : bytes) {
+            if (magic == "P3")
+                in >> byte;
+            else
+                byte = in.get();
+        }
+        if (!in)
+            return false;
+        auto linear = [](int byte) { auto gamma = (byte + 0.5) / 256; return gamma * gamma; };
+        pixel_color = color(linear(bytes[0]), linear(bytes[1]), linear(bytes[2]));
+    }
+    return true;
+}
+
 class camera {
   public:
     double aspect_ratio      = 1.0;  // Image width over height ratio
@@ -11,6 +137,7 @@ class camera {
     int    samples_per_pixel = 10;   // Number of random samples per pixel
     int    max_depth         = 10;   // Maximum ray bounce depth
     color  background;               // Scene background color
+    shared_ptr<environment_light> environment;  // Lights rays that miss, in place of background
 
     double vfov = 90;                         // Vertical field of view
     point3 lookfrom = point3(0, 0, 0);        // Camera position
@@ -20,24 +147,116 @@ class camera {
     double defocus_angle = 0;  // Defocus blur angle
     double focus_dist    = 10; // Distance to focus plane
 
-    void render(const hittable& world) {
+    // Features of the world that camera rays pay for. Scene files clear them when the world
+    // has nothing that needs them.
+    bool   motion_blur       = true;  // Spread ray times over the shutter, for moving objects
+    bool   texture_filtering = true;  // Give rays cones, so textures filter to their footprint
+
+    bool   packet_tracing = true;  // Trace primary rays as coherent pixel-block packets
+    bool   light_sampling = true;  // Light diffuse hits by sampling the lights directly
+    int    threads        = 0;     // Render threads, 0 to use every hardware thread
+    std::uint64_t seed    = 0;     // Base seed of the per-block random sequences
+    int    tile_size      = 32;    // Edge of the tiles passed to render_image's callback
+    bool   cost_ordering  = false; // Trace the tiles predicted to cost most first
+    pixel_rect window;             // If not empty, only the pixels in it are rendered
+    std::vector<pixel_rect> regions;  // If any, only the pixels in one of them are rendered
+
+    render_stats stats;            // Counters from the most recent render
+    std::vector<tile_timing> tile_timings;  // Per tile of the most recent render
+
+    // Record traversal_counts for every pixel into pixel_traversal. Ignored in builds without
+    // RTW_TRAVERSAL_STATS; recording renders take the scalar path, so that every count can be
+    // charged to its own pixel.
+    bool record_traversal = false;
+    std::vector<traversal_counts> pixel_traversal;
+
+    void render(const hittable& world, std::ostream& out = std::cout,
+                const light_tree* lights = nullptr) {
+        // Renders the world as a PPM image. Diffuse hits are lit by sampling `lights`, the
+        // emitters of the world that the light tree holds, when there are any.
+        write_ppm(out, image_width, height(), render_image(world, lights));
+    }
+
+    std::vector<color> render_image(const hittable& world, const light_tree* lights = nullptr,
+                                    const tile_callback& on_tile = nullptr) {
+        // Renders the world and returns its linear pixel colors, row by row. If `on_tile` is
+        // given, it is called with each tile_size square of the image that holds rendered
+        // pixels, clipped to the window, as soon as the tile is finished, from whichever render
+        // thread finished it. Calls are not serialized: several threads may be in `on_tile` at
+        // once, each with a different tile, and a thread that waits in it holds up no other.
+        // Pixels outside the window and the regions are left black.
+        // Tiles never overlap, so threads paste them into the framebuffer without a lock.
+        std::vector<color> framebuffer(size_t(height()) * image_width, color(0,0,0));
+        render_sums(world, lights, [&](const image_tile& tile) {
+            paste_tile(framebuffer, image_width, tile);
+            if (on_tile)
+                on_tile(tile);
+        });
+        return framebuffer;
+    }
+
+    void render_tiles(const hittable& world, const light_tree* lights, const tile_callback& on_tile) {
+        // Renders the world as render_image does, handing the pixels only to `on_tile`. No
+        // image is kept: memory for the pixels goes with the tiles being traced at the time,
+        // rather than with the area of the image.
+        render_sums(world, lights, on_tile);
+    }
+
+    std::vector<tile_timing> predict_tile_costs(const hittable& world, const light_tree* lights = nullptr) {
+        // Predicts the cost of each tile_size tile that holds rendered pixels from a quick
+        // prepass over the image, without rendering it. Only the proportions of the predicted
+        // costs mean anything.
         init();
+        sampled_lights = (light_sampling && lights && !lights->empty()) ? lights : nullptr;
+        stats = render_stats();
+        const auto grid = plan_tiles();
+        auto costs = prepass(world, grid, thread_count());
 
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+        std::vector<tile_timing> timings;
+        for (size_t t = 0; t < grid.rects.size(); t++) {
+            if (!grid.blocks[t].empty())
+                timings.push_back({ grid.rects[t], costs[t], 0 });
+        }
+        return timings;
+    }
 
-        for (int row = 0; row < image_height; row++) {
-            std::clog << "\rScanlines remaining: " << (image_height - row) << ' ' << std::flush;
-            for (int col = 0; col < image_width; col++) {
-                color pixel_color(0,0,0);
-                for (int s = 0; s < samples_per_pixel; s++) {
-                    ray r = generate_ray(col, row);
-                    pixel_color += trace_ray(r, max_depth, world);
-                }
-                write_color(std::cout, pixel_samples_scale * pixel_color);
+    std::vector<pixel_rect> rendered_regions() const {
+        // The parts of the image that a render fills in (see selected_regions).
+        return selected_regions(image_width, height(), window, regions);
+    }
+
+    int height() const {
+        // Height of the rendered image in pixels, from its width and aspect ratio.
+        int height = int(image_width / aspect_ratio);
+        return (height < 1) ? 1 : height;
+    }
+
+    std::vector<ray> record_rays(const hittable& world, size_t count) {
+        // Returns `count` rays distributed as the renderer traces them: camera rays through
+        // random pixels, each followed by its scattered bounces. Used to feed the kernel
+        // benchmarks with realistic ray batches.
+        init();
+
+        std::vector<ray> rays;
+        rays.reserve(count);
+        while (rays.size() < count) {
+            int i = int(random_double() * image_width);
+            int j = int(random_double() * image_height);
+            ray r = (this->*kernel.generate_ray)(i, j);
+
+            for (int depth = 0; depth < max_depth && rays.size() < count; depth++) {
+                rays.push_back(r);
+
+                hit_record rec;
+                ray scattered;
+                color attenuation;
+                if (!world.hit(r, interval(0.001, infinity), rec)
+                    || !rec.mat->scatter(r, rec, attenuation, scattered))
+                    break;
+                r = scattered;
             }
         }
-
-        std::clog << "\rDone.                 \n";
+        return rays;
     }
 
   private:
@@ -50,10 +269,24 @@ class camera {
     vec3   u, v, w;              // Camera coordinate frame basis vectors
     vec3   defocus_disk_u;       // Defocus disk horizontal radius
     vec3   defocus_disk_v;       // Defocus disk vertical radius
+    double pixel_spread;         // Spread angle of camera ray cones
+    const light_tree* sampled_lights = nullptr;  // Lights sampled at diffuse hits, if any
+
+    struct scatter_origin {
+        // A hit that sampled the lights, and the density with which it scattered its ray.
+        point3 p;
+        vec3 normal;
+        double pdf;
+    };
+
+    static render_stats& thread_stats() {
+        // Counters of the calling render thread, folded into `stats` when the thread finishes.
+        thread_local render_stats counts;
+        return counts;
+    }
 
     void init() {
-        image_height = int(image_width / aspect_ratio);
-        image_height = (image_height < 1) ? 1 : image_height;
+        image_height = height();
 
         pixel_samples_scale = 1.0 / samples_per_pixel;
         cam_center = lookfrom;
@@ -76,6 +309,9 @@ class camera {
         // Calculate pixel deltas
         pixel_delta_u = viewport_u / image_width;
         pixel_delta_v = viewport_v / image_height;
+        // Cones are half a pixel wide: jittering samples across the pixel already does the
+        // rest of the filtering, and a full-pixel cone would blur twice.
+        pixel_spread = 0.5 * pixel_delta_v.length() / focus_dist;
 
         // Calculate upper left pixel location
         auto viewport_top_left = cam_center - (focus_dist * w) - viewport_u/2 - viewport_v/2;
@@ -85,21 +321,390 @@ class camera {
         auto defocus_radius = focus_dist * std::tan(degrees_to_radians(defocus_angle / 2));
         defocus_disk_u = u * defocus_radius;
         defocus_disk_v = v * defocus_radius;
+
+        kernel = pick_kernel();
+    }
+
+    struct sample_sums {
+        // Sums of the samples of each pixel of `rect`, one tile of the image clipped to its
+        // edges, row by row. The pixels are only allocated while the tile is being traced.
+        pixel_rect rect;
+        std::vector<color> pixels;
+        std::once_flag allocated;
+
+        color& at(int i, int j) { return pixels[size_t(j - rect.y) * rect.width + (i - rect.x)]; }
+    };
+
+    struct render_kernel {
+        // The per-sample code of a render, compiled for one combination of features.
+        void (camera::*render_block)(const hittable&, int, int, sample_sums&);
+        ray  (camera::*generate_ray)(int, int) const;
+    };
+    render_kernel kernel;        // Picked by init for the features of the render
+
+    template <bool DefocusBlur, bool MotionBlur, bool TextureFiltering>
+    static constexpr render_kernel kernel_for() {
+        return { &camera::render_block<DefocusBlur, MotionBlur, TextureFiltering>,
+                 &camera::generate_ray<DefocusBlur, MotionBlur, TextureFiltering> };
     }
 
+    render_kernel pick_kernel() const {
+        // Features are tested once here rather than for every camera ray, and the kernels
+        // without them do none of their work.
+        static constexpr render_kernel kernels[] = {
+            kernel_for<false, false, false>(), kernel_for<false, false, true>(),
+            kernel_for<false, true,  false>(), kernel_for<false, true,  true>(),
+            kernel_for<true,  false, false>(), kernel_for<true,  false, true>(),
+            kernel_for<true,  true,  false>(), kernel_for<true,  true,  true>(),
+        };
+        return kernels[(defocus_angle > 0 ? 4 : 0) | (motion_blur ? 2 : 0)
+                       | (texture_filtering ? 1 : 0)];
+    }
+
+    struct tile_grid {
+        // The tiles of the image, whole blocks on a side, and the blocks to trace in each:
+        // those that overlap the rendered regions, in raster order.
+        int blocks_x, tile_blocks, tiles_x;
+        std::vector<pixel_rect> rects;          // Each tile, clipped to the image
+        std::vector<std::vector<int>> blocks;   // Block indices, row by row over the image
+
+        int tile_of(int b) const { return (b / blocks_x) / tile_blocks * tiles_x + (b % blocks_x) / tile_blocks; }
+    };
+
+    tile_grid plan_tiles() const {
+        // Only the blocks that overlap the rendered regions are traced, in whole. Blocks keep
+        // their index in the whole image, and with it their random sequence, so the pixels of
+        // a window or region match those of a full render exactly and can be composited into
+        // it without seams.
+        const int block = ray_packet::width;
+        const int blocks_x = (image_width + block - 1) / block;
+        const int blocks_y = (image_height + block - 1) / block;
+
+        std::vector<char> traced(size_t(blocks_x) * blocks_y, 0);
+        for (const auto& part : rendered_regions()) {
+            if (part.empty())
+                continue;
+            for (int by = part.y / block; by * block < part.y + part.height; by++)
+                for (int bx = part.x / block; bx * block < part.x + part.width; bx++)
+                    traced[size_t(by) * blocks_x + bx] = 1;
+        }
+
+        tile_grid grid;
+        grid.blocks_x = blocks_x;
+        grid.tile_blocks = std::max(1, (tile_size + block - 1) / block);
+        grid.tiles_x = (blocks_x + grid.tile_blocks - 1) / grid.tile_blocks;
+        const int tiles_y = (blocks_y + grid.tile_blocks - 1) / grid.tile_blocks;
+        const int edge = grid.tile_blocks * block;
+        for (int t = 0; t < grid.tiles_x * tiles_y; t++) {
+            grid.rects.push_back(pixel_rect { (t % grid.tiles_x) * edge, (t / grid.tiles_x) * edge,
+                                              edge, edge }.intersect(
+                                 pixel_rect { 0, 0, image_width, image_height }));
+        }
+        grid.blocks.resize(grid.rects.size());
+        for (int b = 0; b < int(traced.size()); b++)
+            if (traced[b])
+                grid.blocks[grid.tile_of(b)].push_back(b);
+        return grid;
+    }
+
+    int thread_count() const {
+        return std::max(1, (threads > 0) ? threads : int(std::thread::hardware_concurrency()));
+    }
+
+    void render_sums(const hittable& world, const light_tree* lights, const tile_callback& on_tile) {
+        // Traces the blocks that overlap the rendered regions, as render_image describes,
+        // handing each tile to `on_tile` as soon as it is finished.
+        init();
+        sampled_lights = (light_sampling && lights && !lights->empty()) ? lights : nullptr;
+        auto start_time = std::chrono::steady_clock::now();
+        stats = render_stats();
+        std::mutex stats_mutex;
+
+        const bool recording = traversal_stats_enabled && record_traversal;
+        pixel_traversal.assign(recording ? size_t(image_width) * image_height : 0,
+                               traversal_counts());
+        const int block = ray_packet::width;
+        const auto parts = rendered_regions();
+        const auto grid = plan_tiles();
+        const int tile_count = int(grid.rects.size());
+        const int threads_used = thread_count();
+
+        // Sums are kept per tile. A tile's sums are allocated by the first block traced in it
+        // and freed once it has been handed on, so only the tiles being traced are held at a
+        // time, whatever the size of the image. Each tile counts down its unfinished blocks,
+        // and the thread that finishes the last one hands the tile on.
+        std::vector<sample_sums> tiles(tile_count);
+        std::vector<std::atomic<int>> unfinished_blocks(tile_count);
+        int tiles_traced = 0;
+        for (int t = 0; t < tile_count; t++) {
+            tiles[t].rect = grid.rects[t];
+            unfinished_blocks[t] = int(grid.blocks[t].size());
+            tiles_traced += !grid.blocks[t].empty();
+        }
+
+        // The work is a list of runs of blocks that threads take in turn from a shared counter.
+        // In raster order each run is a single block, which already leaves little for threads
+        // to wait on at the end. Ordered by cost, the runs are whole tiles, the most expensive
+        // first, with the hottest tiles split into several runs, so that the last runs taken
+        // are short; this keeps fewer tiles in flight than raster order, where a whole row of
+        // tiles is open at once.
+        std::vector<int> blocks;
+        std::vector<int> run_ends;
+        std::vector<double> predicted(tile_count, 0);
+        bool by_cost = cost_ordering && threads_used > 1;
+
+        if (!by_cost) {
+            for (int t = 0; t < tile_count; t++)
+                blocks.insert(blocks.end(), grid.blocks[t].begin(), grid.blocks[t].end());
+            std::sort(blocks.begin(), blocks.end());
+            for (int b = 1; b <= int(blocks.size()); b++)
+                run_ends.push_back(b);
+        } else {
+            predicted = prepass(world, grid, threads_used);
+            std::vector<int> order;
+            double total_cost = 0;
+            for (int t = 0; t < tile_count; t++) {
+                if (!grid.blocks[t].empty())
+                    order.push_back(t);
+                total_cost += predicted[t];
+            }
+            std::stable_sort(order.begin(), order.end(),
+                             [&](int a, int b) { return predicted[a] > predicted[b]; });
+
+            auto run_cost = total_cost / (threads_used * 8);
+            for (auto t : order) {
+                const auto& tile_list = grid.blocks[t];
+                int count = int(tile_list.size());
+                int runs = run_cost > 0 ? int(std::ceil(predicted[t] / run_cost)) : 1;
+                runs = std::clamp(runs, 1, count);
+                for (int r = 0; r < runs; r++) {
+                    blocks.insert(blocks.end(), tile_list.begin() + r * count / runs,
+                                  tile_list.begin() + (r + 1) * count / runs);
+                    run_ends.push_back(int(blocks.size()));
+                }
+            }
+        }
+        const int run_count = int(run_ends.size());
+        const int first_col = blocks.empty() ? 0 : (blocks[0] % grid.blocks_x) * block;
+        const int last_row = blocks.empty() ? 0 : (blocks.back() / grid.blocks_x + 1) * block;
+
+        std::vector<std::atomic<std::int64_t>> tile_nanoseconds(tile_count);
+        std::vector<std::chrono::steady_clock::time_point> finish_times(threads_used);
+        std::atomic<int> tiles_left(tiles_traced);
+
+        // Each block reseeds the generator from its own index, so the image does not depend
+        // on the thread count or on the order of the blocks.
+        std::atomic<int> next_run(0);
+        run_threads(threads_used, [&](int thread) {
+            thread_stats() = render_stats();
+
+            for (int run = next_run++; run < run_count; run = next_run++) {
+                auto run_start = std::chrono::steady_clock::now();
+                int t = -1;
+
+                for (int next = run > 0 ? run_ends[run - 1] : 0; next < run_ends[run]; next++) {
+                    int b = blocks[next];
+                    int col = (b % grid.blocks_x) * block;
+                    int row = (b / grid.blocks_x) * block;
+                    if (thread == 0 && !by_cost && col == first_col)
+                        std::clog << "\rScanlines remaining: " << (last_row - row) << ' ' << std::flush;
+
+                    t = grid.tile_of(b);
+                    auto& sums = tiles[t];
+                    std::call_once(sums.allocated, [&] {
+                        sums.pixels.assign(size_t(sums.rect.width) * sums.rect.height, color(0,0,0));
+                    });
+
+                    seed_random(seed * 0x9e3779b97f4a7c15ULL + std::uint64_t(b));
+                    (this->*kernel.render_block)(world, col, row, sums);
+
+                    if (--unfinished_blocks[t] == 0) {
+                        auto tile = make_tile(sums, parts);
+                        sums.pixels = std::vector<color>();
+                        int left = --tiles_left;
+                        on_tile(tile);
+                        if (thread == 0 && by_cost)
+                            std::clog << "\rTiles remaining: " << left << "   " << std::flush;
+                    }
+                }
+
+                // Runs never span tiles, so the whole run is charged to the tile of its blocks.
+                tile_nanoseconds[t] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - run_start).count();
+            }
+            finish_times[thread] = std::chrono::steady_clock::now();
+
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            stats.primary_rays += thread_stats().primary_rays;
+            stats.total_rays += thread_stats().total_rays;
+        });
+
+        auto end_time = std::chrono::steady_clock::now();
+        stats.seconds = std::chrono::duration<double>(end_time - start_time).count();
+        stats.tail_seconds = std::chrono::duration<double>(
+            end_time - *std::min_element(finish_times.begin(), finish_times.end())).count();
+
+        tile_timings.clear();
+        for (int t = 0; t < tile_count; t++) {
+            if (!grid.blocks[t].empty())
+                tile_timings.push_back({ grid.rects[t], predicted[t], tile_nanoseconds[t] * 1e-9 });
+        }
+        std::clog << "\rDone.                 \n";
+    }
+
+    std::vector<double> prepass(const hittable& world, const tile_grid& grid, int threads_used) {
+        // Estimates the cost of each tile by timing a single sample through the middle pixel
+        // of each of its blocks: a sixteenth of the pixels at one sample each. The prepass
+        // draws from random sequences of its own, so the render is unchanged.
+        auto start_time = std::chrono::steady_clock::now();
+        const int block = ray_packet::width;
+        std::vector<double> costs(grid.rects.size(), 0);
+
+        std::atomic<int> next_tile(0);
+        run_threads(threads_used, [&](int) {
+            for (int t = next_tile++; t < int(costs.size()); t = next_tile++) {
+                if (grid.blocks[t].empty())
+                    continue;
+                seed_random(~seed * 0x9e3779b97f4a7c15ULL + std::uint64_t(t));
+                auto tile_start = std::chrono::steady_clock::now();
+                for (auto b : grid.blocks[t]) {
+                    int i = std::min((b % grid.blocks_x) * block + block / 2, image_width - 1);
+                    int j = std::min((b / grid.blocks_x) * block + block / 2, image_height - 1);
+                    trace_ray((this->*kernel.generate_ray)(i, j), max_depth, world);
+                }
+                costs[t] = std::chrono::duration<double>(std::chrono::steady_clock::now() - tile_start).count();
+            }
+        });
+
+        stats.prepass_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        return costs;
+    }
+
+    static void run_threads(int thread_count, const std::function<void(int)>& work) {
+        // Runs `work` on thread_count threads, the calling thread being thread 0, and waits
+        // for all of them.
+        std::vector<std::thread> workers;
+        for (int t = 1; t < thread_count; t++)
+            workers.emplace_back(work, t);
+        work(0);
+        for (auto& w : workers)
+            w.join();
+    }
+
+    image_tile make_tile(sample_sums& sums, const std::vector<pixel_rect>& parts) const {
+        // Copies the averaged pixels of a tile that lie in the rendered parts of the image out
+        // of its sample sums. The tile is clipped to the window, and its other pixels are black.
+        auto rect = window.empty() ? sums.rect : sums.rect.intersect(window);
+        image_tile tile { rect.x, rect.y, rect.width, rect.height, {} };
+        tile.pixels.assign(size_t(tile.width) * tile.height, color(0,0,0));
+        for (const auto& part : parts) {
+            auto overlap = part.intersect(rect);
+            for (int j = overlap.y; j < overlap.y + overlap.height; j++)
+                for (int i = overlap.x; i < overlap.x + overlap.width; i++)
+                    tile.pixels[size_t(j - rect.y) * rect.width + (i - rect.x)]
+                        = pixel_samples_scale * sums.at(i, j);
+        }
+        return tile;
+    }
+
+    template <bool DefocusBlur, bool MotionBlur, bool TextureFiltering>
+    void render_block(const hittable& world, int i0, int j0, sample_sums& sums) {
+        // Render the block of pixels whose top-left corner is i0,j0 into the sums of its tile.
+        const int block = ray_packet::width;
+        const int i1 = std::min(i0 + block, image_width);
+        const int j1 = std::min(j0 + block, image_height);
+
+        thread_stats().primary_rays += std::uint64_t(i1 - i0) * (j1 - j0) * samples_per_pixel;
+
+        // Counters are only read in builds that keep them; elsewhere this is all constant false.
+        const bool recording = traversal_stats_enabled && record_traversal;
+
+        if (!packet_tracing || max_depth <= 0 || recording) {
+            for (int j = j0; j < j1; j++) {
+                for (int i = i0; i < i1; i++) {
+                    traversal_counts counts_before;
+                    if constexpr (traversal_stats_enabled) {
+                        if (record_traversal)
+                            counts_before = traversal_counters();
+                    }
+                    color pixel_color(0,0,0);
+                    for (int s = 0; s < samples_per_pixel; s++) {
+                        ray r = generate_ray<DefocusBlur, MotionBlur, TextureFiltering>(i, j);
+                        pixel_color += trace_ray(r, max_depth, world);
+                    }
+                    sums.at(i, j) = pixel_color;
+                    if constexpr (traversal_stats_enabled) {
+                        if (record_traversal)
+                            pixel_traversal[j*image_width + i] = traversal_counters() - counts_before;
+                    }
+                }
+            }
+            return;
+        }
+
+        // Trace one sample of every pixel in the block together, so the primary rays share
+        // their walk through the acceleration structure. Bounces are then traced ray by ray.
+        ray_packet packet;
+        hit_record recs[ray_packet::size];
+        color block_colors[ray_packet::size];
+
+        for (int s = 0; s < samples_per_pixel; s++) {
+            generate_packet<DefocusBlur, MotionBlur, TextureFiltering>(i0, j0, packet);
+            auto hits = world.hit_packet(packet, packet.valid, recs);
+            thread_stats().total_rays += std::uint64_t(i1 - i0) * (j1 - j0);
+
+            for (int lane = 0; lane < ray_packet::size; lane++) {
+                auto bit = ray_packet::lane_bit(lane);
+                if (!(packet.valid & bit))
+                    continue;
+
+                block_colors[lane] += (hits & bit)
+                    ? shade(packet.rays[lane], recs[lane], max_depth, world)
+                    : missed(packet.rays[lane]);
+            }
+        }
+
+        for (int j = j0; j < j1; j++)
+            for (int i = i0; i < i1; i++)
+                sums.at(i, j) = block_colors[(j-j0)*block + (i-i0)];
+    }
+
+    template <bool DefocusBlur, bool MotionBlur, bool TextureFiltering>
+    void generate_packet(int i0, int j0, ray_packet& packet) const {
+        // Generate one camera ray for each pixel of the block whose top-left corner is i0,j0.
+        // Lanes falling outside the image are left invalid.
+        packet_mask lanes = 0;
+        for (int dj = 0; dj < ray_packet::width; dj++) {
+            for (int di = 0; di < ray_packet::width; di++) {
+                int lane = dj*ray_packet::width + di;
+                if (i0 + di >= image_width || j0 + dj >= image_height)
+                    continue;
+
+                packet.rays[lane] = generate_ray<DefocusBlur, MotionBlur, TextureFiltering>(i0 + di, j0 + dj);
+                lanes |= ray_packet::lane_bit(lane);
+            }
+        }
+        packet.prepare(lanes);
+    }
+
+    template <bool DefocusBlur, bool MotionBlur, bool TextureFiltering>
     ray generate_ray(int i, int j) const {
-        // Generate a camera ray for pixel at location i,j with random sampling
+        // Generate a camera ray for pixel at location i,j with random sampling. Without motion
+        // blur every ray is at time 0, and without texture filtering rays have no cone.
 
         auto offset = random_in_square();
         auto pixel_sample = first_pixel_loc
                           + ((i + offset.x()) * pixel_delta_u)
                           + ((j + offset.y()) * pixel_delta_v);
 
-        auto ray_origin = (defocus_angle <= 0) ? cam_center : sample_defocus_disk();
+        auto ray_origin = DefocusBlur ? sample_defocus_disk() : cam_center;
         auto ray_direction = pixel_sample - ray_origin;
-        auto ray_time = random_double();
+        auto ray_time = MotionBlur ? random_double() : 0.0;
 
-        return ray(ray_origin, ray_direction, ray_time);
+        ray r(ray_origin, ray_direction, ray_time);
+        if constexpr (TextureFiltering)
+            r.set_cone(0, pixel_spread);
+        return r;
     }
 
     vec3 random_in_square() const {
@@ -113,28 +718,94 @@ class camera {
         return cam_center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 
-    color trace_ray(const ray& r, int depth, const hittable& world) const {
+    color trace_ray(const ray& r, int depth, const hittable& world,
+                    const scatter_origin* from = nullptr) const {
+        // from is set when the ray was scattered from a hit that sampled the lights directly.
+
         // Return black if we've exceeded the ray bounce limit
         if (depth <= 0)
             return color(0,0,0);
 
         hit_record rec;
+        thread_stats().total_rays++;
+        RTW_COUNT(path_length);
 
         // If ray doesn't hit anything, return background color
         if (!world.hit(r, interval(0.001, infinity), rec))
+            return missed(r, from);
+
+        return shade(r, rec, depth, world, from);
+    }
+
+    color missed(const ray& r, const scatter_origin* from = nullptr) const {
+        // Light arriving along a ray that leaves the world. The environment, when sampled as a
+        // light from where the ray scattered, takes its multiple importance sampling weight.
+        if (!environment)
             return background;
 
+        auto emission = environment->emitted(r.direction());
+        if (from)
+            emission *= power_heuristic(from->pdf, sampled_lights->environment_pdf(r.direction()));
+        return emission;
+    }
+
+    color shade(const ray& r, const hit_record& rec, int depth, const hittable& world,
+                const scatter_origin* from = nullptr) const {
+        // Return the color carried back along ray r from its hit point rec
         ray scattered;
         color attenuation;
+
         color color_emitted = rec.mat->emitted(rec.u, rec.v, rec.p);
 
+        // A sampled light found by scattering from a hit that also sampled the lights takes
+        // its multiple importance sampling weight.
+        int light = rec.mat->light_index();
+        if (from && light >= 0) {
+            auto light_pdf = sampled_lights->pdf(light, from->p, from->normal, rec.p);
+            color_emitted *= power_heuristic(from->pdf, light_pdf);
+        }
+
         // If material doesn't scatter light, return only emitted color
         if (!rec.mat->scatter(r, rec, attenuation, scattered))
             return color_emitted;
 
-        color color_scattered = attenuation * trace_ray(scattered, depth-1, world);
+        // Sampled light stands in for the next bounce, so there must be one left.
+        if (!(sampled_lights && depth > 1 && rec.mat->diffuse()))
+            return color_emitted + attenuation * trace_ray(scattered, depth-1, world);
+
+        scatter_origin here { rec.p, rec.normal, rec.mat->scattering_pdf(rec, scattered.direction()) };
+        color incoming = direct_light(r, rec, world) + trace_ray(scattered, depth-1, world, &here);
+
+        return color_emitted + attenuation * incoming;
+    }
+
+    static double power_heuristic(double pdf, double other_pdf) {
+        auto a = pdf * pdf, b = other_pdf * other_pdf;
+        return a / (a + b);
+    }
+
+    color direct_light(const ray& r, const hit_record& rec, const hittable& world) const {
+        // Light arriving at a diffuse hit straight from one light picked by the light tree,
+        // weighted by the material's scattering density and by multiple importance sampling
+        // against finding the same light by scattering. Multiplied by the attenuation, it
+        // estimates the directly reflected light.
+        light_sample light;
+        if (!sampled_lights->sample(rec.p, rec.normal, light))
+            return color(0,0,0);
+
+        ray shadow(rec.p, light.direction, r.time());
+        auto density = rec.mat->scattering_pdf(rec, shadow.direction());
+        if (density <= 0)
+            return color(0,0,0);
+
+        // Media along the way dim the light rather than block it, so the estimate is smooth
+        // where a drawn visibility would be noisy.
+        thread_stats().total_rays++;
+        auto visible = world.transmittance(shadow, interval(0.001, light.t_max));
+        if (visible <= 0)
+            return color(0,0,0);
 
-        return color_emitted + color_scattered;
+        return visible * light.emission * (density / light.pdf * power_heuristic(light.pdf, density));
     }
 };
 
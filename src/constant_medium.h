@@ -3,63 +3,84 @@
 
 #include "hittable.h"
 #include "material.h"
+#include "medium.h"
 #include "texture.h"
 
+// A convex boundary filled with a participating medium. Rays that scatter inside it hit a
+// point in the volume with an isotropic phase function. The medium is homogeneous unless one
+// is given.
 class constant_medium : public hittable {
 public:
     constant_medium(shared_ptr<hittable> boundary, double density, shared_ptr<texture> tex)
-      : boundary(boundary), neg_inv_density(-1.0/density),
+      : boundary(boundary), fill(make_shared<homogeneous_medium>(density)),
         phase_mat(make_shared<isotropic>(tex))
     {}
 
     constant_medium(shared_ptr<hittable> boundary, double density, const color& albedo)
-      : boundary(boundary), neg_inv_density(-1.0/density),
+      : boundary(boundary), fill(make_shared<homogeneous_medium>(density)),
         phase_mat(make_shared<isotropic>(albedo))
     {}
 
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        hit_record entry_rec, exit_rec;
-
-        // Find where ray enters the boundary
-        if (!boundary->hit(r, interval::universe, entry_rec))
-            return false;
-
-        // Find where ray exits the boundary
-        if (!boundary->hit(r, interval(entry_rec.t + 0.0001, infinity), exit_rec))
-            return false;
-
-        // Clamp to valid ray interval
-        if (entry_rec.t < ray_t.min) entry_rec.t = ray_t.min;
-        if (exit_rec.t > ray_t.max) exit_rec.t = ray_t.max;
-
-        if (entry_rec.t >= exit_rec.t)
-            return false;
-
-        if (entry_rec.t < 0)
-            entry_rec.t = 0;
-
-        auto ray_len = r.direction().length();
-        auto dist_in_medium = (exit_rec.t - entry_rec.t) * ray_len;
-        auto scatter_dist = neg_inv_density * std::log(random_double());
+    constant_medium(shared_ptr<hittable> boundary, shared_ptr<medium> fill,
+                    shared_ptr<texture> tex)
+      : boundary(boundary), fill(fill), phase_mat(make_shared<isotropic>(tex))
+    {}
 
-        if (scatter_dist > dist_in_medium)
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        interval span;
+        if (!inside_span(r, ray_t, span) || !fill->sample_scatter(r, span, rec.t))
             return false;
 
-        rec.t = entry_rec.t + scatter_dist / ray_len;
         rec.p = r.at(rec.t);
-        rec.normal = vec3(1, 0, 0);  // arbitrary direction
+        rec.normal = vec3(0, 0, 0);  // points in a volume have no surface normal
         rec.front_face = true;
+        rec.footprint = 0;
         rec.mat = phase_mat;
 
         return true;
     }
 
+    bool occluded(const ray& r, interval ray_t) const override {
+        // A ray is blocked where it would scatter, which is drawn just as hit draws it, so
+        // visibility tests see the medium as the rays that scatter off it do.
+        interval span;
+        double t;
+        return inside_span(r, ray_t, span) && fill->sample_scatter(r, span, t);
+    }
+
+    double transmittance(const ray& r, interval ray_t) const override {
+        // The medium's estimate of the fraction of light that crosses it, which shadow rays
+        // weight the light by instead of drawing whether it gets through.
+        interval span;
+        return inside_span(r, ray_t, span) ? fill->transmittance(r, span) : 1;
+    }
+
     aabb bounding_box() const override { return boundary->bounding_box(); }
 
+    aabb bounding_box_at(double time) const override { return boundary->bounding_box_at(time); }
+
 private:
     shared_ptr<hittable> boundary;
-    double neg_inv_density;
+    shared_ptr<medium> fill;
     shared_ptr<material> phase_mat;
+
+    bool inside_span(const ray& r, interval ray_t, interval& span) const {
+        // Find where the ray enters and exits the boundary, in one traversal
+        if (!boundary->hit_span(r, span))
+            return false;
+
+        // Clamp to valid ray interval
+        if (span.min < ray_t.min) span.min = ray_t.min;
+        if (span.max > ray_t.max) span.max = ray_t.max;
+
+        if (span.min >= span.max)
+            return false;
+
+        if (span.min < 0)
+            span.min = 0;
+
+        return true;
+    }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,274 @@
+#ifndef DENSITY_GRID_H
+#define DENSITY_GRID_H
+
+#include "medium.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Density volume files
+//
+// A volume file starts with one text line, "rtwvol <nx> <ny> <nz> <u8|f32>", followed right
+// after its newline by nx * ny * nz voxels, x varying fastest and then y. u8 voxels are bytes
+// mapped to densities 0 to 1; f32 voxels are native-endian floats.
+
+// A voxel grid of densities stretched over a box, stored sparsely in bricks of 8x8x8 voxels.
+// Bricks whose voxels are all zero take no memory. Every brick keeps the largest density that
+// interpolation can produce inside it, and tracking steps through the bricks along the ray with
+// a 3D DDA, skipping empty bricks and sampling the others against their own majorant.
+class density_grid : public medium {
+public:
+    static const int brick_size = 8;
+
+    // `voxels` holds nx * ny * nz densities, x fastest; each is multiplied by `scale`. Voxel
+    // samples sit at the centers of the cells they divide the box into.
+    density_grid(int nx, int ny, int nz, const std::vector<float>& voxels, const point3& min,
+                 const point3& max, double scale)
+      : origin(min)
+    {
+        int size[3] = { nx, ny, nz };
+        for (int a = 0; a < 3; a++) {
+            voxel_count[a] = std::max(size[a], 1);
+            brick_count[a] = (voxel_count[a] + brick_size - 1) / brick_size;
+            voxel_size[a] = (max[a] - min[a]) / voxel_count[a];
+        }
+
+        auto voxel = [&](int x, int y, int z) {
+            return float(scale * voxels[(size_t(z) * ny + y) * nx + x]);
+        };
+
+        // Store the bricks that hold any density.
+        brick_slots.assign(size_t(brick_count[0]) * brick_count[1] * brick_count[2], -1);
+        for (int bz = 0; bz < brick_count[2]; bz++)
+            for (int by = 0; by < brick_count[1]; by++)
+                for (int bx = 0; bx < brick_count[0]; bx++) {
+                    float brick[brick_size * brick_size * brick_size] = {};
+                    bool occupied = false;
+                    for (int z = 0; z < brick_size; z++)
+                        for (int y = 0; y < brick_size; y++)
+                            for (int x = 0; x < brick_size; x++) {
+                                int vx = bx * brick_size + x;
+                                int vy = by * brick_size + y;
+                                int vz = bz * brick_size + z;
+                                if (vx >= nx || vy >= ny || vz >= nz)
+                                    continue;
+                                auto value = voxel(vx, vy, vz);
+                                brick[(z * brick_size + y) * brick_size + x] = value;
+                                occupied |= value != 0;
+                            }
+
+                    if (occupied) {
+                        brick_slots[brick_index(bx, by, bz)] = std::int32_t(bricks.size() / brick_volume);
+                        bricks.insert(bricks.end(), brick, brick + brick_volume);
+                    }
+                }
+
+        // A point inside a brick interpolates between voxels up to one voxel beyond the brick's
+        // edges, so each majorant covers that border too.
+        brick_majorants.assign(brick_slots.size(), 0);
+        for (int bz = 0; bz < brick_count[2]; bz++)
+            for (int by = 0; by < brick_count[1]; by++)
+                for (int bx = 0; bx < brick_count[0]; bx++) {
+                    float largest = 0;
+                    for (int z = bz * brick_size - 1; z <= (bz + 1) * brick_size; z++)
+                        for (int y = by * brick_size - 1; y <= (by + 1) * brick_size; y++)
+                            for (int x = bx * brick_size - 1; x <= (bx + 1) * brick_size; x++)
+                                largest = std::max(largest, stored_voxel(x, y, z));
+                    brick_majorants[brick_index(bx, by, bz)] = largest;
+                    max_density = std::max(max_density, double(largest));
+                }
+    }
+
+    double density(const point3& p) const override {
+        // Trilinear interpolation between the voxel centers around p.
+        double f[3];
+        int c[3];
+        for (int a = 0; a < 3; a++) {
+            auto x = (p[a] - origin[a]) / voxel_size[a] - 0.5;
+            auto base = std::floor(x);
+            c[a] = int(base);
+            f[a] = x - base;
+        }
+
+        auto value = 0.0;
+        for (int dz = 0; dz < 2; dz++)
+            for (int dy = 0; dy < 2; dy++)
+                for (int dx = 0; dx < 2; dx++) {
+                    auto weight = (dx ? f[0] : 1 - f[0]) * (dy ? f[1] : 1 - f[1]) * (dz ? f[2] : 1 - f[2]);
+                    value += weight * stored_voxel(c[0] + dx, c[1] + dy, c[2] + dz);
+                }
+        return value;
+    }
+
+    double majorant() const override { return max_density; }
+
+    bool sample_scatter(const ray& r, interval span, double& t) const override {
+        // Delta tracking, brick by brick. Free flights are memoryless, so restarting the
+        // flight at each brick boundary with the next brick's majorant stays unbiased.
+        auto step = -1.0 / r.direction().length();
+        bool scattered = false;
+        march(r, span, [&](double t0, double t1, double sigma) {
+            if (sigma <= 0)
+                return false;
+            t = t0;
+            while (true) {
+                t += step / sigma * std::log(random_double());
+                if (t >= t1)
+                    return false;
+                if (random_double() * sigma < density(r.at(t)))
+                    return scattered = true;
+            }
+        });
+        return scattered;
+    }
+
+    double transmittance(const ray& r, interval span) const override {
+        // Ratio tracking, brick by brick.
+        auto step = -1.0 / r.direction().length();
+        auto fraction = 1.0;
+        march(r, span, [&](double t0, double t1, double sigma) {
+            if (sigma <= 0)
+                return false;
+            auto t = t0;
+            while (true) {
+                t += step / sigma * std::log(random_double());
+                if (t >= t1)
+                    return false;
+                fraction *= 1 - density(r.at(t)) / sigma;
+                if (fraction <= 0) {
+                    fraction = 0;
+                    return true;
+                }
+            }
+        });
+        return fraction;
+    }
+
+    size_t occupied_bricks() const { return bricks.size() / brick_volume; }
+    size_t total_bricks() const { return brick_slots.size(); }
+    size_t resident_bytes() const {
+        return bricks.size() * sizeof(float) + brick_slots.size() * sizeof(std::int32_t)
+             + brick_majorants.size() * sizeof(float);
+    }
+
+private:
+    static const int brick_volume = brick_size * brick_size * brick_size;
+
+    point3 origin;
+    double voxel_size[3];
+    int voxel_count[3];
+    int brick_count[3];
+    double max_density = 0;
+    std::vector<std::int32_t> brick_slots;   // Per brick: index into bricks, or -1 if empty
+    std::vector<float> bricks;               // Voxels of the occupied bricks, brick after brick
+    std::vector<float> brick_majorants;      // Per brick: largest interpolated density in it
+
+    size_t brick_index(int bx, int by, int bz) const {
+        return (size_t(bz) * brick_count[1] + by) * brick_count[0] + bx;
+    }
+
+    float stored_voxel(int x, int y, int z) const {
+        // Voxels past the edges repeat the edge voxels.
+        x = std::clamp(x, 0, voxel_count[0] - 1);
+        y = std::clamp(y, 0, voxel_count[1] - 1);
+        z = std::clamp(z, 0, voxel_count[2] - 1);
+
+        auto slot = brick_slots[brick_index(x / brick_size, y / brick_size, z / brick_size)];
+        if (slot < 0)
+            return 0;
+        int lx = x % brick_size, ly = y % brick_size, lz = z % brick_size;
+        return bricks[size_t(slot) * brick_volume + (lz * brick_size + ly) * brick_size + lx];
+    }
+
+    template <typename Visit>
+    void march(const ray& r, interval span, Visit visit) const {
+        // Walks the bricks the ray crosses within span, in order, calling
+        // visit(t0, t1, majorant) for each until it returns true.
+        double origin_b[3], dir_b[3], next_t[3], delta_t[3];
+        int cell[3], step[3];
+        for (int a = 0; a < 3; a++) {
+            // Ray in brick coordinates
+            auto brick_width = voxel_size[a] * brick_size;
+            origin_b[a] = (r.origin()[a] - origin[a]) / brick_width;
+            dir_b[a] = r.direction()[a] / brick_width;
+
+            auto entry = origin_b[a] + span.min * dir_b[a];
+            cell[a] = std::clamp(int(std::floor(entry)), 0, brick_count[a] - 1);
+
+            if (dir_b[a] > 0) {
+                step[a] = 1;
+                next_t[a] = (cell[a] + 1 - origin_b[a]) / dir_b[a];
+                delta_t[a] = 1 / dir_b[a];
+            } else if (dir_b[a] < 0) {
+                step[a] = -1;
+                next_t[a] = (cell[a] - origin_b[a]) / dir_b[a];
+                delta_t[a] = -1 / dir_b[a];
+            } else {
+                step[a] = 0;
+                next_t[a] = infinity;
+                delta_t[a] = infinity;
+            }
+        }
+
+        auto t = span.min;
+        while (t < span.max) {
+            int axis = (next_t[0] < next_t[1])
+                     ? (next_t[0] < next_t[2] ? 0 : 2)
+                     : (next_t[1] < next_t[2] ? 1 : 2);
+            auto t_exit = std::fmin(next_t[axis], span.max);
+
+            if (t_exit > t && visit(t, t_exit, double(brick_majorants[brick_index(cell[0], cell[1], cell[2])])))
+                return;
+
+            cell[axis] += step[axis];
+            if (cell[axis] < 0 || cell[axis] >= brick_count[axis])
+                return;
+            t = t_exit;
+            next_t[axis] += delta_t[axis];
+        }
+    }
+};
+
+inline shared_ptr<density_grid> load_density_grid(
+    const std::string& filename, const point3& min, const point3& max, double scale
+) {
+    // Reads a volume file and stretches it over the box from min to max. Throws
+    // std::runtime_error if the file cannot be read or is malformed.
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open())
+        throw std::runtime_error("cannot open '" + filename + "'");
+
+    std::string header;
+    std::getline(in, header);
+    std::istringstream fields(header);
+    std::string magic, format;
+    long long nx = 0, ny = 0, nz = 0;
+    fields >> magic >> nx >> ny >> nz >> format;
+    if (!fields || magic != "rtwvol" || (format != "u8" && format != "f32"))
+        throw std::runtime_error("'" + filename + "' is not a volume file");
+    if (nx < 1 || ny < 1 || nz < 1 || nx * ny * nz > (1ll << 32))
+        throw std::runtime_error("'" + filename + "' has bad dimensions");
+
+    auto count = size_t(nx * ny * nz);
+    std::vector<float> voxels(count);
+    if (format == "u8") {
+        std::vector<unsigned char> bytes(count);
+        in.read(reinterpret_cast<char*>(bytes.data()), std::streamsize(count));
+        for (size_t i = 0; i < count; i++)
+            voxels[i] = bytes[i] / 255.0f;
+    } else {
+        in.read(reinterpret_cast<char*>(voxels.data()), std::streamsize(count * sizeof(float)));
+    }
+    if (!in)
+        throw std::runtime_error("'" + filename + "' is shorter than its header says");
+
+    return make_shared<density_grid>(int(nx), int(ny), int(nz), voxels, min, max, scale);
+}
+
+#endif
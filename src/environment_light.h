@@ -0,0 +1,143 @@
+#ifndef ENVIRONMENT_LIGHT_H
+#define ENVIRONMENT_LIGHT_H
+
+#include "rtw_stb_image.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Light arriving from infinitely far away in every direction, read from an equirectangular
+// (latitude-longitude) image. The top row of the image looks straight up (+y), the bottom row
+// straight down, and columns sweep around the vertical axis the same way sphere texture
+// coordinates do. HDR images keep their full range, so a sun in the map can be thousands of
+// times brighter than the sky around it.
+//
+// sample() picks directions in proportion to the radiance of each pixel times the solid angle
+// it covers, from a precomputed marginal CDF over rows and one conditional CDF per row. Small
+// bright regions then get the samples that their share of the light deserves, instead of being
+// found only by the rare scattered ray that happens to point at them.
+class environment_light {
+  public:
+    environment_light(const std::string& filename, double intensity) {
+        // Loads the map, scaling its radiance by `intensity`. Throws std::runtime_error if the
+        // image cannot be read.
+        if (!rtw_image::load_linear(filename, width, height, radiance))
+            throw std::runtime_error("cannot load environment image '" + filename + "'");
+        for (auto& value : radiance)
+            value = float(value * intensity);
+
+        build_distribution();
+    }
+
+    color emitted(const vec3& direction) const {
+        // Radiance arriving along the reverse of `direction`, that is, seen looking along it.
+        double u, v;
+        direction_to_uv(unit_vector(direction), u, v);
+        return pixel(std::min(int(u * width), width - 1), std::min(int(v * height), height - 1));
+    }
+
+    bool sample(vec3& direction, color& emission, double& pdf) const {
+        // Picks a direction to look for light in. Returns false if the map is black.
+        if (total_weight <= 0)
+            return false;
+
+        auto row = pick(marginal_cdf.data(), height);
+        auto col = pick(conditional_cdf.data() + size_t(row) * (width + 1), width);
+
+        // Uniform within the pixel, in image coordinates
+        auto u = (col + random_double()) / width;
+        auto v = (row + random_double()) / height;
+        direction = uv_to_direction(u, v);
+
+        pdf = pixel_pdf(col, row, v);
+        if (pdf <= 0)
+            return false;
+
+        emission = pixel(col, row);
+        return true;
+    }
+
+    double pdf(const vec3& direction) const {
+        // Density per steradian with which sample() picks `direction`.
+        if (total_weight <= 0)
+            return 0;
+
+        double u, v;
+        direction_to_uv(unit_vector(direction), u, v);
+        auto col = std::min(int(u * width), width - 1);
+        auto row = std::min(int(v * height), height - 1);
+        return pixel_pdf(col, row, v);
+    }
+
+  private:
+    int width = 0;
+    int height = 0;
+    std::vector<float> radiance;         // Linear RGB, three floats per pixel, rows top down
+    std::vector<double> marginal_cdf;    // height + 1 entries: cumulative weight of the rows
+    std::vector<double> conditional_cdf; // width + 1 entries per row: cumulative weight within it
+    std::vector<double> weights;         // Per pixel: luminance times the sine of its latitude
+    double total_weight = 0;
+
+    color pixel(int col, int row) const {
+        auto p = radiance.data() + (size_t(row) * width + col) * 3;
+        return color(p[0], p[1], p[2]);
+    }
+
+    static void direction_to_uv(const vec3& d, double& u, double& v) {
+        auto theta = std::acos(std::clamp(d.y(), -1.0, 1.0));
+        auto phi = std::atan2(-d.z(), d.x()) + pi;
+        u = phi / (2 * pi);
+        v = theta / pi;
+    }
+
+    static vec3 uv_to_direction(double u, double v) {
+        auto theta = v * pi;
+        auto phi = u * 2 * pi;
+        auto sin_theta = std::sin(theta);
+        return vec3(-sin_theta * std::cos(phi), std::cos(theta), sin_theta * std::sin(phi));
+    }
+
+    void build_distribution() {
+        // Rows near the poles cover less solid angle, so each pixel weighs its luminance by the
+        // sine of the latitude at its center.
+        weights.assign(size_t(width) * height, 0);
+        conditional_cdf.assign(size_t(height) * (width + 1), 0);
+        marginal_cdf.assign(height + 1, 0);
+
+        for (int row = 0; row < height; row++) {
+            auto sin_theta = std::sin(pi * (row + 0.5) / height);
+            auto cdf = conditional_cdf.data() + size_t(row) * (width + 1);
+            for (int col = 0; col < width; col++) {
+                auto c = pixel(col, row);
+                auto luminance = 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+                auto weight = std::fmax(0, luminance) * sin_theta;
+                weights[size_t(row) * width + col] = weight;
+                cdf[col + 1] = cdf[col] + weight;
+            }
+            marginal_cdf[row + 1] = marginal_cdf[row] + cdf[width];
+        }
+
+        total_weight = marginal_cdf[height];
+    }
+
+    static int pick(const double* cdf, int count) {
+        // Index i with probability (cdf[i+1] - cdf[i]) / cdf[count], skipping empty entries.
+        auto target = random_double() * cdf[count];
+        auto i = int(std::upper_bound(cdf + 1, cdf + count + 1, target) - (cdf + 1));
+        return std::min(i, count - 1);
+    }
+
+    double pixel_pdf(int col, int row, double v) const {
+        // The discrete pick spreads uniformly over the pixel in u,v, and the image covers
+        // 2 pi by pi radians, each direction weighted by sin(theta) of its own latitude.
+        auto sin_theta = std::sin(v * pi);
+        if (sin_theta <= 0)
+            return 0;
+        auto p_uv = weights[size_t(row) * width + col] / total_weight * width * height;
+        return p_uv / (2 * pi * pi * sin_theta);
+    }
+};
+
+#endif
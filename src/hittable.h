@@ -1,6 +1,7 @@
 #ifndef HITTABLE_H
 #define HITTABLE_H
 #include "aabb.h"
+#include "traversal_stats.h"
 
 
 class material;
@@ -13,6 +14,7 @@ public:
     double t;
     double u;
     double v;
+    double footprint = 0;  // Width of the ray cone at the hit, in texture coordinates
 
     bool front_face;
 
@@ -24,6 +26,20 @@ public:
         normal = front_face ? outward_normal : -outward_normal;
     }
 
+    void set_footprint(const ray& r, double uv_length) {
+        // Sets the footprint from the ray's cone, given the world-space length that one unit of
+        // u or v spans at the hit point. Expects t and the normal to be set. Grazing hits
+        // stretch the footprint, up to a limit.
+
+        if (r.cone_width() == 0 && r.cone_spread() == 0) {
+            footprint = 0;
+            return;
+        }
+
+        auto cos_theta = std::fabs(dot(unit_vector(r.direction()), normal));
+        footprint = r.cone_width_at(t) / (uv_length * std::fmax(cos_theta, 0.05));
+    }
+
 };
 
 class hittable {
@@ -32,22 +48,88 @@ public:
 
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
 
+    virtual packet_mask hit_packet(ray_packet& packet, packet_mask active, hit_record recs[]) const {
+        // Traces each active lane of the packet on its own. Returns the lanes that found a
+        // closer hit, and shrinks their packet.t_max to the new hit distance. Aggregates
+        // override this to share work across the lanes.
+
+        packet_mask hits = 0;
+        for (int lane = 0; lane < ray_packet::size; lane++) {
+            auto bit = ray_packet::lane_bit(lane);
+            if (!(active & bit))
+                continue;
+
+            if (hit(packet.rays[lane], interval(packet.t_min, packet.t_max[lane]), recs[lane])) {
+                packet.t_max[lane] = recs[lane].t;
+                hits |= bit;
+            }
+        }
+        return hits;
+    }
+
+    virtual bool hit_span(const ray& r, interval& span) const {
+        // Finds where the ray's line enters and leaves this object, for closed convex objects,
+        // at any t. Sets span to that stretch and returns true, or returns false if the line
+        // misses. Primitives and aggregates override this to find both ends in one pass; this
+        // fallback looks for the entry and then, in a second traversal, the exit.
+
+        hit_record entry_rec, exit_rec;
+        if (!hit(r, interval::universe, entry_rec))
+            return false;
+        if (!hit(r, interval(entry_rec.t + 0.0001, infinity), exit_rec))
+            return false;
+
+        span = interval(entry_rec.t, exit_rec.t);
+        return true;
+    }
+
+    virtual bool occluded(const ray& r, interval ray_t) const {
+        // Whether anything blocks the ray within ray_t, for visibility tests such as shadow
+        // rays. Unlike hit, any blocker will do, so overrides stop at the first one they find,
+        // in whatever order is cheapest, and compute nothing about it. This fallback finds the
+        // closest hit.
+        hit_record rec;
+        return hit(r, ray_t, rec);
+    }
+
+    virtual double transmittance(const ray& r, interval ray_t) const {
+        // Fraction of the light along the ray within ray_t that gets through, for shadow rays
+        // that cross participating media. Surfaces are opaque, so this fallback is occluded's
+        // answer; aggregates multiply their children's, and media estimate their own.
+        return occluded(r, ray_t) ? 0 : 1;
+    }
+
     virtual aabb bounding_box() const = 0;
 
+    virtual aabb bounding_box_at(double time) const {
+        // Bounds of the object at the given time, for times 0 and 1. Objects that move do so
+        // linearly, so the box interpolated between the two bounds them at any time between.
+        // bounding_box() covers their whole path.
+        return bounding_box();
+    }
+
 };
 
 class translate : public hittable {
 public:
 
     translate(shared_ptr<hittable> object, const vec3& offset)
-     : object(object), offset(offset)
+     : object(object)
     {
+        set_offset(offset);
+    }
+
+    void set_offset(const vec3& new_offset) {
+        // Moves the object to `new_offset`. Also picks up any change in the object's own
+        // bounds.
+        offset = new_offset;
         bbox = object->bounding_box() + offset;
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
         // Move the ray backwards by the offset
         ray offset_ray(r.origin() - offset, r.direction(), r.time());
+        offset_ray.set_cone(r.cone_width(), r.cone_spread());
 
         // Determine whether an intersection exists along the offset ray (and if so, where)
         if (!object->hit(offset_ray, ray_t, rec)) {
@@ -60,8 +142,24 @@ public:
         return true;
     }
 
+    bool hit_span(const ray& r, interval& span) const override {
+        // Ray parameters are unchanged by the offset.
+        return object->hit_span(ray(r.origin() - offset, r.direction(), r.time()), span);
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        return object->occluded(ray(r.origin() - offset, r.direction(), r.time()), ray_t);
+    }
+
+    double transmittance(const ray& r, interval ray_t) const override {
+        return object->transmittance(ray(r.origin() - offset, r.direction(), r.time()), ray_t);
+    }
+
     aabb bounding_box() const override { return bbox; }
 
+    aabb bounding_box_at(double time) const override {
+        return object->bounding_box_at(time) + offset;
+    }
 
 private:
     shared_ptr<hittable> object;
@@ -72,6 +170,12 @@ private:
 class rotate_y : public hittable {
 public:
     rotate_y(shared_ptr<hittable> object, double angle) : object(object) {
+        set_angle(angle);
+    }
+
+    void set_angle(double angle) {
+        // Turns the object to `angle` degrees about the y axis. Also picks up any change in
+        // the object's own bounds.
         auto radians = degrees_to_radians(angle);
         sin_theta = std::sin(radians);
         cos_theta = std::cos(radians);
@@ -105,19 +209,7 @@ public:
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
         // Transform the ray from world space to object space.
-        auto origin = point3(
-             (cos_theta * r.origin().x()) - (sin_theta * r.origin().z()),
-             r.origin().y(),
-             (sin_theta * r.origin().x()) + (cos_theta * r.origin().z())
-         );
-
-        auto direction = vec3(
-            (cos_theta * r.direction().x()) - (sin_theta * r.direction().z()),
-            r.direction().y(),
-            (sin_theta * r.direction().x()) + (cos_theta * r.direction().z())
-        );
-
-        ray rotated_r(origin, direction, r.time());
+        auto rotated_r = object_ray(r);
 
         // Determine whether an intersection exists in object space (and if so, where).
 
@@ -141,6 +233,18 @@ public:
         return true;
     }
 
+    bool hit_span(const ray& r, interval& span) const override {
+        // Ray parameters are unchanged by the rotation.
+        return object->hit_span(object_ray(r), span);
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        return object->occluded(object_ray(r), ray_t);
+    }
+
+    double transmittance(const ray& r, interval ray_t) const override {
+        return object->transmittance(object_ray(r), ray_t);
+    }
 
     aabb bounding_box() const override { return bbox; }
 
@@ -149,6 +253,24 @@ private:
     double sin_theta;
     double cos_theta;
     aabb bbox;
+
+    ray object_ray(const ray& r) const {
+        auto origin = point3(
+             (cos_theta * r.origin().x()) - (sin_theta * r.origin().z()),
+             r.origin().y(),
+             (sin_theta * r.origin().x()) + (cos_theta * r.origin().z())
+         );
+
+        auto direction = vec3(
+            (cos_theta * r.direction().x()) - (sin_theta * r.direction().z()),
+            r.direction().y(),
+            (sin_theta * r.direction().x()) + (cos_theta * r.direction().z())
+        );
+
+        ray rotated_r(origin, direction, r.time());
+        rotated_r.set_cone(r.cone_width(), r.cone_spread());
+        return rotated_r;
+    }
 };
 
 
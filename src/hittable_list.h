@@ -19,6 +19,8 @@ public:
     void add(shared_ptr<hittable> object) {
         objects.push_back(object);
         bbox = aabb(bbox, object->bounding_box());
+        start_bbox = aabb(start_bbox, object->bounding_box_at(0));
+        end_bbox = aabb(end_bbox, object->bounding_box_at(1));
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
@@ -36,10 +38,61 @@ public:
 
         return hit_anything;
     }
+
+    packet_mask hit_packet(ray_packet& packet, packet_mask active, hit_record recs[]) const override {
+        packet_mask hits = 0;
+        for (const auto& object : objects)
+            hits |= object->hit_packet(packet, active, recs);
+
+        return hits;
+    }
+
+    bool hit_span(const ray& r, interval& span) const override {
+        // The parts of a convex object, such as the sides of a box, together span from the
+        // first entry to the last exit.
+        bool hit_anything = false;
+        span = interval::empty;
+        for (const auto& object : objects) {
+            interval object_span;
+            if (object->hit_span(r, object_span)) {
+                hit_anything = true;
+                span = interval(span, object_span);
+            }
+        }
+
+        return hit_anything;
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        for (const auto& object : objects)
+            if (object->occluded(r, ray_t))
+                return true;
+
+        return false;
+    }
+
+    double transmittance(const ray& r, interval ray_t) const override {
+        // Stops at the first object that blocks the ray outright.
+        double fraction = 1;
+        for (const auto& object : objects) {
+            fraction *= object->transmittance(r, ray_t);
+            if (fraction <= 0)
+                return 0;
+        }
+        return fraction;
+    }
+
     aabb bounding_box() const override { return bbox; }
 
+    aabb bounding_box_at(double time) const override {
+        return time <= 0 ? start_bbox : time >= 1 ? end_bbox
+                         : aabb::interpolate(start_bbox, end_bbox, time);
+    }
+
 private:
     aabb bbox;
+    aabb start_bbox;  // Bounds at time 0
+    aabb end_bbox;    // Bounds at time 1
 };
 
 #endif
\ No newline at end of file
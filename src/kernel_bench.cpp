@@ -0,0 +1,415 @@
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "material.h"
+#include "perlin.h"
+#include "quad.h"
+#include "scene.h"
+#include "scene_loader.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Usage: kernel_bench [options]
+//
+// Times the inner kernels of the renderer in isolation. Every kernel is fed batches that are
+// generated before timing starts: one from random distributions, and one for each recorded
+// scene, made from rays traced out of that scene's camera. Each batch is run a few times to
+// warm up and then timed over several repetitions; the report gives ns/op and throughput.
+//
+//   --batch N       Operations per batch (default 65536)
+//   --reps N        Timed repetitions per kernel (default 15)
+//   --warmup N      Untimed repetitions before timing (default 3)
+//   --seed N        Random seed for the batches (default 1)
+//   --scenes DIR    Directory holding the scene files
+//   --filter TEXT   Only run kernels whose name contains TEXT
+//   --json          Print the report as JSON instead of a table
+//   --output FILE   Write the report to FILE instead of standard output
+
+#ifndef RTW_SCENE_DIR
+#define RTW_SCENE_DIR "scenes"
+#endif
+
+#ifndef RTW_IMAGE_DIR
+#define RTW_IMAGE_DIR "images"
+#endif
+
+const char* recorded_scenes[] = {
+    "bouncing_spheres",
+    "cornell_box",
+    "final_scene",
+};
+
+struct kernel_options {
+    size_t batch = 65536;
+    int repetitions = 15;
+    int warmup = 3;
+    std::uint64_t seed = 1;
+    std::string scene_dir = RTW_SCENE_DIR;
+    std::string filter;
+    bool json = false;
+    std::string output;
+};
+
+// Inputs for every kernel. The test shapes are placed at `center` with half-size `scale`, so
+// that recorded rays meet them the way they meet the scene's own geometry.
+struct kernel_batch {
+    std::string name;
+    point3 center;
+    double scale = 1;
+
+    std::vector<ray>        rays;        // Intersection kernels
+    std::vector<double>     plane_a;     // Plane coordinates for triangle::is_interior
+    std::vector<double>     plane_b;
+    std::vector<point3>     points;      // Lookup points for perlin::turbulence
+    std::vector<ray>        hit_rays;    // Incoming rays and hits for dielectric::scatter
+    std::vector<hit_record> hits;
+};
+
+struct kernel_result {
+    std::string kernel;
+    std::string batch;
+    size_t ops = 0;
+    double median_ns = 0;
+    double mean_ns = 0;
+    double stddev_ns = 0;
+    double min_ns = 0;
+    double result = 0;   // Checksum of the kernel outputs, so the work cannot be optimized away
+};
+
+// Shapes and materials the kernels run against.
+struct kernel_shapes {
+    aabb                 box;
+    shared_ptr<sphere>   ball;
+    shared_ptr<quad>     square;
+    shared_ptr<triangle> tri;
+    perlin               noise;
+    dielectric           glass{1.5};
+
+    explicit kernel_shapes(const kernel_batch& batch) {
+        auto c = batch.center;
+        auto s = batch.scale;
+        auto mat = make_shared<lambertian>(color(.5, .5, .5));
+
+        box    = aabb(c - vec3(s, s, s), c + vec3(s, s, s));
+        ball   = make_shared<sphere>(c, s, mat);
+        square = make_shared<quad>(c - vec3(s, s, 0), vec3(2*s, 0, 0), vec3(0, 2*s, 0), mat);
+        tri    = make_shared<triangle>(c - vec3(s, s, 0), vec3(2*s, 0, 0), vec3(0, 2*s, 0), mat);
+    }
+};
+
+void add_plane_coordinates(kernel_batch& batch) {
+    // Derives the plane coordinates at which the batch rays cross the test quad's plane, which
+    // is what quad::hit hands to is_interior.
+    auto corner = batch.center - vec3(batch.scale, batch.scale, 0);
+    for (const auto& r : batch.rays) {
+        if (std::fabs(r.direction().z()) < 1e-8)
+            continue;
+        auto t = (batch.center.z() - r.origin().z()) / r.direction().z();
+        if (t <= 0)
+            continue;
+        auto p = r.at(t) - corner;
+        batch.plane_a.push_back(p.x() / (2 * batch.scale));
+        batch.plane_b.push_back(p.y() / (2 * batch.scale));
+    }
+}
+
+void add_glass_hits(kernel_batch& batch) {
+    // Keeps the batch rays that hit the test sphere, with their hit records, as the input of
+    // the dielectric kernel.
+    kernel_shapes shapes(batch);
+    for (const auto& r : batch.rays) {
+        hit_record rec;
+        if (shapes.ball->hit(r, interval(0.001, infinity), rec)) {
+            batch.hit_rays.push_back(r);
+            batch.hits.push_back(rec);
+        }
+    }
+}
+
+kernel_batch random_batch(size_t count) {
+    // Rays from a cube around the unit test shapes in uniformly random directions.
+    kernel_batch batch;
+    batch.name = "random";
+    batch.center = point3(0, 0, 0);
+    batch.scale = 1;
+
+    for (size_t i = 0; i < count; i++) {
+        point3 origin = vec3::random(-4, 4);
+        batch.rays.emplace_back(origin, random_unit_vector(), random_double());
+        batch.plane_a.push_back(random_double(-0.5, 1.5));
+        batch.plane_b.push_back(random_double(-0.5, 1.5));
+        batch.points.push_back(vec3::random(-8, 8));
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        hit_record rec;
+        ray r(vec3::random(-4, 4), random_unit_vector(), random_double());
+        rec.p = r.origin();
+        rec.t = 1;
+        rec.u = rec.v = 0.5;
+        rec.set_face_normal(r, random_unit_vector());
+        batch.hit_rays.push_back(r);
+        batch.hits.push_back(rec);
+    }
+
+    return batch;
+}
+
+kernel_batch recorded_batch(const std::string& name, const kernel_options& options) {
+    // Rays traced out of a demo scene's camera, including their scattered bounces. The test
+    // shapes sit at the camera's look-at point, sized to a quarter of the viewing distance.
+    scene s = load_scene(options.scene_dir + "/" + name + ".scene");
+
+    kernel_batch batch;
+    batch.name = name;
+    batch.center = s.cam.lookat;
+    batch.scale = 0.25 * (s.cam.lookfrom - s.cam.lookat).length();
+    batch.rays = s.cam.record_rays(s.world, options.batch);
+
+    for (const auto& r : batch.rays) {
+        hit_record rec;
+        if (s.world.hit(r, interval(0.001, infinity), rec))
+            batch.points.push_back(rec.p);
+    }
+
+    add_plane_coordinates(batch);
+    add_glass_hits(batch);
+    return batch;
+}
+
+kernel_result time_kernel(
+    const std::string& kernel, const kernel_batch& batch, size_t ops,
+    const std::function<double()>& run, const kernel_options& options
+) {
+    // Runs the kernel over the whole batch `warmup` times untimed, then `repetitions` times
+    // timed, and summarizes the per-operation times.
+    kernel_result result;
+    result.kernel = kernel;
+    result.batch = batch.name;
+    result.ops = ops;
+    if (ops == 0)
+        return result;
+
+    for (int i = 0; i < options.warmup; i++)
+        result.result += run();
+
+    std::vector<double> samples;
+    for (int i = 0; i < options.repetitions; i++) {
+        auto start = std::chrono::steady_clock::now();
+        result.result += run();
+        auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start);
+        samples.push_back(elapsed.count() / double(ops));
+    }
+
+    std::sort(samples.begin(), samples.end());
+    auto n = samples.size();
+    result.median_ns = (n % 2) ? samples[n/2] : 0.5 * (samples[n/2 - 1] + samples[n/2]);
+    result.min_ns = samples.front();
+
+    for (auto s : samples)
+        result.mean_ns += s;
+    result.mean_ns /= double(n);
+
+    for (auto s : samples)
+        result.stddev_ns += (s - result.mean_ns) * (s - result.mean_ns);
+    result.stddev_ns = n > 1 ? std::sqrt(result.stddev_ns / double(n - 1)) : 0;
+
+    return result;
+}
+
+void run_kernels(const kernel_batch& batch, const kernel_options& options,
+                 std::vector<kernel_result>& results) {
+    kernel_shapes shapes(batch);
+    const interval ray_t(0.001, infinity);
+
+    auto wanted = [&](const std::string& kernel) {
+        return options.filter.empty() || kernel.find(options.filter) != std::string::npos;
+    };
+    auto add = [&](const std::string& kernel, size_t ops, const std::function<double()>& run) {
+        if (!wanted(kernel))
+            return;
+        std::clog << "Timing " << kernel << " on " << batch.name << "\n";
+        results.push_back(time_kernel(kernel, batch, ops, run, options));
+    };
+
+    add("aabb::hit", batch.rays.size(), [&] {
+        double hits = 0;
+        for (const auto& r : batch.rays)
+            hits += shapes.box.hit(r, ray_t);
+        return hits;
+    });
+
+    add("sphere::hit", batch.rays.size(), [&] {
+        double sum = 0;
+        hit_record rec;
+        for (const auto& r : batch.rays)
+            if (shapes.ball->hit(r, ray_t, rec))
+                sum += rec.t;
+        return sum;
+    });
+
+    add("quad::hit", batch.rays.size(), [&] {
+        double sum = 0;
+        hit_record rec;
+        for (const auto& r : batch.rays)
+            if (shapes.square->hit(r, ray_t, rec))
+                sum += rec.t;
+        return sum;
+    });
+
+    add("sphere::occluded", batch.rays.size(), [&] {
+        double blocked = 0;
+        for (const auto& r : batch.rays)
+            blocked += shapes.ball->occluded(r, ray_t);
+        return blocked;
+    });
+
+    add("quad::occluded", batch.rays.size(), [&] {
+        double blocked = 0;
+        for (const auto& r : batch.rays)
+            blocked += shapes.square->occluded(r, ray_t);
+        return blocked;
+    });
+
+    add("triangle::is_interior", batch.plane_a.size(), [&] {
+        double inside = 0;
+        const quad& tri = *shapes.tri;
+        for (size_t i = 0; i < batch.plane_a.size(); i++)
+            inside += tri.is_interior(batch.plane_a[i], batch.plane_b[i]);
+        return inside;
+    });
+
+    add("perlin::turbulence", batch.points.size(), [&] {
+        double sum = 0;
+        for (const auto& p : batch.points)
+            sum += shapes.noise.turbulence(p, 7);
+        return sum;
+    });
+
+    add("dielectric::scatter", batch.hits.size(), [&] {
+        double sum = 0;
+        color attenuation;
+        ray scattered;
+        for (size_t i = 0; i < batch.hits.size(); i++)
+            if (shapes.glass.scatter(batch.hit_rays[i], batch.hits[i], attenuation, scattered))
+                sum += scattered.direction().x();
+        return sum;
+    });
+}
+
+std::string format_report(const std::vector<kernel_result>& results, const kernel_options& options) {
+    std::ostringstream out;
+
+    if (options.json) {
+        out << "{\n  \"settings\": {\"batch\": " << options.batch
+            << ", \"repetitions\": " << options.repetitions
+            << ", \"warmup\": " << options.warmup
+            << ", \"seed\": " << options.seed
+            << ", \"compiler\": \"" << __VERSION__ << "\"},\n"
+            << "  \"kernels\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const auto& r = results[i];
+            out << "    {\"kernel\": \"" << r.kernel << "\", \"batch\": \"" << r.batch << "\""
+                << ", \"ops\": " << r.ops
+                << ", \"median_ns\": " << r.median_ns
+                << ", \"mean_ns\": " << r.mean_ns
+                << ", \"stddev_ns\": " << r.stddev_ns
+                << ", \"min_ns\": " << r.min_ns
+                << ", \"mops_per_second\": " << (r.median_ns > 0 ? 1e3 / r.median_ns : 0)
+                << ", \"checksum\": " << r.result
+                << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        out << "  ]\n}\n";
+        return out.str();
+    }
+
+    char line[160];
+    std::snprintf(line, sizeof(line), "%-22s %-18s %9s %10s %10s %9s %10s\n",
+                  "kernel", "batch", "ops", "median ns", "mean ns", "stddev", "Mops/s");
+    out << line;
+    for (const auto& r : results) {
+        std::snprintf(line, sizeof(line), "%-22s %-18s %9zu %10.2f %10.2f %9.2f %10.1f\n",
+                      r.kernel.c_str(), r.batch.c_str(), r.ops, r.median_ns, r.mean_ns,
+                      r.stddev_ns, r.median_ns > 0 ? 1e3 / r.median_ns : 0);
+        out << line;
+    }
+    return out.str();
+}
+
+bool parse_options(int argc, char* argv[], kernel_options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            std::cout << "Usage: kernel_bench [--batch N] [--reps N] [--warmup N] [--seed N]\n"
+                      << "                    [--scenes DIR] [--filter TEXT] [--json] [--output FILE]\n";
+            return false;
+        }
+        if (arg == "--json") {
+            options.json = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            throw std::invalid_argument(arg + " needs a value");
+
+        std::string value = argv[++i];
+        if      (arg == "--batch")   options.batch = std::stoull(value);
+        else if (arg == "--reps")    options.repetitions = std::max(1, std::stoi(value));
+        else if (arg == "--warmup")  options.warmup = std::stoi(value);
+        else if (arg == "--seed")    options.seed = std::stoull(value);
+        else if (arg == "--scenes")  options.scene_dir = value;
+        else if (arg == "--filter")  options.filter = value;
+        else if (arg == "--output")  options.output = value;
+        else throw std::invalid_argument("unknown option " + arg);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    kernel_options options;
+    try {
+        if (!parse_options(argc, argv, options))
+            return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 2;
+    }
+
+    // Let rtw_image find the textures wherever the benchmark is run from.
+    setenv("RTW_IMAGES", RTW_IMAGE_DIR, 0);
+
+    std::vector<kernel_result> results;
+    try {
+        // Generate every batch up front so that loading and tracing stay out of the timings.
+        seed_random(options.seed);
+        std::vector<kernel_batch> batches;
+        batches.push_back(random_batch(options.batch));
+        for (auto name : recorded_scenes) {
+            std::clog << "Recording rays from " << name << "\n";
+            batches.push_back(recorded_batch(name, options));
+        }
+
+        for (const auto& batch : batches)
+            run_kernels(batch, options, results);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
+    auto report = format_report(results, options);
+    if (options.output.empty()) {
+        std::cout << report;
+    } else {
+        std::ofstream out(options.output);
+        out << report;
+    }
+
+    return 0;
+}
@@ -0,0 +1,435 @@
+#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+
+#include "environment_light.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <algorithm>
+#include <vector>
+
+// Explicit light sampling
+//
+// The light tree holds the scene's emissive quads and spheres in a bounding hierarchy. Every
+// node keeps the total power of its lights, their bounding box, and a cone bounding the
+// directions they emit in. At a shading point, sample() walks from the root to one light,
+// choosing each child with probability proportional to a conservative estimate of what its
+// lights can contribute there: power, falloff with distance, and the orientation of the
+// emitters and of the receiving surface. Picking a light costs one walk down the tree however
+// many lights there are, and the lights likely to matter get most of the shadow rays.
+//
+// An environment light, if the scene has one, sits beside the tree: it is picked half the
+// time, or always when the tree is empty, and samples its own map.
+
+// Wraps the material of one light in the tree, so that hits on it know which light they found
+// and can weigh its emission against the chance that sampling the lights would have picked
+// the same point.
+class sampled_light : public material {
+public:
+    sampled_light(shared_ptr<material> emission, int light) : emission(emission), light(light) {}
+
+    color emitted(double u, double v, const point3& p) const override {
+        return emission->emitted(u, v, p);
+    }
+
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
+    const override {
+        return emission->scatter(r_in, rec, attenuation, scattered);
+    }
+
+    int light_index() const override { return light; }
+
+private:
+    shared_ptr<material> emission;
+    int light;
+};
+
+// A direction chosen toward a light, as seen from a shading point.
+struct light_sample {
+    vec3   direction;  // From the shading point; a light in the scene lies at t = 1 along it
+    double t_max;      // Shadow rays look for blockers up to here: just short of the light, or
+                       // without limit for the environment
+    color  emission;   // Radiance arriving along the direction
+    double pdf;        // Probability density of the direction, per steradian, including the
+                       // probability of picking this light
+};
+
+// Bounds of a set of lights: where they are, how much they emit and in which directions.
+struct light_bounds {
+    aabb   box;
+    double power = 0;
+    vec3   axis = vec3(0, 0, 1);  // Center of the cone of emitting surface normals
+    double theta_o = 0;           // Half-angle of that cone
+    double theta_e = pi / 2;      // How far past the normals the emission reaches
+    bool   two_sided = false;     // Also emits along the reversed normals
+
+    double importance(const point3& p, const vec3& n) const {
+        // A bound on what these lights can contribute at p, up to a constant factor, that is
+        // zero only where none of them can light p. n is the normal of the receiving surface,
+        // or zero for points in a volume.
+        if (power <= 0)
+            return 0;
+
+        point3 center(0.5 * (box.x.min + box.x.max), 0.5 * (box.y.min + box.y.max),
+                      0.5 * (box.z.min + box.z.max));
+        auto radius2 = 0.25 * vec3(box.x.size(), box.y.size(), box.z.size()).length_squared();
+        auto to_p = p - center;
+        auto dist2 = to_p.length_squared();
+
+        // Angle the box's bounding sphere subtends at p, all directions if p is inside it.
+        auto theta_b = dist2 <= radius2 ? pi : std::asin(std::sqrt(radius2 / dist2));
+        auto wi = dist2 > 0 ? to_p / std::sqrt(dist2) : vec3(0, 0, 1);
+
+        // Smallest possible angle between an emitting normal and the direction to p.
+        auto cos_w = dot(axis, wi);
+        if (two_sided)
+            cos_w = std::fabs(cos_w);
+        auto theta_w = std::acos(std::clamp(cos_w, -1.0, 1.0));
+        auto theta_x = std::fmax(0, theta_w - theta_o - theta_b);
+        if (theta_x >= theta_e)
+            return 0;
+
+        auto result = power * std::cos(theta_x) / std::fmax(dist2, radius2);
+
+        if (n.length_squared() > 0) {
+            // Smallest possible angle between the surface normal and the direction to a light.
+            auto theta_i = std::acos(std::clamp(dot(n, -wi), -1.0, 1.0));
+            auto theta_ip = std::fmax(0, theta_i - theta_b);
+            if (theta_ip >= pi / 2)
+                return 0;
+            result *= std::cos(theta_ip);
+        }
+
+        return result;
+    }
+
+    static light_bounds merge(const light_bounds& a, const light_bounds& b) {
+        light_bounds result;
+        result.box = aabb(a.box, b.box);
+        result.power = a.power + b.power;
+        result.theta_e = std::fmax(a.theta_e, b.theta_e);
+        result.two_sided = a.two_sided || b.two_sided;
+
+        // The smallest cone holding both normal cones.
+        const auto& wide = a.theta_o >= b.theta_o ? a : b;
+        const auto& narrow = a.theta_o >= b.theta_o ? b : a;
+        auto theta_d = std::acos(std::clamp(dot(wide.axis, narrow.axis), -1.0, 1.0));
+        result.axis = wide.axis;
+
+        if (std::fmin(theta_d + narrow.theta_o, pi) <= wide.theta_o) {
+            result.theta_o = wide.theta_o;
+            return result;
+        }
+
+        result.theta_o = 0.5 * (wide.theta_o + theta_d + narrow.theta_o);
+        auto turn = cross(wide.axis, narrow.axis);
+        if (result.theta_o >= pi || turn.near_zero()) {
+            result.theta_o = pi;
+            return result;
+        }
+
+        // Rotate the wide cone's axis toward the narrow one until the cone holds both.
+        auto theta_r = result.theta_o - wide.theta_o;
+        auto k = unit_vector(turn);
+        result.axis = unit_vector(std::cos(theta_r) * wide.axis + std::sin(theta_r) * cross(k, wide.axis));
+        return result;
+    }
+};
+
+class light_tree {
+public:
+    // Lights are added with the material they emit through. Returns the new light's index,
+    // or -1, leaving the light out, if its emission measured at its center is black; such
+    // lights are only found by rays that hit them.
+    int add_quad(const point3& Q, const vec3& u, const vec3& v, shared_ptr<material> mat) {
+        emitter e;
+        e.shape = emitter::quad_shape;
+        e.mat = mat;
+        e.Q = Q;
+        e.u = u;
+        e.v = v;
+        auto n = cross(u, v);
+        e.normal = unit_vector(n);
+        e.area = n.length();
+
+        e.bounds.box = aabb(aabb(Q, Q + u + v), aabb(Q + u, Q + v));
+        e.bounds.axis = e.normal;
+        e.bounds.two_sided = true;
+        e.bounds.power = 2 * pi * e.area * average(mat->emitted(0.5, 0.5, Q + 0.5 * (u + v)));
+        return add(e);
+    }
+
+    int add_sphere(const point3& center, double radius, shared_ptr<material> mat) {
+        emitter e;
+        e.shape = emitter::sphere_shape;
+        e.mat = mat;
+        e.center = center;
+        e.radius = radius;
+
+        auto rvec = vec3(radius, radius, radius);
+        e.bounds.box = aabb(center - rvec, center + rvec);
+        e.bounds.theta_o = pi;
+        e.bounds.power = 4 * pi * pi * radius * radius
+                       * average(mat->emitted(0.5, 0.5, center + vec3(radius, 0, 0)));
+        return add(e);
+    }
+
+    void build() {
+        // Builds the hierarchy over the lights added so far.
+        nodes.clear();
+        leaves.assign(emitters.size(), -1);
+        std::vector<int> order(emitters.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = int(i);
+        if (!order.empty())
+            build_node(order, 0, order.size());
+    }
+
+    void set_environment(const environment_light* env) { environment = env; }
+
+    bool empty() const { return nodes.empty() && !environment; }
+    size_t size() const { return emitters.size() + (environment ? 1 : 0); }
+
+    double environment_pdf(const vec3& direction) const {
+        // The density, per steradian, with which sample() picks `direction` from the
+        // environment.
+        return environment ? environment_probability() * environment->pdf(direction) : 0;
+    }
+
+    double pdf(int light, const point3& p, const vec3& n, const point3& y) const {
+        // The density, per steradian, with which sample() picks point y on the given light
+        // when called at p with normal n.
+        int index = leaves[light];
+        if (nodes[index].bounds.importance(p, n) <= 0)
+            return 0;
+
+        double pick = 1;
+        while (index != 0) {
+            int parent = nodes[index].parent;
+            auto left_importance = nodes[parent + 1].bounds.importance(p, n);
+            auto right_importance = nodes[nodes[parent].right].bounds.importance(p, n);
+            auto total = left_importance + right_importance;
+            if (total <= 0)
+                return 0;
+            pick *= (index == parent + 1 ? left_importance : right_importance) / total;
+            index = parent;
+        }
+
+        return (1 - environment_probability()) * pick * emitters[light].pdf(p, y);
+    }
+
+    bool sample(const point3& p, const vec3& n, light_sample& sample) const {
+        // Picks a light in proportion to its importance at p, and a point on it. n is the
+        // surface normal at p, or zero inside a volume. Returns false if no light can reach p.
+        auto p_environment = environment_probability();
+        if (p_environment > 0 && random_double() < p_environment) {
+            if (!environment->sample(sample.direction, sample.emission, sample.pdf))
+                return false;
+            sample.t_max = infinity;
+            sample.pdf *= p_environment;
+            return true;
+        }
+        if (nodes.empty())
+            return false;
+
+        double pick = 1 - p_environment;
+        int index = 0;
+        while (nodes[index].light < 0) {
+            int left = index + 1, right = nodes[index].right;
+            auto left_importance = nodes[left].bounds.importance(p, n);
+            auto right_importance = nodes[right].bounds.importance(p, n);
+            auto total = left_importance + right_importance;
+            if (total <= 0)
+                return false;
+
+            auto p_left = left_importance / total;
+            if (random_double() < p_left) {
+                index = left;
+                pick *= p_left;
+            } else {
+                index = right;
+                pick *= 1 - p_left;
+            }
+        }
+
+        if (nodes[index].bounds.importance(p, n) <= 0)
+            return false;
+        if (!emitters[nodes[index].light].sample(p, sample))
+            return false;
+
+        sample.pdf *= pick;
+        return true;
+    }
+
+private:
+    // Shadow rays stop just short of the light they aim at, at t = 1.
+    static constexpr double shadow_t_max = 0.999;
+
+    struct emitter {
+        enum { quad_shape, sphere_shape } shape;
+        shared_ptr<material> mat;
+        light_bounds bounds;
+
+        point3 Q;            // Quads
+        vec3   u, v, normal;
+        double area = 0;
+
+        point3 center;       // Spheres
+        double radius = 0;
+
+        double pdf(const point3& p, const point3& y) const {
+            // Density of sample() choosing the direction from p to y, a point on the light.
+            auto to_light = y - p;
+            auto dist2 = to_light.length_squared();
+            if (shape == quad_shape) {
+                auto cosine = std::fabs(dot(normal, to_light)) / std::sqrt(dist2);
+                return cosine < 1e-8 ? 0 : dist2 / (cosine * area);
+            }
+
+            auto radius2 = radius * radius;
+            auto center_dist2 = (center - p).length_squared();
+            if (center_dist2 <= radius2) {
+                auto cosine = std::fabs(dot(unit_vector(y - center), to_light)) / std::sqrt(dist2);
+                return cosine < 1e-8 ? 0 : dist2 / (cosine * 4 * pi * radius2);
+            }
+
+            auto sin2_max = radius2 / center_dist2;
+            auto cos_max = std::sqrt(std::fmax(0, 1 - sin2_max));
+            auto one_minus_cos_max = sin2_max / (1 + cos_max);
+            return 1 / (2 * pi * one_minus_cos_max);
+        }
+
+        bool sample(const point3& p, light_sample& s) const {
+            point3 y;
+            if (shape == quad_shape) {
+                // Uniform over the area, converted to a density over directions.
+                auto a = random_double(), b = random_double();
+                y = Q + a * u + b * v;
+                auto to_light = y - p;
+                auto dist2 = to_light.length_squared();
+                auto cosine = std::fabs(dot(normal, to_light)) / std::sqrt(dist2);
+                if (cosine < 1e-8)
+                    return false;
+                s.pdf = dist2 / (cosine * area);
+                s.emission = mat->emitted(a, b, y);
+                s.direction = to_light;
+                s.t_max = shadow_t_max;
+                return true;
+            }
+
+            auto to_center = center - p;
+            auto dist2 = to_center.length_squared();
+            auto radius2 = radius * radius;
+
+            if (dist2 <= radius2) {
+                // From inside, uniform over the surface.
+                y = center + radius * random_unit_vector();
+                auto to_light = y - p;
+                auto d2 = to_light.length_squared();
+                auto cosine = std::fabs(dot(unit_vector(y - center), to_light)) / std::sqrt(d2);
+                if (cosine < 1e-8)
+                    return false;
+                s.pdf = d2 / (cosine * 4 * pi * radius2);
+            } else {
+                // From outside, uniform over the cone of directions the sphere covers.
+                auto sin2_max = radius2 / dist2;
+                auto cos_max = std::sqrt(std::fmax(0, 1 - sin2_max));
+                auto one_minus_cos_max = sin2_max / (1 + cos_max);
+
+                auto cos_theta = 1 - random_double() * one_minus_cos_max;
+                auto sin_theta = std::sqrt(std::fmax(0, 1 - cos_theta * cos_theta));
+                auto phi = 2 * pi * random_double();
+
+                auto w = to_center / std::sqrt(dist2);
+                auto a = std::fabs(w.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+                auto t1 = unit_vector(cross(w, a));
+                auto t2 = cross(w, t1);
+                auto direction = sin_theta * std::cos(phi) * t1 + sin_theta * std::sin(phi) * t2
+                               + cos_theta * w;
+
+                // Nearest point of the sphere along that direction
+                auto b = dot(direction, to_center);
+                auto s_near = b - std::sqrt(std::fmax(0, radius2 - (dist2 - b * b)));
+                y = p + s_near * direction;
+                s.pdf = 1 / (2 * pi * one_minus_cos_max);
+            }
+
+            double u, v;
+            sphere_uv(unit_vector(y - center), u, v);
+            s.emission = mat->emitted(u, v, y);
+            s.direction = y - p;
+            s.t_max = shadow_t_max;
+            return true;
+        }
+    };
+
+    struct node {
+        light_bounds bounds;
+        int light = -1;   // Leaves: index of the emitter
+        int right = -1;   // Interior nodes: index of the second child; the first follows the node
+        int parent = -1;
+    };
+
+    std::vector<emitter> emitters;
+    std::vector<node> nodes;
+    std::vector<int> leaves;  // Leaf node of each emitter
+    const environment_light* environment = nullptr;
+
+    double environment_probability() const {
+        if (!environment) return 0;
+        return nodes.empty() ? 1 : 0.5;
+    }
+
+    static double average(const color& c) { return (c.x() + c.y() + c.z()) / 3; }
+
+    int add(const emitter& e) {
+        if (!(e.bounds.power > 0))
+            return -1;
+        emitters.push_back(e);
+        return int(emitters.size() - 1);
+    }
+
+    static void sphere_uv(const point3& p, double& u, double& v) {
+        // Same mapping as sphere.
+        auto phi = std::atan2(-p.z(), p.x()) + pi;
+        auto theta = std::acos(-p.y());
+        u = phi / (2 * pi);
+        v = theta / pi;
+    }
+
+    int build_node(std::vector<int>& order, size_t start, size_t end, int parent = -1) {
+        int index = int(nodes.size());
+        nodes.emplace_back();
+        nodes[index].parent = parent;
+
+        if (end - start == 1) {
+            nodes[index].light = order[start];
+            nodes[index].bounds = emitters[order[start]].bounds;
+            leaves[order[start]] = index;
+            return index;
+        }
+
+        // Split at the median along the longest axis of the light centers.
+        auto center = [&](int e, int axis) {
+            const auto& range = emitters[e].bounds.box.axis_interval(axis);
+            return range.min + range.max;
+        };
+        aabb centers = aabb::empty;
+        for (size_t i = start; i < end; i++) {
+            point3 c(0.5 * center(order[i], 0), 0.5 * center(order[i], 1), 0.5 * center(order[i], 2));
+            centers = aabb(centers, aabb(c, c));
+        }
+        int axis = centers.longest_axis();
+        auto mid = start + (end - start) / 2;
+        std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+                         [&](int a, int b) { return center(a, axis) < center(b, axis); });
+
+        int left = build_node(order, start, mid, index);
+        int right = build_node(order, mid, end, index);
+        nodes[index].right = right;
+        nodes[index].bounds = light_bounds::merge(nodes[left].bounds, nodes[right].bounds);
+        return index;
+    }
+};
+
+#endif
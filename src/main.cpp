@@ -1,678 +1,594 @@
 #include "rtweekend.h"
 
-#include "camera.h"
-#include "hittable.h"
-#include "hittable_list.h"
-#include "material.h"
-#include "sphere.h"
-#include "bvh.h"
-#include "texture.h"
-#include "quad.h"
-#include "constant_medium.h"
-#include "OBJloader.h"
-
-void bouncing_spheres() {
-    hittable_list world;
-
-    auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
-
-            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    auto center2 = center + vec3(0, random_double(0, .5), 0);
-                    world.add(make_shared<sphere>(center, center2, 0.2, sphere_material));
-                } else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = color::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                } else {
-                    // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-            }
-        }
-    }
-
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
-
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
-
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
-
-    world = hittable_list(make_shared<bvh_node>(world));
-
-    camera cam;
-
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 1200;
-    cam.samples_per_pixel = 10;
-    cam.max_depth = 50;
-    cam.background = color(0.70, 0.80, 1.00);
-
-    cam.vfov = 20;
-    cam.lookfrom = point3(13, 2, 3);
-    cam.lookat = point3(0, 0, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 0.6;
-    cam.focus_dist = 10.0;
-
-    cam.render(world);
+#include "render_service.h"
+#include "scene.h"
+#include "scene_loader.h"
+#include "tile_coordinator.h"
+#include "tile_output.h"
+
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+// Usage: COMS3360Renderer [scene-file] [options]
+//
+// Renders a scene description file (see scene_loader.h) as a PPM image. The demo scenes live
+// in scenes/. Options override the settings in the scene file:
+//
+//   --width N      Image width in pixels
+//   --spp N        Samples per pixel
+//   --depth N      Maximum ray bounce depth
+//   --threads N    Render threads (0 uses every hardware thread)
+//   --seed N       Random seed for scene construction and sampling
+//   --output FILE  Write the image to FILE instead of standard output
+//   --no-light-sampling
+//                  Light diffuse surfaces only through the rays they scatter, without
+//                  sampling the scene's lights directly
+//   --texture-cache MB
+//                  Memory cap of the tile cache used by tiled image textures (default 1024)
+//   --heatmap      Also write traversal cost heatmaps and histograms next to the output
+//                  image (needs a build with RTW_TRAVERSAL_STATS)
+//   --frames N     Render N frames of the scene's animations (see `animate`), loading the
+//                  scene once. Frame f goes to FILE with _ffff added before its extension.
+//   --camera SETTINGS
+//                  Render and camera settings written as in a scene file, for example
+//                  --camera "lookfrom 0 1 5 vfov 30"
+//   --tile-order raster|cost
+//                  Trace tiles in raster order, or the tiles that a quick prepass predicts to
+//                  cost most first. Local renders default to raster order, since their
+//                  threads share out small blocks of pixels; renders on --workers, which
+//                  take whole tiles, default to cost order.
+//   --tile-report FILE
+//                  Write the predicted and measured cost of each tile to FILE
+//
+// Tiles can also be written out as soon as they are finished, by a writer thread of their own
+// (see tile_output.h), whether they are rendered here or come back from servers. Without
+// --output, no PPM image is written and the image is never held in memory as a whole:
+//
+//   --stream FILE  Write the tiles as a stream of float records to FILE, which may be a named
+//                  pipe, or to standard output for "-"
+//   --framebuffer FILE
+//                  Write the image to FILE as a PFM file of linear floats, mapped into memory
+//                  and filled in tile by tile
+//
+// Parts of the image can be rendered on their own, tracing only their pixels. Rectangles are
+// given as X,Y,W,H: W by H pixels whose top-left corner is at column X and row Y.
+//
+//   --crop X,Y,W,H Render only this rectangle, and write it as an image of its own
+//   --region X,Y,W,H
+//                  Render only the pixels in this rectangle, leaving the rest of the image
+//                  black. May be repeated; with --crop, the regions are clipped to it.
+//   --regions FILE Read more regions from FILE, one per line as X Y W H
+//   --composite FILE
+//                  Write the rendered pixels over a copy of the PPM image FILE, for example
+//                  an earlier full render of the scene, instead of over black
+//
+// Render jobs can also go to a long-running server that keeps scenes loaded between jobs
+// (see render_service.h), which trusts its clients with the server's files. ADDRESS is
+// host:port for TCP, where an empty host is the loopback interface and 0.0.0.0 every
+// interface, or else the path of a Unix domain socket:
+//
+//   --serve ADDRESS
+//                  Serve render jobs on ADDRESS instead of rendering a scene
+//   --scene-cache N
+//                  Number of scenes the server keeps loaded (default 8)
+//   --connect ADDRESS
+//                  Render the scene on the server at ADDRESS
+//   --workers ADDRESS,ADDRESS...
+//                  Split the image into tiles rendered by the servers at these addresses,
+//                  retrying tiles of lost workers on the others (see tile_coordinator.h)
+//   --tile N       Edge of the tiles handed to workers in pixels (default 128)
+
+const char* default_scene = "scenes/ray_tracer_final_image.scene";
+
+struct render_options {
+    std::string scene_file = default_scene;
+    std::string output;
+    int width = -1;
+    int samples_per_pixel = -1;
+    int max_depth = -1;
+    int threads = -1;
+    std::uint64_t seed = 0;
+    bool heatmap = false;
+    bool light_sampling = true;
+    long long texture_cache_mb = -1;
+    int frames = 1;
+    std::string camera_settings;
+    std::string serve;
+    std::string connect;
+    int cached_scenes = 8;
+    std::vector<std::string> workers;
+    int worker_tile = 128;
+    pixel_rect crop;
+    std::vector<pixel_rect> regions;
+    std::string composite;
+    std::string stream;
+    std::string framebuffer;
+    std::string tile_order;
+    std::string tile_report;
+};
+
+void print_usage(std::ostream& out) {
+    out << "Usage: COMS3360Renderer [scene-file] [--width N] [--spp N] [--depth N]\n"
+        << "                        [--threads N] [--seed N] [--output FILE] [--heatmap]\n"
+        << "                        [--texture-cache MB] [--no-light-sampling] [--frames N]\n"
+        << "                        [--camera SETTINGS] [--tile-order ORDER]\n"
+        << "                        [--tile-report FILE]\n"
+        << "                        [--connect ADDRESS]\n"
+        << "                        [--workers ADDRESS,ADDRESS... [--tile N]]\n"
+        << "                        [--crop X,Y,W,H] [--region X,Y,W,H]... [--regions FILE]\n"
+        << "                        [--composite FILE] [--stream FILE] [--framebuffer FILE]\n"
+        << "       COMS3360Renderer --serve ADDRESS [--scene-cache N] [--threads N]\n"
+        << "Default scene: " << default_scene << "\n";
 }
 
-void checkered_spheres() {
-    hittable_list world;
-
-    auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
-
-    world.add(make_shared<sphere>(point3(0, -10, 0), 10, make_shared<lambertian>(checker)));
-    world.add(make_shared<sphere>(point3(0, 10, 0), 10, make_shared<lambertian>(checker)));
-
-    camera cam;
-
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 400;
-    cam.samples_per_pixel = 100;
-    cam.max_depth = 50;
-    cam.background = color(0.70, 0.80, 1.00);
-
-    cam.vfov = 20;
-    cam.lookfrom = point3(13, 2, 3);
-    cam.lookat = point3(0, 0, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 0;
-
-    cam.render(world);
-}
-
-void earth() {
-    auto earth_texture = make_shared<image_texture>("earthmap.jpg");
-    auto earth_surface = make_shared<lambertian>(earth_texture);
-    auto globe = make_shared<sphere>(point3(0, 0, 0), 2, earth_surface);
-
-    camera cam;
-
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 400;
-    cam.samples_per_pixel = 100;
-    cam.max_depth = 50;
-    cam.background = color(0.70, 0.80, 1.00);
-
-    cam.vfov = 20;
-    cam.lookfrom = point3(0, 0, 12);
-    cam.lookat = point3(0, 0, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 0;
-
-    cam.render(hittable_list(globe));
-}
-
-void perlin_spheres() {
-    hittable_list world;
-
-    auto pertext = make_shared<noise_texture>(4);
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
-    world.add(make_shared<sphere>(point3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
-
-    camera cam;
-
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 400;
-    cam.samples_per_pixel = 100;
-    cam.max_depth = 50;
-    cam.background = color(0.70, 0.80, 1.00);
-
-    cam.vfov = 20;
-    cam.lookfrom = point3(13, 2, 3);
-    cam.lookat = point3(0, 0, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 0;
-
-    cam.render(world);
-}
-
-void quads() {
-    hittable_list world;
-
-    // Materials
-    auto left_red = make_shared<lambertian>(color(1.0, 0.2, 0.2));
-    auto back_green = make_shared<lambertian>(color(0.2, 1.0, 0.2));
-    auto right_blue = make_shared<lambertian>(color(0.2, 0.2, 1.0));
-    auto upper_orange = make_shared<lambertian>(color(1.0, 0.5, 0.0));
-    auto lower_teal = make_shared<lambertian>(color(0.2, 0.8, 0.8));
-    auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
-
-    // Quads
-    world.add(make_shared<quad>(point3(-3, -2, 5), vec3(0, 0, -4), vec3(0, 4, 0), left_red));
-    world.add(make_shared<triangle>(point3(-2, -2, 0), vec3(4, 0, 0), vec3(0, 4, 0), make_shared<lambertian>(checker)));
-    world.add(make_shared<quad>(point3(3, -2, 1), vec3(0, 0, 4), vec3(0, 4, 0), right_blue));
-    world.add(make_shared<quad>(point3(-2, 3, 1), vec3(4, 0, 0), vec3(0, 0, 4), upper_orange));
-    world.add(make_shared<quad>(point3(-2, -3, 5), vec3(4, 0, 0), vec3(0, 0, -4), lower_teal));
-
-    camera cam;
-
-    cam.aspect_ratio = 1.0;
-    cam.image_width = 400;
-    cam.samples_per_pixel = 100;
-    cam.max_depth = 50;
-    cam.background = color(0.70, 0.80, 1.00);
-
-    cam.vfov = 80;
-    cam.lookfrom = point3(0, 0, 9);
-    cam.lookat = point3(0, 0, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 0;
-
-    cam.render(world);
+pixel_rect parse_rect(const std::string& text, const std::string& name) {
+    // X,Y,W,H, or X Y W H, as non-negative whole numbers. Throws std::invalid_argument if the
+    // text is anything else.
+    std::istringstream in(text);
+    pixel_rect rect;
+    char separator;
+    bool commas = text.find(',') != std::string::npos;
+    in >> rect.x;
+    if (commas) in >> separator;
+    in >> rect.y;
+    if (commas) in >> separator;
+    in >> rect.width;
+    if (commas) in >> separator;
+    in >> rect.height;
+    if (!in || !(in >> std::ws).eof() || rect.x < 0 || rect.y < 0 || rect.empty())
+        throw std::invalid_argument(name + " needs a rectangle X,Y,W,H");
+    return rect;
 }
 
-void simple_light() {
-    hittable_list world;
-
-    auto pertext = make_shared<noise_texture>(4);
-    auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
-    world.add(make_shared<sphere>(point3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
-    auto difflight = make_shared<diffuse_light>(color(4, 4, 4));
-    world.add(make_shared<sphere>(point3(0, 7, 0), 2, difflight));
-    world.add(make_shared<quad>(point3(3, 1, -2), vec3(2, 0, 0), vec3(0, 2, 0), difflight));
-
-    camera cam;
-
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 1200;
-    cam.samples_per_pixel = 100;
-    cam.max_depth = 50;
-    cam.background = color(0, 0, 0);
-
-    cam.vfov = 20;
-    cam.lookfrom = point3(26, 3, 6);
-    cam.lookat = point3(0, 2, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 0;
-
-    cam.render(world);
+void read_regions(const std::string& filename, std::vector<pixel_rect>& regions) {
+    // Appends the regions listed in the file, one per line. Blank lines and lines starting
+    // with '#' are skipped.
+    std::ifstream in(filename);
+    if (!in.is_open())
+        throw std::invalid_argument("cannot open region file '" + filename + "'");
+    std::string line;
+    while (std::getline(in, line)) {
+        auto start = line.find_first_not_of(" \t\r");
+        if (start != std::string::npos && line[start] != '#')
+            regions.push_back(parse_rect(line, "each line of '" + filename + "'"));
+    }
 }
 
-void cornell_box() {
-    hittable_list world;
-
-    auto red = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light = make_shared<diffuse_light>(color(15, 15, 15));
-
-
-    world.add(make_shared<quad>(point3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
-    world.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
-    world.add(make_shared<quad>(point3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light));
-    world.add(make_shared<quad>(point3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
-    world.add(make_shared<quad>(point3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
-    world.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
-
-    shared_ptr<hittable> box1 = box(point3(0, 0, 0), point3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265, 0, 295));
-    world.add(box1);
-
-    shared_ptr<hittable> box2 = box(point3(0, 0, 0), point3(165, 165, 165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130, 0, 65));
-    world.add(box2);
-
-
-    camera cam;
-
-    cam.aspect_ratio = 1.0;
-    cam.image_width = 600;
-    cam.samples_per_pixel = 10;
-    cam.max_depth = 50;
-    cam.background = color(0, 0, 0);
-
-    cam.vfov = 40;
-    cam.lookfrom = point3(278, 278, -800);
-    cam.lookat = point3(278, 278, 0);
-    cam.vup = vec3(0, 1, 0);
+bool parse_options(int argc, char* argv[], render_options& options) {
+    // Fills in `options` from the command line. Returns false if the program should exit
+    // without rendering, and throws std::invalid_argument on a malformed command line.
+    bool have_scene = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        auto value = [&](const std::string& name) -> std::string {
+            if (i + 1 >= argc)
+                throw std::invalid_argument(name + " needs a value");
+            return argv[++i];
+        };
+        auto count = [&](const std::string& name) {
+            auto text = value(name);
+            size_t used = 0;
+            long long n = -1;
+            try { n = std::stoll(text, &used); } catch (const std::exception&) {}
+            if (used != text.size() || n < 0)
+                throw std::invalid_argument(name + " needs a non-negative integer");
+            return n;
+        };
+
+        if (arg == "--help" || arg == "-h") {
+            print_usage(std::cout);
+            return false;
+        }
+        else if (arg == "--width")   options.width = int(count(arg));
+        else if (arg == "--spp")     options.samples_per_pixel = int(count(arg));
+        else if (arg == "--depth")   options.max_depth = int(count(arg));
+        else if (arg == "--threads") options.threads = int(count(arg));
+        else if (arg == "--seed")    options.seed = std::uint64_t(count(arg));
+        else if (arg == "--output")  options.output = value(arg);
+        else if (arg == "--heatmap") options.heatmap = true;
+        else if (arg == "--no-light-sampling") options.light_sampling = false;
+        else if (arg == "--texture-cache") options.texture_cache_mb = count(arg);
+        else if (arg == "--frames")  options.frames = int(count(arg));
+        else if (arg == "--camera")  options.camera_settings = value(arg);
+        else if (arg == "--serve")   options.serve = value(arg);
+        else if (arg == "--connect") options.connect = value(arg);
+        else if (arg == "--scene-cache") options.cached_scenes = int(count(arg));
+        else if (arg == "--tile")    options.worker_tile = int(count(arg));
+        else if (arg == "--crop")    options.crop = parse_rect(value(arg), arg);
+        else if (arg == "--region")  options.regions.push_back(parse_rect(value(arg), arg));
+        else if (arg == "--regions") read_regions(value(arg), options.regions);
+        else if (arg == "--composite") options.composite = value(arg);
+        else if (arg == "--stream")  options.stream = value(arg);
+        else if (arg == "--framebuffer") options.framebuffer = value(arg);
+        else if (arg == "--tile-order") options.tile_order = value(arg);
+        else if (arg == "--tile-report") options.tile_report = value(arg);
+        else if (arg == "--workers") {
+            auto list = value(arg);
+            for (size_t start = 0; start <= list.size();) {
+                auto comma = std::min(list.find(',', start), list.size());
+                if (comma > start)
+                    options.workers.push_back(list.substr(start, comma - start));
+                start = comma + 1;
+            }
+        }
+        else if (arg.rfind("--", 0) == 0)
+            throw std::invalid_argument("unknown option " + arg);
+        else if (!have_scene) {
+            options.scene_file = arg;
+            have_scene = true;
+        }
+        else
+            throw std::invalid_argument("unexpected argument " + arg);
+    }
 
-    cam.defocus_angle = 0;
+    if (options.heatmap && !traversal_stats_enabled)
+        throw std::invalid_argument("--heatmap needs a build with RTW_TRAVERSAL_STATS");
+    if (options.heatmap && options.output.empty())
+        throw std::invalid_argument("--heatmap needs --output");
+    if (options.frames < 1)
+        throw std::invalid_argument("--frames needs at least one frame");
+    if (options.frames > 1 && options.output.empty() && options.stream.empty()
+        && options.framebuffer.empty())
+        throw std::invalid_argument("--frames needs --output, --stream or --framebuffer");
+    if (!options.connect.empty() && !options.workers.empty())
+        throw std::invalid_argument("--connect and --workers cannot be combined");
+    bool remote = !options.connect.empty() || !options.workers.empty();
+    if (remote && (options.heatmap || options.frames > 1))
+        throw std::invalid_argument("remote renders are single images without --heatmap");
+    if (!options.connect.empty() && (!options.tile_order.empty() || !options.tile_report.empty()))
+        throw std::invalid_argument("--tile-order and --tile-report need a local render or --workers");
+    if (!options.tile_order.empty() && options.tile_order != "raster" && options.tile_order != "cost")
+        throw std::invalid_argument("--tile-order needs raster or cost");
+
+    if (!options.composite.empty() && options.frames > 1)
+        throw std::invalid_argument("--composite renders single images");
+
+    // Regions are clipped to the crop window here, so that only regions reach the camera and
+    // the workers keep the window for their tiles.
+    if (!options.crop.empty()) {
+        auto regions = selected_regions(options.crop.x + options.crop.width,
+                                        options.crop.y + options.crop.height,
+                                        options.crop, options.regions);
+        if (regions.empty())
+            throw std::invalid_argument("every region lies outside the crop window");
+        options.regions = regions;
+    }
 
-    cam.render(world);
+    return true;
 }
 
-void cornell_smoke() {
-    hittable_list world;
-
-    auto red = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light = make_shared<diffuse_light>(color(7, 7, 7));
-
-    world.add(make_shared<quad>(point3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
-    world.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
-    world.add(make_shared<quad>(point3(113, 554, 127), vec3(330, 0, 0), vec3(0, 0, 305), light));
-    world.add(make_shared<quad>(point3(0, 555, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
-    world.add(make_shared<quad>(point3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
-    world.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
-
-    shared_ptr<hittable> box1 = box(point3(0, 0, 0), point3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265, 0, 295));
-
-    shared_ptr<hittable> box2 = box(point3(0, 0, 0), point3(165, 165, 165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130, 0, 65));
-
-    world.add(make_shared<constant_medium>(box1, 0.01, color(0, 0, 0)));
-    world.add(make_shared<constant_medium>(box2, 0.01, color(1, 1, 1)));
-
-    camera cam;
-
-    cam.aspect_ratio = 1.0;
-    cam.image_width = 600;
-    cam.samples_per_pixel = 200;
-    cam.max_depth = 50;
-    cam.background = color(0, 0, 0);
-
-    cam.vfov = 40;
-    cam.lookfrom = point3(278, 278, -800);
-    cam.lookat = point3(278, 278, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 0;
-
-    cam.render(world);
+void apply_options(const render_options& options, camera& cam) {
+    apply_camera_settings(cam, options.camera_settings, "--camera");
+    if (options.width > 0)              cam.image_width = options.width;
+    if (options.samples_per_pixel > 0)  cam.samples_per_pixel = options.samples_per_pixel;
+    if (options.max_depth >= 0)         cam.max_depth = options.max_depth;
+    if (options.threads >= 0)           cam.threads = options.threads;
+    cam.seed = options.seed;
+    cam.record_traversal = options.heatmap;
+    cam.light_sampling = options.light_sampling;
+    cam.cost_ordering = options.tile_order == "cost";
+    if (!options.regions.empty())
+        cam.regions = options.regions;
 }
 
-void final_scene(int image_width, int samples_per_pixel, int max_depth) {
-    hittable_list boxes1;
-    auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
-
-    int boxes_per_side = 20;
-    for (int i = 0; i < boxes_per_side; i++) {
-        for (int j = 0; j < boxes_per_side; j++) {
-            auto w = 100.0;
-            auto x0 = -1000.0 + i * w;
-            auto z0 = -1000.0 + j * w;
-            auto y0 = 0.0;
-            auto x1 = x0 + w;
-            auto y1 = random_double(1, 101);
-            auto z1 = z0 + w;
-
-            boxes1.add(box(point3(x0, y0, z0), point3(x1, y1, z1), ground));
-        }
+void write_image(const render_options& options, const std::string& output, int width,
+                 int height, std::vector<color> pixels) {
+    // Writes the rendered image to `output`, or standard output if it is empty: cropped to
+    // the crop window, or with its regions written over the image to composite into.
+    auto parts = selected_regions(width, height, pixel_rect(), options.regions);
+
+    if (!options.composite.empty()) {
+        std::ifstream in(options.composite, std::ios::binary);
+        int base_width, base_height;
+        std::vector<color> base;
+        if (!in.is_open() || !read_ppm(in, base_width, base_height, base))
+            throw std::runtime_error("Cannot read PPM image '" + options.composite + "'");
+        if (base_width != width || base_height != height)
+            throw std::runtime_error("'" + options.composite + "' is not the size of the render");
+        for (const auto& part : parts)
+            for (int j = part.y; j < part.y + part.height; j++)
+                for (int i = part.x; i < part.x + part.width; i++)
+                    base[size_t(j) * width + i] = pixels[size_t(j) * width + i];
+        pixels = std::move(base);
+    } else if (!options.crop.empty()) {
+        auto crop = options.crop.intersect(pixel_rect { 0, 0, width, height });
+        if (crop.empty())
+            throw std::runtime_error("the crop window lies outside the image");
+        std::vector<color> cropped;
+        cropped.reserve(size_t(crop.width) * crop.height);
+        for (int j = crop.y; j < crop.y + crop.height; j++)
+            for (int i = crop.x; i < crop.x + crop.width; i++)
+                cropped.push_back(pixels[size_t(j) * width + i]);
+        pixels = std::move(cropped);
+        width = crop.width;
+        height = crop.height;
     }
 
-    hittable_list world;
-
-    world.add(make_shared<bvh_node>(boxes1));
-
-    auto light = make_shared<diffuse_light>(color(7, 7, 7));
-    world.add(make_shared<quad>(point3(123, 554, 147), vec3(300, 0, 0), vec3(0, 0, 265), light));
-
-    auto center1 = point3(400, 400, 200);
-    auto center2 = center1 + vec3(30, 0, 0);
-    auto sphere_material = make_shared<lambertian>(color(0.7, 0.3, 0.1));
-    world.add(make_shared<sphere>(center1, center2, 50, sphere_material));
-
-    world.add(make_shared<sphere>(point3(260, 150, 45), 50, make_shared<dielectric>(1.5)));
-    world.add(make_shared<sphere>(
-        point3(0, 150, 145), 50, make_shared<metal>(color(0.8, 0.8, 0.9), 1.0)
-    ));
-
-    auto boundary = make_shared<sphere>(point3(360, 150, 145), 70, make_shared<dielectric>(1.5));
-    world.add(boundary);
-    world.add(make_shared<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
-    boundary = make_shared<sphere>(point3(0, 0, 0), 5000, make_shared<dielectric>(1.5));
-    world.add(make_shared<constant_medium>(boundary, .0001, color(1, 1, 1)));
-
-    auto emat = make_shared<lambertian>(make_shared<image_texture>("earthmap.jpg"));
-    world.add(make_shared<sphere>(point3(400, 200, 400), 100, emat));
-    auto pertext = make_shared<noise_texture>(0.2);
-    world.add(make_shared<sphere>(point3(220, 280, 300), 80, make_shared<lambertian>(pertext)));
-
-    hittable_list boxes2;
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    int ns = 1000;
-    for (int j = 0; j < ns; j++) {
-        boxes2.add(make_shared<sphere>(point3::random(0, 165), 10, white));
+    if (output.empty()) {
+        write_ppm(std::cout, width, height, pixels);
+    } else {
+        std::ofstream out(output);
+        if (!out.is_open())
+            throw std::runtime_error("Cannot open output file '" + output + "'");
+        write_ppm(out, width, height, pixels);
     }
-
-    world.add(make_shared<translate>(
-            make_shared<rotate_y>(
-                make_shared<bvh_node>(boxes2), 15),
-            vec3(-100, 270, 395)
-        )
-    );
-
-    camera cam;
-
-    cam.aspect_ratio = 1.0;
-    cam.image_width = image_width;
-    cam.samples_per_pixel = samples_per_pixel;
-    cam.max_depth = max_depth;
-    cam.background = color(0, 0, 0);
-
-    cam.vfov = 40;
-    cam.lookfrom = point3(478, 278, -600);
-    cam.lookat = point3(278, 278, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 0;
-
-    cam.render(world);
 }
 
-void test_obj_loader() {
-    hittable_list world;
-
-    auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
-
-    try {
-        std::vector<point3> vertices = load_obj("./cloud.obj");
-        std::clog << "Loaded " << vertices.size() << " vertices from OBJ file\n";
-        std::clog << "Number of triangles: " << vertices.size() / 3 << "\n";
-
-        auto obj_material = make_shared<lambertian>(color(.65, .05, .05));
-
-        for (size_t i = 0; i + 2 < vertices.size(); i += 3) {
-            point3 v0 = vertices[i];
-            point3 v1 = vertices[i + 1];
-            point3 v2 = vertices[i + 2];
-
-            vec3 u = v1 - v0;
-            vec3 v = v2 - v0;
-
-            world.add(make_shared<triangle>(v0, u, v, obj_material));
-        }
-    } catch (const std::exception &e) {
-        std::cerr << "Error loading OBJ file: " << e.what() << "\n";
-        return;
+void write_tile_report(const std::string& filename, const std::vector<tile_timing>& timings,
+                       double seconds, double prepass_seconds, double tail_seconds) {
+    // Writes one line per tile: its rectangle, its share of the predicted cost and its
+    // measured time, then how long the render took and how long of that threads or workers
+    // sat idle at the end.
+    std::ofstream out(filename);
+    if (!out.is_open())
+        throw std::runtime_error("Cannot open output file '" + filename + "'");
+
+    double predicted_total = 0;
+    for (const auto& tile : timings)
+        predicted_total += tile.predicted;
+
+    out << "# x y width height predicted_share measured_ms\n";
+    for (const auto& tile : timings) {
+        out << tile.rect.x << ' ' << tile.rect.y << ' ' << tile.rect.width << ' ' << tile.rect.height
+            << ' ' << (predicted_total > 0 ? tile.predicted / predicted_total : 0)
+            << ' ' << 1000 * tile.seconds << '\n';
     }
-    camera cam;
-
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 800;
-    cam.samples_per_pixel = 50;
-    cam.max_depth = 50;
-    cam.background = color(0.70, 0.80, 1.00);
-
-    cam.vfov = 40;
-    cam.lookfrom = point3(0, 1, 3);
-    cam.lookat = point3(0, 1, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 0;
-
-    cam.render(world);
+    out << "# render " << 1000 * seconds << " ms, prepass " << 1000 * prepass_seconds
+        << " ms, tail " << 1000 * tail_seconds << " ms\n";
 }
 
-//DEMO FEATURE REDNDERS FOR FINAL
-//Scene 1: Depth of field
-void depth_of_field_demo() {
-    hittable_list world;
-
-    auto ground = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    auto red = make_shared<lambertian>(color(0.8, 0.2, 0.2));
-    auto blue = make_shared<lambertian>(color(0.2, 0.2, 0.8));
-    auto green = make_shared<lambertian>(color(0.2, 0.8, 0.2));
-
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground));
-
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, red));
-    world.add(make_shared<sphere>(point3(-4, 1, -7), 1.0, blue));
-    world.add(make_shared<sphere>(point3(3, 1, 4), 1.0, green));
-
-    camera cam;
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 800;
-    cam.samples_per_pixel = 100;
-    cam.max_depth = 50;
-    cam.background = color(0.70, 0.80, 1.00);
-
-    cam.vfov = 30;
-    cam.lookfrom = point3(0, 2, 12);
-    cam.lookat = point3(0, 1, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 2;
-    cam.focus_dist = 12.0;
-
-    cam.render(world);
+size_t extension_start(const std::string& filename) {
+    // Position of the extension's dot in `filename`, or its length if it has no extension.
+    auto dot = filename.find_last_of('.');
+    if (dot == std::string::npos || filename.find('/', dot) != std::string::npos)
+        return filename.size();
+    return dot;
 }
 
-// Scene 2: Configurable Camera Demo
-void camera_fov_demo() {
-    hittable_list world;
-
-    auto ground = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    auto metal_mat = make_shared<metal>(color(0.8, 0.6, 0.2), 0.3);
-    auto red = make_shared<lambertian>(color(0.8, 0.2, 0.2));
-
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground));
-
-    world.add(make_shared<sphere>(point3(-2, 1, 0), 1.0, metal_mat));
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, red));
-
-    camera cam;
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 800;
-    cam.samples_per_pixel = 50;
-    cam.max_depth = 50;
-    cam.background = color(0.70, 0.80, 1.00);
-
-    cam.vfov = 20;
-    cam.lookfrom = point3(-1, 8, 0);
-    cam.lookat = point3(0, 1, 0);
-    cam.vup = vec3(0, 0, -1);
-
-    cam.defocus_angle = 0;
-
-    cam.render(world);
+std::string frame_filename(const std::string& output, int frame) {
+    // <output> with the frame number, padded to four digits, added before its extension.
+    auto number = std::to_string(frame);
+    if (number.size() < 4)
+        number.insert(0, 4 - number.size(), '0');
+    auto dot = extension_start(output);
+    return output.substr(0, dot) + "_" + number + output.substr(dot);
 }
 
-// Scene 3: Motion Blur
-void motion_blur_demo() {
-    hittable_list world;
-
-    auto ground = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    auto moving_mat = make_shared<lambertian>(color(0.8, 0.2, 0.2));
-    auto static_mat = make_shared<metal>(color(0.7, 0.7, 0.9), 0.1);
-
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground));
-
-    auto center1 = point3(-2, 1, 0);
-    auto center2 = center1 + vec3(0, 0.5, 0);
-    world.add(make_shared<sphere>(center1, center2, 0.7, moving_mat));
-
-    world.add(make_shared<sphere>(point3(2, 1, 0), 0.7, static_mat));
-    world.add(make_shared<sphere>(point3(0, 0.5, -2), 0.5, static_mat));
-
-    camera cam;
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 800;
-    cam.samples_per_pixel = 100;
-    cam.max_depth = 50;
-    cam.background = color(0.70, 0.80, 1.00);
-
-    cam.vfov = 40;
-    cam.lookfrom = point3(0, 2, 8);
-    cam.lookat = point3(0, 1, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 0;
-
-    cam.render(world);
+std::unique_ptr<tile_writer> make_tile_writer(const render_options& options, int frame) {
+    // A writer for the tile outputs asked for, with the frame number in their filenames when
+    // rendering an animation, or null if there are none.
+    auto filename = [&](const std::string& name) {
+        return (options.frames > 1 && name != "-") ? frame_filename(name, frame) : name;
+    };
+
+    std::vector<std::unique_ptr<tile_sink>> sinks;
+    if (!options.stream.empty())
+        sinks.push_back(std::make_unique<tile_stream_sink>(filename(options.stream)));
+    if (!options.framebuffer.empty())
+        sinks.push_back(std::make_unique<mapped_framebuffer_sink>(filename(options.framebuffer)));
+    if (sinks.empty())
+        return nullptr;
+    return std::make_unique<tile_writer>(std::move(sinks));
 }
 
-// Scene 5: All Materials Demo and Perlin Noise
-void materials_showcase() {
-    hittable_list world;
-
-    auto perlin = make_shared<noise_texture>(4);
-    auto ground_mat = make_shared<lambertian>(perlin);
-    auto lambertian_mat = make_shared<lambertian>(color(0.8, 0.3, 0.3));
-    auto metal_mat = make_shared<metal>(color(0.8, 0.8, 0.9), 0.1);
-    auto metal_fuzzy = make_shared<metal>(color(0.9, 0.7, 0.5), 0.5);
-    auto glass_mat = make_shared<dielectric>(1.5);
-    auto light_mat = make_shared<diffuse_light>(color(4, 4, 4));
-
-    //Perlin Noise for ground
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_mat));
-
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, glass_mat)); // Glass
-    world.add(make_shared<sphere>(point3(-2, 1, 0), 1.0, metal_mat)); // Metal
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, lambertian_mat)); // Lambertian
-    world.add(make_shared<sphere>(point3(2, 1, 0), 1.0, metal_fuzzy)); // Metal
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, light_mat)); // Light
-
-    camera cam;
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 800;
-    cam.samples_per_pixel = 100;
-    cam.max_depth = 50;
-    cam.background = color(0.05, 0.05, 0.05);
-
-    cam.vfov = 40;
-    cam.lookfrom = point3(0, 2, 12);
-    cam.lookat = point3(0, 1, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 0;
-
-    cam.render(world);
+void finish_tile_output(tile_writer* writer) {
+    // Waits for the writer, if any, to write out the last tiles, and reports how it kept up.
+    if (!writer)
+        return;
+    writer->finish();
+    const auto& stats = writer->stats();
+    std::clog << "Tile output: " << stats.tiles << " tiles written in " << stats.write_seconds
+              << " s, queue peaked at " << stats.peak_queue << " tiles, render threads waited "
+              << 1000 * stats.wait_seconds << " ms\n";
 }
 
-void ray_tracer_final_image() {
-    hittable_list world;
-
-    // Ground
-    auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
-    world.add(make_shared<sphere>(point3(0, -1000, 0),1000,make_shared<lambertian>(checker)));
+void render_on_servers(const render_options& options) {
+    // Sends the scene and settings as a job to the server, or splits it across the workers,
+    // and writes the image that comes back. The scene file is named by its absolute path,
+    // since the servers have their own working directories.
+    render_job job;
+    job.scene_file = std::filesystem::absolute(options.scene_file).string();
+    job.seed = options.seed;
+    job.light_sampling = options.light_sampling;
+    job.settings = options.camera_settings;
+    if (options.width > 0)             job.settings += " width " + std::to_string(options.width);
+    if (options.samples_per_pixel > 0) job.settings += " spp " + std::to_string(options.samples_per_pixel);
+    if (options.max_depth >= 0)        job.settings += " depth " + std::to_string(options.max_depth);
+    for (const auto& r : options.regions) {
+        job.settings += " region " + std::to_string(r.x) + " " + std::to_string(r.y) + " "
+                      + std::to_string(r.width) + " " + std::to_string(r.height);
+    }
 
-    // OBJ model - cloud
-    try {
-        std::vector<point3> vertices = load_obj("./cloud.obj");
-        std::clog << "Loaded " << vertices.size() << " vertices from OBJ file\n";
-        std::clog << "Number of triangles: " << vertices.size() / 3 << "\n";
+    // As with local renders, the whole image is only kept in memory to write it with
+    // --output, or to standard output when no tile output is asked for.
+    auto start = std::chrono::steady_clock::now();
+    auto writer = make_tile_writer(options, 0);
+    bool keep_image = !writer || !options.output.empty();
+    std::vector<color> pixels;
+    int width = 0, height = 0;
+    bool begun = false;
+    auto begin_image = [&](int w, int h) {
+        width = w;
+        height = h;
+        begun = true;
+        if (keep_image)
+            pixels.assign(size_t(width) * height, color(0,0,0));
+        if (writer)
+            writer->begin(width, height);
+    };
+    auto on_tile = [&](const image_tile& tile) {
+        if (keep_image)
+            paste_tile(pixels, width, tile);
+        if (writer)
+            writer->push(tile);
+    };
+
+    if (options.workers.empty()) {
+        // The server sends the size before any tile.
+        render_client(options.connect).render(job, width, height, [&](const image_tile& tile) {
+            if (!begun)
+                begin_image(width, height);
+            on_tile(tile);
+        });
+        if (!begun)
+            begin_image(width, height);
+    } else {
+        tile_coordinator coordinator(options.workers, options.worker_tile, 3, options.tile_order != "raster");
+        coordinator.render(job, begin_image, on_tile);
+        std::clog << "\rWorkers idle for the last " << 1000 * coordinator.tail_seconds << " ms\n";
+        if (!options.tile_report.empty()) {
+            write_tile_report(options.tile_report, coordinator.tile_timings(), coordinator.seconds,
+                              0, coordinator.tail_seconds);
+        }
+    }
+    auto where = options.workers.empty() ? options.connect
+                                         : std::to_string(options.workers.size()) + " workers";
+    std::clog << "\rRendered " << width << "x" << height << " on " << where << " in "
+              << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+              << " s\n";
+
+    finish_tile_output(writer.get());
+    if (keep_image)
+        write_image(options, options.output, width, height, std::move(pixels));
+}
 
-        auto obj_material = make_shared<lambertian>(color(.65, .05, .05));
+void write_traversal_report(const std::string& output, const camera& cam) {
+    // Writes a heatmap per traversal counter as <output>.<counter>.ppm, and the totals and
+    // histograms as <output>.stats.txt, where <output> is the image file without extension.
+    auto stem = output.substr(0, extension_start(output));
+
+    std::ofstream stats(stem + ".stats.txt");
+    if (!stats.is_open())
+        throw std::runtime_error("Cannot open output file '" + stem + ".stats.txt'");
+
+    for (const auto& field : traversal_fields) {
+        auto filename = stem + "." + field.name + ".ppm";
+        std::ofstream image(filename);
+        if (!image.is_open())
+            throw std::runtime_error("Cannot open output file '" + filename + "'");
+        auto scale = write_heatmap(image, cam.pixel_traversal, cam.image_width, field,
+                                   cam.samples_per_pixel);
+        stats << filename << ": red is " << scale << " " << field.label << " per sample\n";
+    }
 
-        for (size_t i = 0; i + 2 < vertices.size(); i += 3) {
-            point3 v0 = vertices[i];
-            point3 v1 = vertices[i + 1];
-            point3 v2 = vertices[i + 2];
+    stats << "\n";
+    write_traversal_histograms(stats, cam.pixel_traversal, cam.samples_per_pixel);
+}
 
-            vec3 u = v1 - v0;
-            vec3 v = v2 - v0;
+int main(int argc, char* argv[]) {
+    render_options options;
 
-            world.add(make_shared<triangle>(v0, u, v, obj_material));
-        }
-    } catch (const std::exception &e) {
-        std::cerr << "Error loading OBJ file: " << e.what() << "\n";
-        return;
+    try {
+        if (!parse_options(argc, argv, options))
+            return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        print_usage(std::cerr);
+        return 2;
     }
 
-    // Smoke sphere - Behind
-    auto smoke_boundary = make_shared<sphere>(point3(0, 1.5, -3),1.5,make_shared<dielectric>(1.5));
-    world.add(make_shared<constant_medium>(smoke_boundary,0.5,color(0.9, 0.9, 0.9)));
+    try {
+        if (options.texture_cache_mb >= 0)
+            tile_cache::global().set_capacity(size_t(options.texture_cache_mb) << 20);
 
-    // Earth sphere - behind and left
-    auto earth_tex = make_shared<image_texture>("earthmap.jpg");
-    auto earth_mat = make_shared<lambertian>(earth_tex);
-    world.add(make_shared<sphere>(point3(-3, 1.5, -2),1.2,earth_mat));
+        if (!options.serve.empty())
+            render_server(size_t(options.cached_scenes), std::max(0, options.threads)).run(options.serve);
 
-    // Perlin noise sphere - behind and right
-    auto perlin_tex = make_shared<noise_texture>(3.0);
-    world.add(make_shared<sphere>(point3(3, 1.5, -2),1.2, make_shared<lambertian>(perlin_tex)));
+        // A reader of the tile stream that goes away shows up as a failed write, not SIGPIPE.
+        if (!options.stream.empty())
+            std::signal(SIGPIPE, SIG_IGN);
 
-    // Bouncing sphere in front
-    auto bounce_mat = make_shared<lambertian>(color(0.8, 0.2, 0.2));
-    point3 bounce_start(-1, 0.6, 1.5);
-    point3 bounce_end = bounce_start + vec3(0, 0.6, 0);
-    world.add(make_shared<sphere>(bounce_start,bounce_end,0.5,bounce_mat));
+        if (!options.connect.empty() || !options.workers.empty()) {
+            render_on_servers(options);
+            return 0;
+        }
 
-    // Light
-    auto light = make_shared<diffuse_light>(color(6, 6, 6));
-    world.add(make_shared<quad>(point3(-2, 5, 2),vec3(4, 0, 0),vec3(0, 0, -4),light));
+        seed_random(options.seed);
+        scene s = load_scene(options.scene_file);
+        apply_options(options, s.cam);
 
-    camera cam;
+        if (auto images = texture_manager::image_count()) {
+            std::clog << "Textures: " << images << " images, "
+                      << texture_manager::resident_bytes() / (1024.0 * 1024.0) << " MiB resident\n";
+        }
 
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 800;
-    cam.samples_per_pixel = 50;
-    cam.max_depth = 50;
-    cam.background = color(0.05, 0.05, 0.08);
+        if (!s.lights.empty() && s.cam.light_sampling)
+            std::clog << "Lights: " << s.lights.size() << " sampled through the light tree\n";
+
+        if (options.frames > 1 && s.animations.empty())
+            std::clog << "Warning: the scene has no animated objects\n";
+
+        for (int frame = 0; frame < options.frames; frame++) {
+            // Frames with only tile outputs have no image file, and are never held whole.
+            auto output = (options.frames > 1 && !options.output.empty())
+                        ? frame_filename(options.output, frame) : options.output;
+
+            // The scene stays loaded between frames; only the animated objects and the
+            // bounds of the hierarchy above them change.
+            auto update_start = std::chrono::steady_clock::now();
+            auto rebuilt = s.set_frame(frame, options.frames);
+            auto update_ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - update_start).count();
+
+            auto render_start = std::chrono::steady_clock::now();
+            auto writer = make_tile_writer(options, frame);
+            tile_callback on_tile;
+            if (writer) {
+                writer->begin(s.cam.image_width, s.cam.height());
+                on_tile = [&](const image_tile& tile) { writer->push(tile); };
+            }
 
-    cam.vfov = 40;
-    cam.lookfrom = point3(0, 2, 6);
-    cam.lookat = point3(0, 1, 0);
-    cam.vup = vec3(0, 1, 0);
+            if (!writer || !output.empty()) {
+                auto pixels = s.cam.render_image(s.world, &s.lights, on_tile);
+                finish_tile_output(writer.get());
+                write_image(options, output, s.cam.image_width, s.cam.height(), std::move(pixels));
+            } else {
+                s.cam.render_tiles(s.world, &s.lights, on_tile);
+                finish_tile_output(writer.get());
+            }
 
-    cam.defocus_angle = 0;
+            if (options.frames > 1) {
+                auto render_seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - render_start).count();
+                std::clog << "Frame " << frame + 1 << "/" << options.frames << ": scene update "
+                          << update_ms << " ms (" << rebuilt << " subtrees rebuilt), render "
+                          << render_seconds << " s\n";
+            }
 
-    cam.render(world);
-}
+            if (s.cam.stats.prepass_seconds > 0) {
+                std::clog << "Tiles by predicted cost: prepass " << 1000 * s.cam.stats.prepass_seconds
+                          << " ms, threads idle for the last " << 1000 * s.cam.stats.tail_seconds
+                          << " ms\n";
+            }
+            if (!options.tile_report.empty()) {
+                write_tile_report(options.frames > 1 ? frame_filename(options.tile_report, frame)
+                                                     : options.tile_report,
+                                  s.cam.tile_timings, s.cam.stats.seconds,
+                                  s.cam.stats.prepass_seconds, s.cam.stats.tail_seconds);
+            }
 
+            if (options.heatmap)
+                write_traversal_report(output, s.cam);
+        }
 
-int main() {
-    switch (15) {
-        case 1: bouncing_spheres();
-            break;
-        case 2: checkered_spheres();
-            break;
-        case 3: earth();
-            break;
-        case 4: perlin_spheres();
-            break;
-        case 5: quads();
-            break;
-        case 6: simple_light();
-            break;
-        case 7: cornell_box();
-            break;
-        case 8: cornell_smoke();
-            break;
-        case 9: final_scene(800, 400, 40);
-            break;
-        case 10: test_obj_loader();
-            break;
-
-        //Feature demos for class
-        case 11: depth_of_field_demo();
-            break;
-        case 12: camera_fov_demo();
-            break; // Shows configurable FOV
-        case 13: motion_blur_demo();
-            break; // Shows motion blur
-        case 14: materials_showcase();
-            break; // Shows all materials + perlin
-        case 15: ray_tracer_final_image();
-            break;
-
-
-        default: final_scene(400, 250, 4);
-            break;
+        auto tiles = tile_cache::global().stats();
+        if (tiles.hits + tiles.misses > 0) {
+            std::clog << "Tile cache: " << tiles.hits << " hits, " << tiles.misses << " misses ("
+                      << 100.0 * tiles.misses / double(tiles.hits + tiles.misses) << "%), "
+                      << tiles.evictions << " evictions, "
+                      << tiles.resident_bytes / (1024.0 * 1024.0) << " of "
+                      << tiles.capacity_bytes / (1024.0 * 1024.0) << " MiB resident\n";
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
     }
+
+    return 0;
 }
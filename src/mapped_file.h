@@ -0,0 +1,61 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class mapped_file {
+  public:
+    explicit mapped_file(const char* filename, int advice = MADV_SEQUENTIAL) {
+        // Maps the whole file read-only into memory, passing `advice` on to madvise to describe
+        // how the mapping will be read. Throws std::invalid_argument if the file cannot be
+        // opened or mapped.
+
+        fd = ::open(filename, O_RDONLY);
+        if (fd < 0)
+            throw std::invalid_argument("Cannot open file");
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::invalid_argument("Cannot stat file");
+        }
+
+        length = static_cast<size_t>(st.st_size);
+        if (length == 0)
+            return;  // mmap rejects empty mappings; an empty file is just no data.
+
+        void* addr = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            ::close(fd);
+            throw std::invalid_argument("Cannot map file");
+        }
+
+        bytes = static_cast<const char*>(addr);
+        ::madvise(addr, length, advice);
+    }
+
+    ~mapped_file() {
+        if (bytes != nullptr) ::munmap(const_cast<char*>(bytes), length);
+        if (fd >= 0) ::close(fd);
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+  private:
+    int         fd = -1;
+    const char* bytes = nullptr;
+    size_t      length = 0;
+};
+
+#endif
@@ -28,6 +28,19 @@ class material {
     ) const {
         return false;
     }
+
+    // Diffuse materials scatter the same way whatever direction light arrives from, so they
+    // can be lit by sampling the lights directly. scattering_pdf() is the density, per
+    // steradian, of scatter() sending the ray out along `direction`.
+    virtual bool diffuse() const { return false; }
+
+    virtual double scattering_pdf(const hit_record& rec, const vec3& direction) const {
+        return 0;
+    }
+
+    // The index in the scene's light tree of the light that emits through this material, or
+    // -1 if it is not sampled directly.
+    virtual int light_index() const { return -1; }
 };
 
 
@@ -45,10 +58,18 @@ class lambertian : public material {
             scatter_direction = rec.normal;
 
         scattered = ray(rec.p, scatter_direction, r_in.time());
-        attenuation = tex->value(rec.u, rec.v, rec.p);
+        attenuation = tex->value(rec.u, rec.v, rec.p, rec.footprint);
         return true;
     }
 
+    bool diffuse() const override { return true; }
+
+    double scattering_pdf(const hit_record& rec, const vec3& direction) const override {
+        // scatter() picks cosine-weighted directions about the normal.
+        auto cos_theta = dot(rec.normal, unit_vector(direction));
+        return cos_theta < 0 ? 0 : cos_theta / pi;
+    }
+
   private:
     color albedo;
     shared_ptr<texture> tex;
@@ -63,7 +84,10 @@ class metal : public material {
     const override {
         vec3 reflected = reflect(r_in.direction(), rec.normal);
         reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
+        // Mirror and refraction paths keep the incoming ray cone, so that textures seen in
+        // them are still filtered. Diffuse bounces start without one.
         scattered = ray(rec.p, reflected, r_in.time());
+        scattered.set_cone(r_in.cone_width_at(rec.t), r_in.cone_spread());
         attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0);
     }
@@ -96,6 +120,7 @@ class dielectric : public material {
             direction = refract(unit_direction, rec.normal, ri);
 
         scattered = ray(rec.p, direction, r_in.time());
+        scattered.set_cone(r_in.cone_width_at(rec.t), r_in.cone_spread());
         return true;
     }
 
@@ -133,10 +158,16 @@ public:
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
     const override {
         scattered = ray(rec.p, random_unit_vector(), r_in.time());
-        attenuation = tex->value(rec.u, rec.v, rec.p);
+        attenuation = tex->value(rec.u, rec.v, rec.p, rec.footprint);
         return true;
     }
 
+    bool diffuse() const override { return true; }
+
+    double scattering_pdf(const hit_record& rec, const vec3& direction) const override {
+        return 1 / (4 * pi);
+    }
+
 private:
     shared_ptr<texture> tex;
 };
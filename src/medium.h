@@ -0,0 +1,90 @@
+#ifndef MEDIUM_H
+#define MEDIUM_H
+
+// The participating media that fill volumes. A medium gives the density (extinction per unit
+// length) at each point, and a majorant: a density it never exceeds. Along a stretch of ray
+// inside the volume it samples where the ray first scatters, and estimates how much light gets
+// through.
+//
+// The defaults handle any density by delta and ratio tracking: they step along the ray by
+// distances sampled from the majorant, as if the medium were that dense everywhere, and treat
+// the difference as null collisions that do not change the ray. Media whose density has a
+// closed form override them.
+class medium {
+public:
+    virtual ~medium() = default;
+
+    virtual double density(const point3& p) const = 0;
+
+    virtual double majorant() const = 0;
+
+    virtual bool sample_scatter(const ray& r, interval span, double& t) const {
+        // Delta tracking. Sets t to where the ray scatters within span and returns true, or
+        // returns false if it passes through.
+        auto sigma = majorant();
+        if (sigma <= 0)
+            return false;
+
+        auto step = -1.0 / (sigma * r.direction().length());
+        t = span.min;
+        while (true) {
+            t += step * std::log(random_double());
+            if (t >= span.max)
+                return false;
+            if (random_double() * sigma < density(r.at(t)))
+                return true;
+        }
+    }
+
+    virtual double transmittance(const ray& r, interval span) const {
+        // Ratio tracking. Returns an unbiased estimate of the fraction of light that crosses
+        // span without scattering or being absorbed.
+        auto sigma = majorant();
+        if (sigma <= 0)
+            return 1;
+
+        auto step = -1.0 / (sigma * r.direction().length());
+        auto t = span.min;
+        auto fraction = 1.0;
+        while (true) {
+            t += step * std::log(random_double());
+            if (t >= span.max)
+                return fraction;
+            fraction *= 1 - density(r.at(t)) / sigma;
+            if (fraction <= 0)
+                return 0;
+        }
+    }
+};
+
+class homogeneous_medium : public medium {
+public:
+    homogeneous_medium(double density) : sigma(density), neg_inv_density(-1.0/density) {}
+
+    double density(const point3& p) const override { return sigma; }
+
+    double majorant() const override { return sigma; }
+
+    bool sample_scatter(const ray& r, interval span, double& t) const override {
+        // Exponential free flight; every collision is real.
+        auto ray_len = r.direction().length();
+        auto dist_in_medium = (span.max - span.min) * ray_len;
+        auto scatter_dist = neg_inv_density * std::log(random_double());
+
+        if (scatter_dist > dist_in_medium)
+            return false;
+
+        t = span.min + scatter_dist / ray_len;
+        return true;
+    }
+
+    double transmittance(const ray& r, interval span) const override {
+        return std::exp(-sigma * (span.max - span.min) * r.direction().length());
+    }
+
+private:
+    double sigma;
+    double neg_inv_density;
+};
+
+#endif
@@ -0,0 +1,332 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "hittable.h"
+#include "OBJloader.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+
+// Three position indices making up one triangle of a triangle_mesh.
+struct mesh_triangle {
+    std::uint32_t v[3];
+};
+
+// Node of a flattened mesh BVH, stored depth first. An interior node's first child directly
+// follows it and `offset` holds its second child. A leaf covers `count` triangles starting at
+// `offset`. The layout is plain data so nodes can be written to and mapped from disk as-is.
+struct mesh_bvh_node {
+    double        bounds_min[3];
+    double        bounds_max[3];
+    std::uint32_t offset;
+    std::uint16_t count;   // Zero for interior nodes
+    std::uint16_t axis;    // Split axis of interior nodes, used to visit the nearer child first
+};
+
+struct mesh_build_settings {
+    int max_leaf_size = 4;  // Largest number of triangles kept in one BVH leaf
+};
+
+// Vertex, triangle and node arrays of a mesh, with triangles ordered to match the BVH leaves.
+struct mesh_buffers {
+    std::vector<point3>        positions;
+    std::vector<mesh_triangle> triangles;
+    std::vector<mesh_bvh_node> nodes;
+};
+
+
+class triangle_mesh : public hittable {
+  public:
+    // Deepest tree the traversal stacks can walk: a node's depth bounds the far children
+    // waiting on the stack beneath it.
+    static constexpr int max_tree_depth = 64;
+
+    triangle_mesh(
+        const point3* positions, const mesh_triangle* triangles, const mesh_bvh_node* nodes,
+        size_t node_count, shared_ptr<const void> storage, shared_ptr<material> mat
+    ) : positions(positions), triangles(triangles), nodes(nodes), node_count(node_count),
+        storage(storage), mat(mat)
+    {
+        // The mesh only views its arrays; `storage` keeps whatever owns them alive, whether
+        // that is a set of vectors built in memory or a memory-mapped cache file.
+        if (node_count > 0) {
+            const auto& root = nodes[0];
+            bbox = aabb(point3(root.bounds_min[0], root.bounds_min[1], root.bounds_min[2]),
+                        point3(root.bounds_max[0], root.bounds_max[1], root.bounds_max[2]));
+        } else {
+            bbox = aabb::empty;
+        }
+    }
+
+    triangle_mesh(shared_ptr<const mesh_buffers> buffers, shared_ptr<material> mat)
+      : triangle_mesh(buffers->positions.data(), buffers->triangles.data(),
+                      buffers->nodes.data(), buffers->nodes.size(), buffers, mat)
+    {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (node_count == 0)
+            return false;
+
+        const point3& orig = r.origin();
+        const vec3& dir = r.direction();
+        const double inv_dir[3] = { 1.0 / dir[0], 1.0 / dir[1], 1.0 / dir[2] };
+
+        std::uint32_t best_triangle = 0;
+        double best_alpha = 0, best_beta = 0;
+        bool hit_anything = false;
+
+        // Walk the flattened tree with an explicit stack, nearer child first.
+        std::uint32_t stack[max_tree_depth];
+        int stack_size = 0;
+        std::uint32_t node_index = 0;
+
+        while (true) {
+            const auto& node = nodes[node_index];
+
+            RTW_COUNT(boxes_tested);
+            if (hit_node(node, orig, inv_dir, ray_t)) {
+                RTW_COUNT(nodes_visited);
+                if (node.count > 0) {
+                    for (std::uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                        double alpha, beta, t;
+                        RTW_COUNT(primitives_tested);
+                        if (hit_triangle(triangles[i], r, ray_t, t, alpha, beta)) {
+                            RTW_COUNT(hits);
+                            ray_t.max = t;
+                            best_triangle = i;
+                            best_alpha = alpha;
+                            best_beta = beta;
+                            hit_anything = true;
+                        }
+                    }
+                } else {
+                    bool dir_negative = dir[node.axis] < 0;
+                    std::uint32_t near_child = dir_negative ? node.offset : node_index + 1;
+                    std::uint32_t far_child  = dir_negative ? node_index + 1 : node.offset;
+                    stack[stack_size++] = far_child;
+                    node_index = near_child;
+                    continue;
+                }
+            }
+
+            if (stack_size == 0)
+                break;
+            node_index = stack[--stack_size];
+        }
+
+        if (!hit_anything)
+            return false;
+
+        const auto& tri = triangles[best_triangle];
+        const point3& p0 = positions[tri.v[0]];
+        vec3 e1 = positions[tri.v[1]] - p0;
+        vec3 e2 = positions[tri.v[2]] - p0;
+
+        rec.t = ray_t.max;
+        rec.p = r.at(rec.t);
+        rec.u = best_alpha;
+        rec.v = best_beta;
+        rec.mat = mat;
+        auto n = cross(e1, e2);
+        rec.set_face_normal(r, unit_vector(n));
+        rec.set_footprint(r, std::sqrt(n.length()));
+
+        return true;
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        // The walk of hit, in storage order rather than nearer child first, stopping at the
+        // first triangle in the interval.
+        if (node_count == 0)
+            return false;
+
+        const point3& orig = r.origin();
+        const vec3& dir = r.direction();
+        const double inv_dir[3] = { 1.0 / dir[0], 1.0 / dir[1], 1.0 / dir[2] };
+
+        std::uint32_t stack[max_tree_depth];
+        int stack_size = 0;
+        std::uint32_t node_index = 0;
+
+        while (true) {
+            const auto& node = nodes[node_index];
+
+            RTW_COUNT(boxes_tested);
+            if (hit_node(node, orig, inv_dir, ray_t)) {
+                RTW_COUNT(nodes_visited);
+                if (node.count == 0) {
+                    stack[stack_size++] = node.offset;
+                    node_index = node_index + 1;
+                    continue;
+                }
+                for (std::uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                    double alpha, beta, t;
+                    RTW_COUNT(primitives_tested);
+                    if (hit_triangle(triangles[i], r, ray_t, t, alpha, beta)) {
+                        RTW_COUNT(hits);
+                        return true;
+                    }
+                }
+            }
+
+            if (stack_size == 0)
+                return false;
+            node_index = stack[--stack_size];
+        }
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+  private:
+    const point3*          positions;
+    const mesh_triangle*   triangles;
+    const mesh_bvh_node*   nodes;
+    size_t                 node_count;
+    shared_ptr<const void> storage;
+    shared_ptr<material>   mat;
+    aabb                   bbox;
+
+    static bool hit_node(
+        const mesh_bvh_node& node, const point3& orig, const double inv_dir[3], interval ray_t
+    ) {
+        for (int axis = 0; axis < 3; axis++) {
+            auto t0 = (node.bounds_min[axis] - orig[axis]) * inv_dir[axis];
+            auto t1 = (node.bounds_max[axis] - orig[axis]) * inv_dir[axis];
+            if (t1 < t0) std::swap(t0, t1);
+
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+
+            if (ray_t.max < ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
+    bool hit_triangle(
+        const mesh_triangle& tri, const ray& r, interval ray_t, double& t, double& alpha,
+        double& beta
+    ) const {
+        // Moller-Trumbore intersection. alpha and beta are the hit point's coordinates along
+        // the triangle's first and second edges, matching the u,v of the `triangle` primitive.
+        const point3& p0 = positions[tri.v[0]];
+        vec3 e1 = positions[tri.v[1]] - p0;
+        vec3 e2 = positions[tri.v[2]] - p0;
+
+        vec3 pvec = cross(r.direction(), e2);
+        double det = dot(e1, pvec);
+        if (std::fabs(det) < 1e-12)
+            return false;
+
+        double inv_det = 1.0 / det;
+        vec3 tvec = r.origin() - p0;
+        alpha = dot(tvec, pvec) * inv_det;
+        if (alpha < 0 || alpha > 1)
+            return false;
+
+        vec3 qvec = cross(tvec, e1);
+        beta = dot(r.direction(), qvec) * inv_det;
+        if (beta < 0 || alpha + beta > 1)
+            return false;
+
+        t = dot(e2, qvec) * inv_det;
+        return ray_t.surrounds(t);
+    }
+};
+
+
+namespace mesh_detail {
+
+    struct build_item {
+        std::uint32_t triangle;
+        aabb          bounds;
+        point3        centroid;
+    };
+
+    inline void set_bounds(mesh_bvh_node& node, const aabb& bounds) {
+        for (int axis = 0; axis < 3; axis++) {
+            node.bounds_min[axis] = bounds.axis_interval(axis).min;
+            node.bounds_max[axis] = bounds.axis_interval(axis).max;
+        }
+    }
+
+    inline std::uint32_t build_node(
+        std::vector<build_item>& items, size_t start, size_t end,
+        const mesh_build_settings& settings, std::vector<mesh_bvh_node>& nodes
+    ) {
+        // Build the subtree over items[start, end) and return its node index.
+        auto node_index = static_cast<std::uint32_t>(nodes.size());
+        nodes.push_back(mesh_bvh_node{});
+
+        aabb bounds = aabb::empty;
+        aabb centroid_bounds = aabb::empty;
+        for (size_t i = start; i < end; i++) {
+            bounds = aabb(bounds, items[i].bounds);
+            centroid_bounds = aabb(centroid_bounds, aabb(items[i].centroid, items[i].centroid));
+        }
+        set_bounds(nodes[node_index], bounds);
+
+        size_t span = end - start;
+        if (span <= size_t(settings.max_leaf_size)) {
+            nodes[node_index].offset = static_cast<std::uint32_t>(start);
+            nodes[node_index].count = static_cast<std::uint16_t>(span);
+            return node_index;
+        }
+
+        // Split at the median centroid along the longest axis of the centroid bounds.
+        int axis = centroid_bounds.longest_axis();
+        size_t mid = start + span/2;
+        std::nth_element(items.begin() + start, items.begin() + mid, items.begin() + end,
+            [axis](const build_item& a, const build_item& b) {
+                return a.centroid[axis] < b.centroid[axis];
+            });
+
+        build_node(items, start, mid, settings, nodes);
+        auto right = build_node(items, mid, end, settings, nodes);
+
+        nodes[node_index].offset = right;
+        nodes[node_index].count = 0;
+        nodes[node_index].axis = static_cast<std::uint16_t>(axis);
+        return node_index;
+    }
+
+}
+
+inline shared_ptr<mesh_buffers> build_mesh_buffers(
+    const obj_mesh& mesh, const mesh_build_settings& settings = mesh_build_settings()
+) {
+    // Build the flattened BVH over an indexed OBJ mesh. Triangles are reordered so each leaf
+    // covers a contiguous run of them.
+
+    std::vector<mesh_detail::build_item> items(mesh.triangle_count());
+    for (size_t i = 0; i < items.size(); i++) {
+        const point3& a = mesh.positions[mesh.indices[3*i].position];
+        const point3& b = mesh.positions[mesh.indices[3*i + 1].position];
+        const point3& c = mesh.positions[mesh.indices[3*i + 2].position];
+
+        items[i].triangle = static_cast<std::uint32_t>(i);
+        items[i].bounds = aabb(aabb(a, b), aabb(c, c));
+        items[i].centroid = (a + b + c) / 3;
+    }
+
+    auto buffers = make_shared<mesh_buffers>();
+    buffers->positions = mesh.positions;
+    buffers->nodes.reserve(items.empty() ? 0 : 2 * items.size() / settings.max_leaf_size + 1);
+    if (!items.empty())
+        mesh_detail::build_node(items, 0, items.size(), settings, buffers->nodes);
+
+    buffers->triangles.reserve(items.size());
+    for (const auto& item : items) {
+        mesh_triangle tri;
+        for (int k = 0; k < 3; k++)
+            tri.v[k] = static_cast<std::uint32_t>(mesh.indices[3*item.triangle + k].position);
+        buffers->triangles.push_back(tri);
+    }
+
+    return buffers;
+}
+
+#endif
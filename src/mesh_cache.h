@@ -0,0 +1,234 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include "mesh.h"
+#include "mapped_file.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Compiled mesh cache
+//
+// A cache file holds a mesh_cache_header followed by the position, triangle and BVH node
+// arrays of a triangle_mesh, each starting on a 64-byte boundary, so a warm start maps the
+// file and points the mesh straight at the mapped arrays. The header's key is a hash of the
+// source file and of the build settings; a cache whose key, version or sizes do not match, or
+// whose indices point outside its arrays, is ignored and rebuilt.
+
+struct mesh_cache_header {
+    char          magic[8];
+    std::uint32_t version;
+    std::uint32_t max_leaf_size;
+    std::uint64_t key;
+    std::uint64_t position_count;
+    std::uint64_t triangle_count;
+    std::uint64_t node_count;
+    std::uint64_t positions_offset;
+    std::uint64_t triangles_offset;
+    std::uint64_t nodes_offset;
+};
+
+namespace mesh_cache_detail {
+
+    const char          magic[8] = { 'R', 'T', 'W', 'M', 'E', 'S', 'H', '\0' };
+    const std::uint32_t version = 1;
+    const std::uint64_t alignment = 64;
+
+    inline std::uint64_t fnv1a(const void* data, size_t size, std::uint64_t hash) {
+        auto bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    inline std::uint64_t source_key(const char* filename, const mesh_build_settings& settings) {
+        // Hash the source file's size, modification time and leading and trailing bytes,
+        // together with the build settings and format version. Sampling the content instead
+        // of hashing all of it keeps warm starts of multi-gigabyte sources fast, while the
+        // size and timestamp catch ordinary edits.
+
+        struct stat st;
+        if (::stat(filename, &st) != 0)
+            return 0;
+
+        std::uint64_t hash = 14695981039346656037ull;
+        std::uint64_t size = static_cast<std::uint64_t>(st.st_size);
+        std::int64_t mtime_ns = std::int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        hash = fnv1a(&size, sizeof(size), hash);
+        hash = fnv1a(&mtime_ns, sizeof(mtime_ns), hash);
+        hash = fnv1a(&version, sizeof(version), hash);
+        hash = fnv1a(&settings.max_leaf_size, sizeof(settings.max_leaf_size), hash);
+
+        mapped_file file(filename);
+        const size_t sample = 64 * 1024;
+        size_t head = std::min(sample, file.size());
+        hash = fnv1a(file.data(), head, hash);
+        if (file.size() > head) {
+            size_t tail = std::min(sample, file.size() - head);
+            hash = fnv1a(file.data() + file.size() - tail, tail, hash);
+        }
+        return hash;
+    }
+
+    inline std::uint64_t align(std::uint64_t offset) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    inline bool write_cache(
+        const std::string& cache_path, std::uint64_t key, const mesh_buffers& buffers,
+        const mesh_build_settings& settings
+    ) {
+        // Write to a temporary file and rename it into place, so a concurrent reader never
+        // maps a half-written cache.
+
+        mesh_cache_header header{};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.max_leaf_size = static_cast<std::uint32_t>(settings.max_leaf_size);
+        header.key = key;
+        header.position_count = buffers.positions.size();
+        header.triangle_count = buffers.triangles.size();
+        header.node_count = buffers.nodes.size();
+        header.positions_offset = align(sizeof(header));
+        header.triangles_offset = align(header.positions_offset + header.position_count * sizeof(point3));
+        header.nodes_offset = align(header.triangles_offset + header.triangle_count * sizeof(mesh_triangle));
+
+        auto temp_path = cache_path + ".tmp" + std::to_string(::getpid());
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        if (!out.is_open())
+            return false;
+
+        auto write_at = [&out](std::uint64_t offset, const void* data, size_t size) {
+            static const char zeros[alignment] = {};
+            auto position = static_cast<std::uint64_t>(out.tellp());
+            out.write(zeros, static_cast<std::streamsize>(offset - position));
+            out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+        };
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        write_at(header.positions_offset, buffers.positions.data(), buffers.positions.size() * sizeof(point3));
+        write_at(header.triangles_offset, buffers.triangles.data(), buffers.triangles.size() * sizeof(mesh_triangle));
+        write_at(header.nodes_offset, buffers.nodes.data(), buffers.nodes.size() * sizeof(mesh_bvh_node));
+        out.close();
+
+        if (!out || std::rename(temp_path.c_str(), cache_path.c_str()) != 0) {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    inline bool valid_mesh(
+        const mesh_cache_header& header, const mesh_triangle* triangles, const mesh_bvh_node* nodes
+    ) {
+        // Check every index that triangle_mesh follows without checking: vertex indices must
+        // name positions, leaves must cover triangles that exist, and the nodes must form one
+        // depth-first tree, each second child past its first, no deeper than the traversal
+        // stacks allow. A corrupted cache whose key still matches fails here.
+
+        for (std::uint64_t i = 0; i < header.triangle_count; i++) {
+            for (auto v : triangles[i].v)
+                if (v >= header.position_count)
+                    return false;
+        }
+        if (header.node_count == 0)
+            return true;
+
+        struct pending_node { std::uint64_t index; int depth; };
+        std::vector<pending_node> pending { { 0, 0 } };
+        std::uint64_t visited = 0;
+        while (!pending.empty()) {
+            auto [index, depth] = pending.back();
+            pending.pop_back();
+            if (index >= header.node_count || depth > triangle_mesh::max_tree_depth
+                || ++visited > header.node_count)
+                return false;
+
+            const auto& node = nodes[index];
+            if (node.count > 0) {
+                if (node.offset > header.triangle_count
+                    || node.count > header.triangle_count - node.offset)
+                    return false;
+            } else {
+                if (node.axis > 2 || node.offset <= index + 1)
+                    return false;
+                pending.push_back({ node.offset, depth + 1 });
+                pending.push_back({ index + 1, depth + 1 });
+            }
+        }
+        return visited == header.node_count;
+    }
+
+    inline shared_ptr<triangle_mesh> map_cache(
+        const std::string& cache_path, std::uint64_t key, shared_ptr<material> mat
+    ) {
+        // Map a cache file and build a mesh over it, or return null if the file is missing,
+        // stale or malformed.
+
+        shared_ptr<mapped_file> file;
+        try {
+            file = make_shared<mapped_file>(cache_path.c_str(), MADV_WILLNEED);
+        } catch (const std::exception&) {
+            return nullptr;
+        }
+
+        if (file->size() < sizeof(mesh_cache_header))
+            return nullptr;
+
+        mesh_cache_header header;
+        std::memcpy(&header, file->data(), sizeof(header));
+        if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version
+            || header.key != key)
+            return nullptr;
+
+        auto section_fits = [&file](std::uint64_t offset, std::uint64_t count, size_t item) {
+            return offset % alignment == 0 && offset <= file->size()
+                && count <= (file->size() - offset) / item;
+        };
+        if (!section_fits(header.positions_offset, header.position_count, sizeof(point3))
+            || !section_fits(header.triangles_offset, header.triangle_count, sizeof(mesh_triangle))
+            || !section_fits(header.nodes_offset, header.node_count, sizeof(mesh_bvh_node)))
+            return nullptr;
+
+        const char* base = file->data();
+        auto positions = reinterpret_cast<const point3*>(base + header.positions_offset);
+        auto triangles = reinterpret_cast<const mesh_triangle*>(base + header.triangles_offset);
+        auto nodes = reinterpret_cast<const mesh_bvh_node*>(base + header.nodes_offset);
+        if (!valid_mesh(header, triangles, nodes))
+            return nullptr;
+
+        return make_shared<triangle_mesh>(positions, triangles, nodes, header.node_count, file, mat);
+    }
+
+}
+
+inline shared_ptr<triangle_mesh> load_mesh(
+    const char* filename, shared_ptr<material> mat,
+    const mesh_build_settings& settings = mesh_build_settings()
+) {
+    // Load an OBJ file as a triangle_mesh, going through the compiled cache stored next to it
+    // as <filename>.rtwcache. A valid cache is mapped directly; otherwise the OBJ file is
+    // parsed, its BVH built, and the cache (re)written if the directory is writable. Throws
+    // std::invalid_argument if the OBJ file cannot be opened.
+
+    std::string cache_path = std::string(filename) + ".rtwcache";
+    auto key = mesh_cache_detail::source_key(filename, settings);
+
+    if (key != 0) {
+        if (auto mesh = mesh_cache_detail::map_cache(cache_path, key, mat))
+            return mesh;
+    }
+
+    auto buffers = build_mesh_buffers(load_obj_mesh(filename), settings);
+    if (key != 0 && !mesh_cache_detail::write_cache(cache_path, key, *buffers, settings))
+        std::clog << "Could not write mesh cache '" << cache_path << "'\n";
+
+    return make_shared<triangle_mesh>(buffers, mat);
+}
+
+#endif
@@ -1,11 +1,18 @@
 #ifndef PERLIN_H
 #define PERLIN_H
 
+#include <algorithm>
+#include <thread>
+#include <vector>
+
 class perlin {
 public:
     perlin() {
         for (int i = 0; i < grid_size; i++) {
-            gradient[i] = unit_vector(vec3::random(-1, 1));
+            auto gradient = unit_vector(vec3::random(-1, 1));
+            gradient_x[i] = gradient.x();
+            gradient_y[i] = gradient.y();
+            gradient_z[i] = gradient.z();
         }
 
         generate_permutation(perm_x);
@@ -14,37 +21,20 @@ public:
     }
 
     double noise(const point3& p) const {
-        auto u = p.x() - std::floor(p.x());
-        auto v = p.y() - std::floor(p.y());
-        auto w = p.z() - std::floor(p.z());
-
-        auto i = int(std::floor(p.x()));
-        auto j = int(std::floor(p.y()));
-        auto k = int(std::floor(p.z()));
-
-        vec3 corners[2][2][2];
-
-        for (int di = 0; di < 2; di++)
-            for (int dj = 0; dj < 2; dj++)
-                for (int dk = 0; dk < 2; dk++)
-                    corners[di][dj][dk] = gradient[
-                        perm_x[(i + di) & 255] ^
-                        perm_y[(j + dj) & 255] ^
-                        perm_z[(k + dk) & 255]
-                    ];
-
-        return trilinear_interp(corners, u, v, w);
+        return noise(p.x(), p.y(), p.z());
     }
 
     double turbulence(const point3& p, int octaves) const {
         auto total = 0.0;
-        auto temp_p = p;
+        auto x = p.x(), y = p.y(), z = p.z();
         auto amplitude = 1.0;
 
         for (int i = 0; i < octaves; i++) {
-            total += amplitude * noise(temp_p);
+            total += amplitude * noise(x, y, z);
             amplitude *= 0.5;
-            temp_p *= 2;
+            x *= 2;
+            y *= 2;
+            z *= 2;
         }
 
         return std::fabs(total);
@@ -52,7 +42,9 @@ public:
 
 private:
     static const int grid_size = 256;
-    vec3 gradient[grid_size];
+    double gradient_x[grid_size];  // Gradient vectors, one array per component
+    double gradient_y[grid_size];
+    double gradient_z[grid_size];
     int perm_x[grid_size];
     int perm_y[grid_size];
     int perm_z[grid_size];
@@ -73,26 +65,121 @@ private:
         }
     }
 
-    static double trilinear_interp(const vec3 corners[2][2][2], double u, double v, double w) {
+    double noise(double x, double y, double z) const {
+        // floor() without a library call, exact over the lattice's integer range
+        int i = int(x) - (x < int(x));
+        int j = int(y) - (y < int(y));
+        int k = int(z) - (z < int(z));
+        auto u = x - i;
+        auto v = y - j;
+        auto w = z - k;
+
         // Hermite smoothing
         auto su = u * u * (3 - 2 * u);
         auto sv = v * v * (3 - 2 * v);
         auto sw = w * w * (3 - 2 * w);
 
+        // Per-axis lookups, weights and offsets, indexed by the corner's offset along the axis.
+        int    hash_x[2]   = { perm_x[i & 255], perm_x[(i + 1) & 255] };
+        int    hash_y[2]   = { perm_y[j & 255], perm_y[(j + 1) & 255] };
+        int    hash_z[2]   = { perm_z[k & 255], perm_z[(k + 1) & 255] };
+        double weight_x[2] = { 1 - su, su };
+        double weight_y[2] = { 1 - sv, sv };
+        double weight_z[2] = { 1 - sw, sw };
+        double offset_x[2] = { u, u - 1 };
+        double offset_y[2] = { v, v - 1 };
+        double offset_z[2] = { w, w - 1 };
+
+        // The eight corners are independent lanes of one loop, which the compiler unrolls and
+        // vectorizes; the sum then runs in the original corner order so results are unchanged.
+        double corner[8];
+        for (int c = 0; c < 8; c++) {
+            int di = c >> 2, dj = (c >> 1) & 1, dk = c & 1;
+            int g = hash_x[di] ^ hash_y[dj] ^ hash_z[dk];
+            corner[c] = weight_x[di] * weight_y[dj] * weight_z[dk]
+                      * (gradient_x[g] * offset_x[di] + gradient_y[g] * offset_y[dj]
+                         + gradient_z[g] * offset_z[dk]);
+        }
+
         auto sum = 0.0;
+        for (int c = 0; c < 8; c++)
+            sum += corner[c];
+        return sum;
+    }
+};
 
-        for (int i = 0; i < 2; i++)
-            for (int j = 0; j < 2; j++)
-                for (int k = 0; k < 2; k++) {
-                    vec3 weight(u - i, v - j, w - k);
-                    sum += (i * su + (1 - i) * (1 - su))
-                         * (j * sv + (1 - j) * (1 - sv))
-                         * (k * sw + (1 - k) * (1 - sw))
-                         * dot(corners[i][j][k], weight);
+// Turbulence sampled once on a regular grid over a box, then looked up with trilinear
+// interpolation. Much cheaper than evaluating the octaves, and accurate wherever the grid is
+// fine compared to the highest octave's detail. Points outside the box are left to the caller.
+class baked_turbulence {
+public:
+    baked_turbulence(const perlin& noise, const point3& min, const point3& max, int resolution,
+                     int octaves)
+      : origin(min)
+    {
+        // The longest side of the box gets `resolution` cells; the others get cells of the
+        // same size.
+        auto extent = max - min;
+        auto longest = std::fmax(extent.x(), std::fmax(extent.y(), extent.z()));
+        cell = longest / std::max(resolution, 1);
+        for (int a = 0; a < 3; a++)
+            samples[a] = std::max(2, int(std::ceil(extent[a] / cell)) + 1);
+
+        values.resize(size_t(samples[0]) * samples[1] * samples[2]);
+
+        // Bake slices of the grid on every hardware thread.
+        auto bake = [&](int first, int stride) {
+            for (int zi = first; zi < samples[2]; zi += stride)
+                for (int yi = 0; yi < samples[1]; yi++)
+                    for (int xi = 0; xi < samples[0]; xi++) {
+                        auto p = origin + cell * vec3(xi, yi, zi);
+                        values[index(xi, yi, zi)] = float(noise.turbulence(p, octaves));
+                    }
+        };
+
+        int thread_count = std::max(1, int(std::thread::hardware_concurrency()));
+        std::vector<std::thread> threads;
+        for (int t = 1; t < thread_count; t++)
+            threads.emplace_back(bake, t, thread_count);
+        bake(0, thread_count);
+        for (auto& t : threads)
+            t.join();
+    }
+
+    bool lookup(const point3& p, double& value) const {
+        // Sets `value` to the interpolated turbulence at p and returns true, or returns false
+        // if p lies outside the baked box.
+        double f[3];
+        int c[3];
+        for (int a = 0; a < 3; a++) {
+            auto x = (p[a] - origin[a]) / cell;
+            if (!(x >= 0 && x <= samples[a] - 1))
+                return false;
+            c[a] = std::min(int(x), samples[a] - 2);
+            f[a] = x - c[a];
+        }
+
+        value = 0;
+        for (int dz = 0; dz < 2; dz++)
+            for (int dy = 0; dy < 2; dy++)
+                for (int dx = 0; dx < 2; dx++) {
+                    auto weight = (dx ? f[0] : 1 - f[0]) * (dy ? f[1] : 1 - f[1]) * (dz ? f[2] : 1 - f[2]);
+                    value += weight * values[index(c[0] + dx, c[1] + dy, c[2] + dz)];
                 }
+        return true;
+    }
 
-        return sum;
+    size_t resident_bytes() const { return values.size() * sizeof(float); }
+
+private:
+    point3 origin;
+    double cell;
+    int samples[3];
+    std::vector<float> values;
+
+    size_t index(int x, int y, int z) const {
+        return (size_t(z) * samples[1] + y) * samples[0] + x;
     }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -3,6 +3,7 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "scene_arena.h"
 #include "vec3.h"
 
 class quad : public hittable {
@@ -14,6 +15,7 @@ public:
         normal = unit_vector(n);
         D = dot(Q, normal);
         w = n / dot(n,n);
+        uv_length = std::sqrt(n.length());
         set_bounding_box();
     }
 
@@ -28,6 +30,7 @@ public:
 
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        RTW_COUNT(primitives_tested);
         //n * d
         double denom = dot(r.direction(), normal);
 
@@ -49,30 +52,57 @@ public:
         auto alpha = dot(w, cross(planar_hitpt_vector, v));
         auto beta = dot(w, cross(u, planar_hitpt_vector));
 
-        if (!is_interior(alpha, beta, rec)) {
+        if (!is_interior(alpha, beta)) {
             return false;
         }
 
         rec.t = t;
+        rec.u = alpha;
+        rec.v = beta;
         rec.p = intersection;
         rec.mat = mat;
         rec.set_face_normal(r, normal);
+        rec.set_footprint(r, uv_length);
+        RTW_COUNT(hits);
 
         return true;
     }
 
-    virtual bool is_interior(double a, double b, hit_record& rec) const {
-        interval criteria = interval(0,1);
+    bool occluded(const ray& r, interval ray_t) const override {
+        // The plane and interior tests of hit, without filling in a record.
+        RTW_COUNT(primitives_tested);
+        double denom = dot(r.direction(), normal);
+        if (std::fabs(denom) < 1e-8)
+            return false;
 
-        if(!criteria.contains(a) || !criteria.contains(b)) {
+        double t = (D - dot(normal, r.origin())) / denom;
+        if (!ray_t.contains(t))
             return false;
-        }
 
-        rec.u = a;
-        rec.v = b;
+        vec3 planar_hitpt_vector = r.at(t) - Q;
+        if (!is_interior(dot(w, cross(planar_hitpt_vector, v)), dot(w, cross(u, planar_hitpt_vector))))
+            return false;
+
+        RTW_COUNT(hits);
+        return true;
+    }
+
+    bool hit_span(const ray& r, interval& span) const override {
+        // A flat shape is entered and left at the same point.
+        hit_record rec;
+        if (!hit(r, interval::universe, rec))
+            return false;
+
+        span = interval(rec.t, rec.t);
         return true;
     }
 
+    virtual bool is_interior(double a, double b) const {
+        // Whether the point at plane coordinates a,b lies within the shape.
+        interval criteria = interval(0,1);
+        return criteria.contains(a) && criteria.contains(b);
+    }
+
 private:
     point3 Q;
     vec3 u, v;
@@ -81,10 +111,13 @@ private:
     vec3 normal;
     double D;
     vec3 w;
+    double uv_length;  // World length spanned by one unit of u or v, from the quad's area
 };
 
-inline shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_ptr<material> mat) {
-    auto sides = make_shared<hittable_list>();
+inline shared_ptr<hittable_list> box(
+    const point3& a, const point3& b, shared_ptr<material> mat, scene_arena* arena = nullptr
+) {
+    auto sides = make_in<hittable_list>(arena);
 
     // Construct the two opposite vertices with the minimum and maximum coordinates.
     point3 min = point3(std::fmin(a.x(), b.x()), std::fmin(a.y(), b.y()), std::fmin(a.z(), b.z()));
@@ -94,12 +127,12 @@ inline shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_pt
     vec3 dy = vec3(0, max.y() - min.y() ,0);
     vec3 dz = vec3(0, 0 , max.z() - min.z());
 
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), max.z()),  dx,  dy, mat)); //front
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), min.z()),  -dx,  dy, mat)); //back
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()),  dz,  dy, mat)); //left
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), max.z()),  -dz,  dy, mat)); //right
-    sides->add(make_shared<quad>(point3(min.x(), max.y(), max.z()),  dx,  -dz, mat)); //top
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()),  dx,  dz, mat)); //bottom
+    sides->add(make_in<quad>(arena, point3(min.x(), min.y(), max.z()),  dx,  dy, mat)); //front
+    sides->add(make_in<quad>(arena, point3(max.x(), min.y(), min.z()),  -dx,  dy, mat)); //back
+    sides->add(make_in<quad>(arena, point3(min.x(), min.y(), min.z()),  dz,  dy, mat)); //left
+    sides->add(make_in<quad>(arena, point3(max.x(), min.y(), max.z()),  -dz,  dy, mat)); //right
+    sides->add(make_in<quad>(arena, point3(min.x(), max.y(), max.z()),  dx,  -dz, mat)); //top
+    sides->add(make_in<quad>(arena, point3(min.x(), min.y(), min.z()),  dx,  dz, mat)); //bottom
 
 
     return sides;
@@ -109,14 +142,8 @@ class triangle : public quad {
 public:
     triangle(const point3& Q, const vec3& u, const vec3& v, shared_ptr<material> mat) : quad(Q, u, v, mat) {}
 
-    virtual bool is_interior(double a, double b, hit_record& rec) const override {
-        if (a > 0 && b > 0 && a + b < 1) {
-            rec.u = a;
-            rec.v = b;
-            return true;
-        }
-
-        return false;
+    bool is_interior(double a, double b) const override {
+        return a > 0 && b > 0 && a + b < 1;
     }
 };
 
@@ -22,10 +22,28 @@ class ray {
         return orig + t*dir;
     }
 
+    // Ray cone used to filter textures: the cone's width at the origin, and how fast it widens
+    // per unit of distance traveled. Rays start without a cone (both zero), which samples
+    // textures at full resolution.
+    double cone_width() const  { return cone_w; }
+    double cone_spread() const { return cone_s; }
+
+    void set_cone(double width, double spread) {
+        cone_w = width;
+        cone_s = spread;
+    }
+
+    double cone_width_at(double t) const {
+        // Width of the cone at parameter t along the ray.
+        return cone_w + cone_s * t * dir.length();
+    }
+
   private:
     point3 orig;
     vec3 dir;
   double tm;
+    double cone_w = 0;
+    double cone_s = 0;
 };
 
 
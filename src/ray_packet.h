@@ -0,0 +1,66 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include <cstdint>
+
+// Bit mask over packet lanes. Bit n set means lane n takes part in the current operation.
+using packet_mask = std::uint64_t;
+
+class ray_packet {
+  public:
+    static const int width = 4;               // Packet covers a width x width pixel block
+    static const int size  = width * width;   // Number of rays (lanes) in the packet
+
+    static_assert(size <= 64, "packet lanes must fit in a packet_mask");
+
+    ray         rays[size];
+    double      t_min = 0.001;   // Shared near limit of every lane
+    double      t_max[size];     // Closest hit found so far, per lane
+    packet_mask valid = 0;       // Lanes holding a live ray
+
+    // Structure-of-arrays copies of the rays, used by the vectorized box test.
+    double orig[3][size];
+    double inv_dir[3][size];
+    double time[size];
+
+    // Packet-wide bounds over all valid lanes, used by the interval-arithmetic culling test.
+    interval orig_range[3];
+    interval inv_dir_range[3];
+
+    static packet_mask lane_bit(int lane) { return packet_mask(1) << lane; }
+
+    void prepare(packet_mask lanes) {
+        // Fill in the derived lane data after `rays` has been written. Only lanes in `lanes`
+        // are considered live; the others are left pointing at a copy of a live ray so the
+        // vectorized loops never read garbage.
+
+        valid = lanes;
+        int first_lane = 0;
+        while (first_lane < size && !(valid & lane_bit(first_lane)))
+            first_lane++;
+
+        for (int axis = 0; axis < 3; axis++) {
+            orig_range[axis] = interval::empty;
+            inv_dir_range[axis] = interval::empty;
+        }
+
+        for (int lane = 0; lane < size; lane++) {
+            bool live = valid & lane_bit(lane);
+            const ray& r = rays[live ? lane : first_lane % size];
+            t_max[lane] = infinity;
+            time[lane] = r.time();
+
+            for (int axis = 0; axis < 3; axis++) {
+                orig[axis][lane] = r.origin()[axis];
+                inv_dir[axis][lane] = 1.0 / r.direction()[axis];
+
+                if (live) {
+                    orig_range[axis] = interval(orig_range[axis], interval(orig[axis][lane], orig[axis][lane]));
+                    inv_dir_range[axis] = interval(inv_dir_range[axis], interval(inv_dir[axis][lane], inv_dir[axis][lane]));
+                }
+            }
+        }
+    }
+};
+
+#endif
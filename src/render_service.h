@@ -0,0 +1,324 @@
+#ifndef RENDER_SERVICE_H
+#define RENDER_SERVICE_H
+
+#include "scene.h"
+#include "scene_loader.h"
+#include "socket_stream.h"
+#include "tile_output.h"
+
+#include <chrono>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Render jobs served over a socket (see socket_stream.h), so that a long-running server keeps
+// scenes loaded, with their textures, meshes and hierarchies, from one job to the next.
+//
+// A client sends each job as one line:
+//
+//   render <scene file> <seed> <light sampling 0|1> [<setting> <value>...]
+//   size   <scene file> <seed> <light sampling 0|1> [<setting> <value>...]
+//   costs  <scene file> <seed> <light sampling 0|1> [<setting> <value>...]
+//
+// The settings are the keys of the `render` and `camera` statements of a scene file, applied
+// over the scene's own, such as "width 400 lookfrom 0 1 5 vfov 30" or "window 0 0 128 128".
+// The seed is used both to build the scene and to sample it. The server answers with
+//
+//   image <width> <height>
+//   tile <x> <y> <width> <height>     then width * height * 3 floats, once per tile
+//   done <render seconds> <scene was cached 0|1>
+//
+// or, in place of any of these lines, `error <message>`. Tiles arrive as they are finished, in
+// no particular order. The floats are the tile's linear RGB averaged over the samples, row by
+// row, in the byte order of the server. A connection may send any number of jobs in turn.
+//
+// A `size` job loads the scene and reports its image size the same way, without any tiles.
+// A `costs` job runs the camera's cost prepass instead of the render, and sends a line
+//
+//   cost <x> <y> <width> <height> <predicted cost>
+//
+// in place of each tile, for the tiles of the job's `tile` setting that hold rendered pixels.
+//
+// Clients are trusted. There is no authentication, and a job may name any scene file the
+// server can read, by absolute path or relative to the server's working directory; loading
+// a scene reads its meshes and images and may write their cache and tile files next to them
+// (see mesh_cache.h and tiled_image.h). So a server should only listen where every client
+// may be given those rights: on a Unix domain socket, whose file permissions decide who can
+// connect, or on loopback, which is where a TCP address without a host listens. Listening
+// on other interfaces takes an explicit host, such as 0.0.0.0 for all of them, and belongs
+// on a private network.
+
+struct render_job {
+    enum job_kind { render, size, costs };
+
+    job_kind      kind = render;
+    std::string   scene_file;
+    std::uint64_t seed = 0;
+    bool          light_sampling = true;
+    std::string   settings;            // Render and camera settings, as in a scene file
+
+    std::string line() const {
+        static const char* keywords[] = { "render ", "size ", "costs " };
+        std::ostringstream out;
+        out << keywords[kind] << scene_file << ' ' << seed << ' ' << (light_sampling ? 1 : 0);
+        if (!settings.empty())
+            out << ' ' << settings;
+        return out.str() + "\n";
+    }
+
+    static render_job parse(const std::string& line) {
+        // Reads a job line. Throws std::invalid_argument if it is malformed.
+        std::istringstream in(line);
+        std::string keyword;
+        int light_sampling = 1;
+        render_job job;
+        if (!(in >> keyword >> job.scene_file >> job.seed >> light_sampling)
+            || (keyword != "render" && keyword != "size" && keyword != "costs"))
+            throw std::invalid_argument("expected 'render <scene file> <seed> <light sampling>'");
+        job.kind = keyword == "size" ? size : keyword == "costs" ? costs : render;
+        job.light_sampling = light_sampling != 0;
+        std::getline(in >> std::ws, job.settings);
+        return job;
+    }
+};
+
+// An error the server reported for a job, as opposed to a failure of the connection.
+class render_server_error : public std::runtime_error {
+  public:
+    using std::runtime_error::runtime_error;
+};
+
+// The most recently used scenes, loaded once and kept for later jobs. A scene is loaded again
+// if its file has changed since, or if a job asks for another seed.
+class scene_cache {
+  public:
+    explicit scene_cache(size_t capacity) : capacity(std::max<size_t>(1, capacity)) {}
+
+    shared_ptr<scene> get(const std::string& filename, std::uint64_t seed, bool& cached) {
+        // Returns the scene, loading it if needed. Throws std::runtime_error as load_scene
+        // does. Not thread safe.
+        std::error_code error;
+        auto modified = std::filesystem::last_write_time(filename, error);
+
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->filename != filename || it->seed != seed)
+                continue;
+            if (it->modified != modified) {
+                entries.erase(it);
+                break;
+            }
+            entries.splice(entries.begin(), entries, it);
+            cached = true;
+            return it->loaded;
+        }
+
+        cached = false;
+        seed_random(seed);
+        auto loaded = std::make_shared<scene>(load_scene(filename));
+        entries.push_front({ filename, seed, modified, loaded });
+        if (entries.size() > capacity)
+            entries.pop_back();
+        return loaded;
+    }
+
+  private:
+    struct entry {
+        std::string                     filename;
+        std::uint64_t                   seed;
+        std::filesystem::file_time_type modified;
+        shared_ptr<scene>               loaded;
+    };
+
+    size_t capacity;
+    std::list<entry> entries;  // Most recently used first
+};
+
+namespace render_service_detail {
+    inline void write_tile(socket_stream& out, const image_tile& tile) {
+        out.write(tile_output_detail::encode_tile(tile));
+    }
+
+    inline image_tile read_tile(socket_stream& in, std::istringstream& header) {
+        image_tile tile;
+        if (!(header >> tile.x >> tile.y >> tile.width >> tile.height)
+            || tile.width <= 0 || tile.height <= 0)
+            throw std::runtime_error("malformed tile header from the server");
+
+        std::vector<float> values(size_t(tile.width) * tile.height * 3);
+        in.read(values.data(), values.size() * sizeof(float));
+        tile.pixels.reserve(values.size() / 3);
+        for (size_t i = 0; i < values.size(); i += 3)
+            tile.pixels.emplace_back(values[i], values[i+1], values[i+2]);
+        return tile;
+    }
+}
+
+// Serves render jobs, one at a time, to any number of connected clients. Each job renders
+// with all of the server's render threads, so jobs from different clients wait their turn.
+class render_server {
+  public:
+    render_server(size_t cached_scenes, int threads) : scenes(cached_scenes), threads(threads) {}
+
+    [[noreturn]] void run(const std::string& address) {
+        // Listens on `address` and serves clients until the process ends. Throws
+        // std::runtime_error if the address cannot be bound.
+        socket_listener listener(address);
+        std::clog << "Serving render jobs on " << address << "\n";
+
+        for (;;) {
+            auto client = std::make_shared<socket_stream>(listener.accept());
+            std::thread([this, client] { serve(*client); }).detach();
+        }
+    }
+
+  private:
+    scene_cache scenes;
+    int threads;
+    std::mutex render_mutex;  // Held for the whole of each job
+
+    void serve(socket_stream& client) {
+        std::string line;
+        try {
+            while (client.read_line(line)) {
+                if (line.empty())
+                    continue;
+                try {
+                    run_job(client, render_job::parse(line));
+                } catch (const std::exception& e) {
+                    client.write(std::string("error ") + e.what() + "\n");
+                }
+            }
+        } catch (const std::exception& e) {
+            // The client went away; nothing is left to tell it.
+            std::clog << "Client dropped: " << e.what() << "\n";
+        }
+    }
+
+    void run_job(socket_stream& client, const render_job& job) {
+        std::lock_guard<std::mutex> lock(render_mutex);
+
+        bool cached = false;
+        auto s = scenes.get(job.scene_file, job.seed, cached);
+
+        // Overrides go to a copy of the camera, so the cached scene keeps its own settings.
+        camera cam = s->cam;
+        apply_camera_settings(cam, job.settings, "job settings");
+        cam.seed = job.seed;
+        cam.light_sampling = job.light_sampling;
+        cam.threads = threads;
+
+        client.write("image " + std::to_string(cam.image_width) + " "
+                     + std::to_string(cam.height()) + "\n");
+        if (job.kind == render_job::size) {
+            client.write(std::string("done 0 ") + (cached ? "1" : "0") + "\n");
+            return;
+        }
+        if (job.kind == render_job::costs) {
+            std::ostringstream reply;
+            for (const auto& tile : cam.predict_tile_costs(s->world, &s->lights)) {
+                reply << "cost " << tile.rect.x << ' ' << tile.rect.y << ' ' << tile.rect.width
+                      << ' ' << tile.rect.height << ' ' << tile.predicted << '\n';
+            }
+            reply << "done " << cam.stats.prepass_seconds << ' ' << (cached ? 1 : 0) << '\n';
+            client.write(reply.str());
+            return;
+        }
+
+        // The callback runs on render threads, possibly several at once, so sends are taken
+        // in turn and a failed send is only noted there.
+        std::mutex send_mutex;
+        std::string send_error;
+        cam.render_tiles(s->world, &s->lights, [&](const image_tile& tile) {
+            std::lock_guard<std::mutex> lock(send_mutex);
+            if (!send_error.empty())
+                return;
+            try {
+                render_service_detail::write_tile(client, tile);
+            } catch (const std::exception& e) {
+                send_error = e.what();
+            }
+        });
+        if (!send_error.empty())
+            throw std::runtime_error(send_error);
+        client.write("done " + std::to_string(cam.stats.seconds) + " " + (cached ? "1" : "0") + "\n");
+
+        std::clog << "\rJob: " << job.scene_file << (cached ? " (cached)" : " (loaded)") << ", "
+                  << cam.image_width << "x" << cam.height() << ", " << cam.samples_per_pixel
+                  << " spp, " << cam.stats.seconds << " s\n";
+    }
+};
+
+// A connection to a render server, over which any number of jobs can be sent in turn.
+class render_client {
+  public:
+    explicit render_client(const std::string& address)
+      : server(socket_stream::connect(address)) {}
+
+    void render(const render_job& job, int& width, int& height, const tile_callback& on_tile) {
+        // Has the server render `job`, calling `on_tile` with each tile as it arrives, and
+        // sets the width and height of the whole image. Throws render_server_error if the
+        // server reports an error, and std::runtime_error if the connection fails.
+        server.write(job.line());
+        read_reply(width, height, on_tile, nullptr);
+    }
+
+    std::vector<tile_timing> predict_costs(render_job job, int& width, int& height) {
+        // Has the server run the cost prepass of `job`, and returns the predicted cost of
+        // each tile. Throws as render does.
+        job.kind = render_job::costs;
+        server.write(job.line());
+        std::vector<tile_timing> costs;
+        read_reply(width, height, nullptr, &costs);
+        return costs;
+    }
+
+  private:
+    socket_stream server;
+
+    void read_reply(int& width, int& height, const tile_callback& on_tile,
+                    std::vector<tile_timing>* costs) {
+        width = height = 0;
+        std::string line;
+        while (server.read_line(line)) {
+            std::istringstream in(line);
+            std::string keyword;
+            in >> keyword;
+
+            if (keyword == "image") {
+                if (!(in >> width >> height) || width <= 0 || height <= 0)
+                    throw std::runtime_error("malformed image header from the server");
+            } else if (keyword == "tile") {
+                auto tile = render_service_detail::read_tile(server, in);
+                if (tile.x < 0 || tile.y < 0 || tile.x + tile.width > width
+                    || tile.y + tile.height > height)
+                    throw std::runtime_error("tile outside the image from the server");
+                if (on_tile)
+                    on_tile(tile);
+            } else if (keyword == "cost" && costs) {
+                tile_timing cost;
+                if (!(in >> cost.rect.x >> cost.rect.y >> cost.rect.width >> cost.rect.height
+                      >> cost.predicted))
+                    throw std::runtime_error("malformed tile cost from the server");
+                costs->push_back(cost);
+            } else if (keyword == "done") {
+                return;
+            } else if (keyword == "error") {
+                std::string message;
+                std::getline(in >> std::ws, message);
+                throw render_server_error("server: " + message);
+            } else {
+                throw std::runtime_error("unexpected reply from the server: " + line);
+            }
+        }
+
+        throw std::runtime_error("the server closed the connection before the job was done");
+    }
+};
+
+#endif
@@ -15,61 +15,109 @@
 #define STBI_FAILURE_USERMSG
 #include "../external/stb_image.h"
 
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <vector>
 
 class rtw_image {
   public:
     rtw_image() {}
 
     rtw_image(const char* image_filename) {
-        // Loads image data from the specified file. If the RTW_IMAGES environment variable is
-        // defined, looks only in that directory for the image file. If the image was not found,
-        // searches for the specified image file first from the current directory, then in the
-        // images/ subdirectory, then the _parent's_ images/ subdirectory, and then _that_
-        // parent, on so on, for six levels up. If the image was not loaded successfully,
-        // width() and height() will return 0.
+        // Loads image data from the specified file, found as described for locate(). If the
+        // image was not loaded successfully, width() and height() will return 0.
+
+        if (!load(locate(image_filename)))
+            std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
+    }
+
+    rtw_image(const rtw_image&) = delete;
+    rtw_image& operator=(const rtw_image&) = delete;
+
+    ~rtw_image() {
+        STBI_FREE(bdata);
+    }
+
+    static std::string locate(const char* image_filename) {
+        // Returns the path of the image file. If the RTW_IMAGES environment variable is
+        // defined, looks first in that directory for the image file. Otherwise searches for
+        // the specified image file first from the current directory, then in the images/
+        // subdirectory, then the _parent's_ images/ subdirectory, and then _that_ parent, on
+        // so on, for six levels up. Returns the name unchanged if the file was not found.
 
         auto filename = std::string(image_filename);
         auto imagedir = getenv("RTW_IMAGES");
+        auto exists = [](const std::string& path) { return std::ifstream(path).good(); };
 
         // Hunt for the image file in some likely locations.
-        if (imagedir && load(std::string(imagedir) + "/" + image_filename)) return;
-        if (load(filename)) return;
-        if (load("images/" + filename)) return;
-        if (load("../images/" + filename)) return;
-        if (load("../../images/" + filename)) return;
-        if (load("../../../images/" + filename)) return;
-        if (load("../../../../images/" + filename)) return;
-        if (load("../../../../../images/" + filename)) return;
-        if (load("../../../../../../images/" + filename)) return;
-
-        std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
-    }
-
-    ~rtw_image() {
-        delete[] bdata;
-        STBI_FREE(fdata);
+        if (imagedir && exists(std::string(imagedir) + "/" + filename))
+            return std::string(imagedir) + "/" + filename;
+
+        std::string prefix = "";
+        if (exists(filename)) return filename;
+        for (int up = 0; up <= 6; up++) {
+            if (exists(prefix + "images/" + filename))
+                return prefix + "images/" + filename;
+            prefix += "../";
+        }
+        return filename;
     }
 
     bool load(const std::string& filename) {
-        // Loads the linear (gamma=1) image data from the given file name. Returns true if the
-        // load succeeded. The resulting data buffer contains the three [0.0, 1.0]
-        // floating-point values for the first pixel (red, then green, then blue). Pixels are
-        // contiguous, going left to right for the width of the image, followed by the next row
-        // below, for the full height of the image.
+        // Loads the linear (gamma=1) image data from the given file name as bytes. Returns
+        // true if the load succeeded. The resulting data buffer contains the three [0, 255]
+        // values for the first pixel (red, then green, then blue). Pixels are contiguous,
+        // going left to right for the width of the image, followed by the next row below, for
+        // the full height of the image.
+        //
+        // 8-bit files are decoded straight to bytes and linearized through a table; only HDR
+        // files pass through a temporary floating point copy.
 
         auto n = bytes_per_pixel; // Dummy out parameter: original components per pixel
-        fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
-        if (fdata == nullptr) return false;
+        if (stbi_is_hdr(filename.c_str())) {
+            float* fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
+            if (fdata == nullptr) return false;
+            convert_to_bytes(fdata);
+            STBI_FREE(fdata);
+        } else {
+            bdata = stbi_load(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
+            if (bdata == nullptr) return false;
+            linearize_bytes();
+        }
 
         bytes_per_scanline = image_width * bytes_per_pixel;
-        convert_to_bytes();
+        build_mips();
+        return true;
+    }
+
+    static bool load_linear(const std::string& filename, int& width, int& height,
+                            std::vector<float>& rgb) {
+        // Loads the linear image data from the given file name as floats, three per pixel in
+        // the same order as load(), keeping the full range of HDR files. 8-bit files are
+        // linearized with the same gamma as load() uses. Returns true if the load succeeded.
+        int n;
+        float* fdata = stbi_loadf(filename.c_str(), &width, &height, &n, 3);
+        if (fdata == nullptr) return false;
+        rgb.assign(fdata, fdata + size_t(width) * height * 3);
+        STBI_FREE(fdata);
         return true;
     }
 
-    int width()  const { return (fdata == nullptr) ? 0 : image_width; }
-    int height() const { return (fdata == nullptr) ? 0 : image_height; }
+    int width()  const { return (bdata == nullptr) ? 0 : image_width; }
+    int height() const { return (bdata == nullptr) ? 0 : image_height; }
+
+    size_t resident_bytes() const {
+        // Memory held by the pixel data of every mip level.
+        size_t bytes = size_t(width()) * height() * bytes_per_pixel;
+        for (const auto& mip : mips)
+            bytes += mip.data.size();
+        return bytes;
+    }
 
     const unsigned char* pixel_data(int x, int y) const {
         // Return the address of the three RGB bytes of the pixel at x,y. If there is no image
@@ -83,13 +131,37 @@ class rtw_image {
         return bdata + y*bytes_per_scanline + x*bytes_per_pixel;
     }
 
+    // Mip levels. Level 0 is the full image; each further level halves the one before it, down
+    // to a single pixel.
+
+    int levels() const { return 1 + int(mips.size()); }
+
+    int width(int level) const  { return level == 0 ? width()  : mips[level-1].width; }
+    int height(int level) const { return level == 0 ? height() : mips[level-1].height; }
+
+    const unsigned char* pixel_data(int x, int y, int level) const {
+        // Return the address of the three RGB bytes of the pixel at x,y of the given level,
+        // clamping x,y to the level's edges.
+        if (level == 0) return pixel_data(x, y);
+
+        const auto& mip = mips[level-1];
+        x = clamp(x, 0, mip.width);
+        y = clamp(y, 0, mip.height);
+        return mip.data.data() + (size_t(y)*mip.width + x)*bytes_per_pixel;
+    }
+
   private:
+    struct mip_level {
+        int width, height;
+        std::vector<unsigned char> data;
+    };
+
     const int      bytes_per_pixel = 3;
-    float         *fdata = nullptr;         // Linear floating point pixel data
     unsigned char *bdata = nullptr;         // Linear 8-bit pixel data
     int            image_width = 0;         // Loaded image width
     int            image_height = 0;        // Loaded image height
     int            bytes_per_scanline = 0;
+    std::vector<mip_level> mips;            // Levels 1 and up of the mip pyramid
 
     static int clamp(int x, int low, int high) {
         // Return the value clamped to the range [low, high).
@@ -106,12 +178,12 @@ class rtw_image {
         return static_cast<unsigned char>(256.0 * value);
     }
 
-    void convert_to_bytes() {
+    void convert_to_bytes(const float* fdata) {
         // Convert the linear floating point pixel data to bytes, storing the resulting byte
         // data in the `bdata` member.
 
         int total_bytes = image_width * image_height * bytes_per_pixel;
-        bdata = new unsigned char[total_bytes];
+        bdata = static_cast<unsigned char*>(STBI_MALLOC(total_bytes));
 
         // Iterate through all pixel components, converting from [0.0, 1.0] float values to
         // unsigned [0, 255] byte values.
@@ -121,6 +193,55 @@ class rtw_image {
         for (auto i=0; i < total_bytes; i++, fptr++, bptr++)
             *bptr = float_to_byte(*fptr);
     }
+
+    void linearize_bytes() {
+        // Convert gamma-encoded bytes to linear bytes in place. The table maps each byte the
+        // way stbi_loadf followed by float_to_byte would.
+
+        static const auto table = [] {
+            std::array<unsigned char, 256> t;
+            for (int i = 0; i < 256; i++)
+                t[i] = float_to_byte(float(std::pow(double(i / 255.0f), double(2.2f))));
+            return t;
+        }();
+
+        int total_bytes = image_width * image_height * bytes_per_pixel;
+        for (int i = 0; i < total_bytes; i++)
+            bdata[i] = table[bdata[i]];
+    }
+
+    void build_mips() {
+        // Build each level from the one before by averaging 2x2 blocks of its pixels. The
+        // pixel data is linear, so the averages are too. Odd edges reuse their last pixel.
+        mips.clear();
+        int w = image_width, h = image_height;
+
+        while (w > 1 || h > 1) {
+            mip_level next;
+            next.width = std::max(1, w / 2);
+            next.height = std::max(1, h / 2);
+            next.data.resize(size_t(next.width) * next.height * bytes_per_pixel);
+
+            int level = levels() - 1;
+            for (int y = 0; y < next.height; y++) {
+                int y0 = std::min(2*y, h-1), y1 = std::min(2*y+1, h-1);
+                for (int x = 0; x < next.width; x++) {
+                    int x0 = std::min(2*x, w-1), x1 = std::min(2*x+1, w-1);
+                    const unsigned char* p[4] = {
+                        pixel_data(x0, y0, level), pixel_data(x1, y0, level),
+                        pixel_data(x0, y1, level), pixel_data(x1, y1, level),
+                    };
+                    auto out = next.data.data() + (size_t(y)*next.width + x)*bytes_per_pixel;
+                    for (int c = 0; c < bytes_per_pixel; c++)
+                        out[c] = static_cast<unsigned char>((p[0][c] + p[1][c] + p[2][c] + p[3][c] + 2) / 4);
+                }
+            }
+
+            w = next.width;
+            h = next.height;
+            mips.push_back(std::move(next));
+        }
+    }
 };
 
 // Restore MSVC compiler warnings
@@ -2,6 +2,7 @@
 #define RTWEEKEND_H
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
 #include <limits>
@@ -24,9 +25,29 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+inline std::uint64_t& random_state() {
+    // Per-thread generator state, so render threads never contend on a shared generator.
+    thread_local std::uint64_t state = 0x853c49e6748fea9bULL;
+    return state;
+}
+
+inline void seed_random(std::uint64_t seed) {
+    // Seeds the calling thread's generator. Nearby seeds are scrambled (splitmix64) so they
+    // give unrelated sequences.
+    std::uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    random_state() = (z == 0) ? 1 : z;
+}
+
 inline double random_double() {
-    // Returns a random real in [0,1).
-    return std::rand() / (RAND_MAX + 1.0);
+    // Returns a random real in [0,1), from the calling thread's xorshift64* generator.
+    auto& s = random_state();
+    s ^= s >> 12;
+    s ^= s << 25;
+    s ^= s >> 27;
+    return double((s * 0x2545f4914f6cdd1dULL) >> 11) * 0x1.0p-53;
 }
 
 inline double random_double(double min, double max) {
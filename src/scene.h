@@ -0,0 +1,47 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "animation.h"
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "light_tree.h"
+#include "scene_arena.h"
+
+// A renderable scene: the world geometry together with the camera and render settings that
+// view it, and the world's lights for the camera to sample. The arena owns the objects the
+// world is built from, and is declared first so that it outlives every handle to them.
+class scene {
+  public:
+    scene_arena   arena;
+    hittable_list world;
+    light_tree    lights;
+    camera        cam;
+
+    shared_ptr<bvh_node>           world_bvh;   // Hierarchy over the world, if it has objects
+    std::vector<animated_instance> animations;  // Objects that move from frame to frame
+
+    double load_seconds      = 0;  // Time spent reading the description and building the world
+    double bvh_build_seconds = 0;  // Part of load_seconds spent building bounding volume hierarchies
+
+    void render(std::ostream& out = std::cout) { cam.render(world, out, &lights); }
+
+    int set_frame(int frame, int frames) {
+        // Poses the animated objects for frame `frame` of `frames`, with the first frame at
+        // the start of each animation and the last one step short of its end, so that a loop
+        // such as a full turn repeats cleanly. The world hierarchy is refit around the objects'
+        // new bounds, and the subtrees that have degraded too far are rebuilt. Returns the
+        // number of subtrees rebuilt.
+        if (animations.empty() || !world_bvh)
+            return 0;
+
+        auto t = frames > 0 ? double(frame) / frames : 0.0;
+        for (auto& animation : animations)
+            animation.set_time(t);
+
+        world_bvh->refit();
+        return world_bvh->rebuild_degraded();
+    }
+};
+
+#endif
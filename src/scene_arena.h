@@ -0,0 +1,159 @@
+#ifndef SCENE_ARENA_H
+#define SCENE_ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <typeindex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Owns the objects of a scene: primitives, materials, textures and BVH nodes.
+//
+// Objects are bump-allocated out of a few large blocks, in runs of one type, so objects of a
+// type sit next to each other in memory and none of them needs its own heap allocation or
+// control block. make() hands out non-owning shared_ptr handles (aliasing an empty owner), so
+// the rest of the renderer keeps using shared_ptr while copying a handle never touches a
+// reference count. Handles stay valid until the arena is destroyed, which runs every
+// object's destructor and then releases the blocks together.
+//
+// An arena is not thread safe; scenes are built on one thread.
+class scene_arena {
+  public:
+    scene_arena() = default;
+    scene_arena(const scene_arena&) = delete;
+    scene_arena& operator=(const scene_arena&) = delete;
+    scene_arena(scene_arena&&) = default;
+    scene_arena& operator=(scene_arena&&) = default;
+
+    ~scene_arena() {
+        // Destroy the objects first, newest type first, then free the blocks they live in.
+        while (!pools.empty())
+            pools.pop_back();
+    }
+
+    template <typename T, typename... Args>
+    shared_ptr<T> make(Args&&... args) {
+        // The slot is taken before construction, since constructors may make objects of
+        // their own type (as bvh_node does for its children).
+        auto& objects = pool_for<T>();
+        T* slot = objects.allocate(*this);
+        try {
+            new (slot) T(std::forward<Args>(args)...);
+        } catch (...) {
+            objects.abandoned.push_back(slot);
+            throw;
+        }
+        return shared_ptr<T>(shared_ptr<T>(), slot);
+    }
+
+    size_t object_count() const {
+        size_t count = 0;
+        for (const auto& p : pools)
+            count += p->object_count();
+        return count;
+    }
+
+    size_t bytes_reserved() const { return reserved; }
+
+  private:
+    using storage = std::max_align_t;
+
+    struct pool_base {
+        virtual ~pool_base() = default;
+        virtual size_t object_count() const = 0;
+    };
+
+    template <typename T>
+    struct pool : pool_base {
+        struct run {
+            T*     first;
+            size_t count;
+        };
+
+        std::vector<run> runs;      // Runs of storage, the last one being filled
+        size_t used = 0;            // Slots taken in the last run
+        size_t next_run_size = 8;   // Runs grow geometrically as the type proves common
+        std::vector<T*> abandoned;  // Slots whose constructor threw
+
+        ~pool() override {
+            for (size_t r = 0; r < runs.size(); r++) {
+                size_t count = (r + 1 == runs.size()) ? used : runs[r].count;
+                for (T* object = runs[r].first; object != runs[r].first + count; object++) {
+                    if (std::find(abandoned.begin(), abandoned.end(), object) == abandoned.end())
+                        std::destroy_at(object);
+                }
+            }
+        }
+
+        size_t object_count() const override {
+            size_t count = used;
+            for (size_t r = 0; r + 1 < runs.size(); r++)
+                count += runs[r].count;
+            return count - abandoned.size();
+        }
+
+        T* allocate(scene_arena& arena) {
+            if (runs.empty() || used == runs.back().count) {
+                auto* first = static_cast<T*>(arena.allocate(next_run_size * sizeof(T), alignof(T)));
+                runs.push_back({ first, next_run_size });
+                used = 0;
+                next_run_size = std::min<size_t>(next_run_size * 2, 4096);
+            }
+            return runs.back().first + used++;
+        }
+    };
+
+    std::vector<std::unique_ptr<storage[]>>            blocks;
+    std::vector<std::unique_ptr<pool_base>>            pools;
+    std::unordered_map<std::type_index, pool_base*>    pool_index;
+    std::byte* cursor = nullptr;     // Free space in the newest block
+    size_t     remaining = 0;
+    size_t     reserved = 0;
+
+    template <typename T>
+    pool<T>& pool_for() {
+        static_assert(alignof(T) <= alignof(storage), "scene_arena cannot align this type");
+
+        auto& slot = pool_index[std::type_index(typeid(T))];
+        if (!slot) {
+            pools.push_back(std::make_unique<pool<T>>());
+            slot = pools.back().get();
+        }
+        return *static_cast<pool<T>*>(slot);
+    }
+
+    void* allocate(size_t bytes, size_t alignment) {
+        // Bump-allocates from the newest block, starting a new block when it is full. Blocks
+        // double in size so that large scenes need only a handful of them.
+        auto padding = (alignment - reinterpret_cast<std::uintptr_t>(cursor) % alignment) % alignment;
+        if (!cursor || padding + bytes > remaining) {
+            size_t growth = std::min<size_t>(blocks.size(), 10);
+            size_t block_bytes = std::max<size_t>(bytes, (size_t(64) * 1024) << growth);
+            size_t units = (block_bytes + sizeof(storage) - 1) / sizeof(storage);
+            blocks.emplace_back(new storage[units]);
+            cursor = reinterpret_cast<std::byte*>(blocks.back().get());
+            remaining = units * sizeof(storage);
+            reserved += remaining;
+            padding = 0;
+        }
+
+        void* result = cursor + padding;
+        cursor += padding + bytes;
+        remaining -= padding + bytes;
+        return result;
+    }
+};
+
+template <typename T, typename... Args>
+shared_ptr<T> make_in(scene_arena* arena, Args&&... args) {
+    // Allocates from `arena` when there is one, and falls back to make_shared otherwise.
+    if (arena)
+        return arena->make<T>(std::forward<Args>(args)...);
+    return make_shared<T>(std::forward<Args>(args)...);
+}
+
+#endif
@@ -0,0 +1,631 @@
+#ifndef SCENE_LOADER_H
+#define SCENE_LOADER_H
+
+#include "scene.h"
+#include "bvh.h"
+#include "constant_medium.h"
+#include "density_grid.h"
+#include "material.h"
+#include "mesh_cache.h"
+#include "quad.h"
+#include "sphere.h"
+#include "texture.h"
+
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Scene description files
+//
+// A scene file is plain text with one statement per line. Blank lines and anything after a
+// '#' are ignored. Colors are three numbers r g b. Wherever a statement takes "color or
+// texture", either three numbers or the name of a texture may be given.
+//
+//   render  [width N] [aspect A or W/H] [spp N] [depth N] [background r g b]
+//           [window x y width height] [region x y width height]... [tile N]
+//   camera  [vfov deg] [lookfrom x y z] [lookat x y z] [vup x y z]
+//           [defocus_angle deg] [focus_dist d]
+//   environment <image file> [intensity]
+//
+//   texture  <name> solid r g b
+//   texture  <name> checker <scale> r g b r g b
+//   texture  <name> image <file>
+//   texture  <name> tiled_image <file>
+//   texture  <name> noise <scale> [baked <resolution> x0 y0 z0 x1 y1 z1]
+//
+//   material <name> lambertian <color or texture>
+//   material <name> metal r g b <fuzz>
+//   material <name> dielectric <refraction index>
+//   material <name> diffuse_light <color or texture>
+//   material <name> isotropic <color or texture>
+//
+// Geometry statements add an object to the world, or to the enclosing group:
+//
+//   sphere        <material> x y z <radius>
+//   moving_sphere <material> x0 y0 z0 x1 y1 z1 <radius>
+//   quad          <material> Qx Qy Qz ux uy uz vx vy vz
+//   triangle      <material> Qx Qy Qz ux uy uz vx vy vz
+//   box           <material> ax ay az bx by bz
+//   mesh          <material> <file.obj>
+//   instance      <object> [rotate_y deg | translate x y z]...
+//   medium        <object> <density> <color or texture>
+//   volume        <file.vol> x0 y0 z0 x1 y1 z1 <density> <color or texture>
+//   bvh           <object>
+//
+// Prefixing a geometry statement with `define <name>` names the object instead of adding it.
+// `group <name>` ... `end` collects the geometry statements in between into a named object.
+// Named objects are placed with `instance`, which applies its transforms in order; `medium`
+// fills a named object's volume with a constant-density medium; `volume` stretches a density
+// grid file (see density_grid.h) over the box from x0 y0 z0 up to x1 y1 z1, scaling its
+// densities by <density>; `bvh` adds a bounding volume hierarchy over a named group.
+// Relative file paths are looked up next to the scene file first. The finished world is
+// wrapped in a bounding volume hierarchy.
+//
+// `animate <object> [rotate_y deg | translate x y z | spin deg | move x y z]...` places a named
+// object in the world like `instance`, except that `spin` and `move` play out over a multi-frame
+// render: frame f of N turns or moves the object by f/N of the amount. Animated objects must
+// not emit light, since lights are sampled where they were loaded. `animate` is only allowed
+// outside groups.
+//
+// `environment` lights the scene from an equirectangular image, usually HDR, scaled by
+// intensity (default 1), that replaces the background color and is sampled as a light.
+//
+// `render window` traces only the pixels in the given rectangle of the image, whose top-left
+// corner is at column x and row y, and leaves the rest of the image black. Each `region`
+// narrows this further to a list of rectangles, of which a pixel must be in at least one.
+// `tile` sets the edge in pixels of the tiles that are traced and handed on as a unit
+// (default 32).
+//
+// Camera rays only get random times over the shutter if the file has a `moving_sphere`, and
+// ray cones for texture filtering if it has an `image` or `tiled_image` texture, so that the
+// camera's render kernels without them are used otherwise.
+
+class scene_loader {
+  public:
+    scene load(const std::string& filename) {
+        auto start = std::chrono::steady_clock::now();
+
+        std::ifstream in(filename, std::ios::binary);
+        if (!in.is_open())
+            throw std::runtime_error("Cannot open scene file '" + filename + "'");
+
+        std::stringstream buffer;
+        buffer << in.rdbuf();
+        scene result = parse(buffer.str(), filename);
+
+        result.load_seconds = seconds_since(start);
+        return result;
+    }
+
+    void apply_settings(camera& cam, const std::string& settings, const std::string& origin) {
+        // Applies `settings`, any mix of the keys of the `render` and `camera` statements each
+        // followed by its value, to `cam`. Errors name `origin` in place of a file.
+        source = origin;
+        line_number = 1;
+        tokenize(settings);
+        while (more()) {
+            auto key = word("setting");
+            if (!render_setting(cam, key) && !camera_setting(cam, key))
+                fail("unknown setting '" + key + "'");
+        }
+    }
+
+    scene parse(const std::string& text, const std::string& filename) {
+        source = filename;
+        auto slash = filename.find_last_of('/');
+        base_dir = (slash == std::string::npos) ? "" : filename.substr(0, slash + 1);
+
+        scene result;
+        arena = &result.arena;
+        lights = &result.lights;
+        bvh_seconds = 0;
+        moving_objects = filtered_textures = false;
+        groups.clear();
+        groups.push_back({ "", arena->make<hittable_list>() });
+
+        size_t start = 0;
+        line_number = 0;
+        while (start <= text.size()) {
+            auto end = text.find('\n', start);
+            if (end == std::string::npos) end = text.size();
+            line_number++;
+
+            tokenize(std::string_view(text).substr(start, end - start));
+            if (!tokens.empty())
+                statement(result);
+
+            start = end + 1;
+        }
+
+        if (groups.size() > 1)
+            fail("group '" + groups.back().name + "' is missing its 'end'");
+
+        auto& world = *groups.front().objects;
+        if (!world.objects.empty()) {
+            result.world_bvh = build_bvh(world);
+            result.world = hittable_list(result.world_bvh);
+        }
+        result.lights.build();
+        result.cam.motion_blur = moving_objects;
+        result.cam.texture_filtering = filtered_textures;
+
+        result.bvh_build_seconds = bvh_seconds;
+        return result;
+    }
+
+  private:
+    struct group {
+        std::string               name;
+        shared_ptr<hittable_list> objects;
+    };
+
+    std::string source;
+    std::string base_dir;
+    int line_number = 0;
+    std::vector<std::string_view> tokens;
+    size_t next = 0;
+
+    std::map<std::string, shared_ptr<texture>>  textures;
+    std::map<std::string, shared_ptr<material>> materials;
+    std::map<std::string, shared_ptr<hittable>> objects;
+    std::vector<group> groups;
+    scene_arena* arena = nullptr;  // Arena of the scene being parsed, which owns its objects
+    light_tree* lights = nullptr;  // Lights of the scene being parsed
+    bool top_level = false;        // The statement adds its geometry straight to the world
+    bool moving_objects = false;   // Some object moves over the shutter interval
+    bool filtered_textures = false;  // Some texture filters to the footprints of ray cones
+    double bvh_seconds = 0;
+
+    static double seconds_since(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    shared_ptr<bvh_node> build_bvh(const hittable_list& list) {
+        auto start = std::chrono::steady_clock::now();
+        auto node = arena->make<bvh_node>(list, arena);
+        bvh_seconds += seconds_since(start);
+        return node;
+    }
+
+    [[noreturn]] void fail(const std::string& message) const {
+        throw std::runtime_error(source + ":" + std::to_string(line_number) + ": " + message);
+    }
+
+    void tokenize(std::string_view line) {
+        tokens.clear();
+        next = 0;
+
+        auto comment = line.find('#');
+        if (comment != std::string_view::npos)
+            line = line.substr(0, comment);
+
+        size_t i = 0;
+        while (i < line.size()) {
+            while (i < line.size() && std::isspace(static_cast<unsigned char>(line[i]))) i++;
+            size_t j = i;
+            while (j < line.size() && !std::isspace(static_cast<unsigned char>(line[j]))) j++;
+            if (j > i) tokens.push_back(line.substr(i, j - i));
+            i = j;
+        }
+    }
+
+    // Token readers
+
+    bool more() const { return next < tokens.size(); }
+
+    std::string word(const char* what) {
+        if (!more()) fail(std::string("expected ") + what);
+        return std::string(tokens[next++]);
+    }
+
+    bool peek_number() const {
+        if (!more()) return false;
+        double value;
+        auto token = tokens[next];
+        auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+        return result.ec == std::errc() && result.ptr == token.data() + token.size();
+    }
+
+    double number(const char* what) {
+        if (!more()) fail(std::string("expected ") + what);
+        auto token = tokens[next++];
+        double value;
+        auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+        if (result.ec != std::errc() || result.ptr != token.data() + token.size())
+            fail(std::string("expected ") + what + ", found '" + std::string(token) + "'");
+        return value;
+    }
+
+    int integer(const char* what) {
+        double value = number(what);
+        if (value != std::floor(value)) fail(std::string(what) + " must be a whole number");
+        return int(value);
+    }
+
+    vec3 triple(const char* what) {
+        auto x = number(what);
+        auto y = number(what);
+        auto z = number(what);
+        return vec3(x, y, z);
+    }
+
+    pixel_rect rect(const char* what) {
+        // x y width height, in whole pixels.
+        pixel_rect r;
+        r.x = integer(what);
+        r.y = integer(what);
+        r.width = integer(what);
+        r.height = integer(what);
+        if (r.x < 0 || r.y < 0 || r.width < 0 || r.height < 0)
+            fail(std::string(what) + " must not be negative");
+        return r;
+    }
+
+    double ratio(const char* what) {
+        // A plain number, or W/H.
+        auto token = word(what);
+        auto slash = token.find('/');
+        double num, den = 1;
+        auto r1 = std::from_chars(token.data(), token.data() + (slash == std::string::npos ? token.size() : slash), num);
+        bool ok = r1.ec == std::errc();
+        if (ok && slash != std::string::npos) {
+            auto r2 = std::from_chars(token.data() + slash + 1, token.data() + token.size(), den);
+            ok = r2.ec == std::errc() && den != 0;
+        }
+        if (!ok) fail(std::string("expected ") + what + ", found '" + token + "'");
+        return num / den;
+    }
+
+    void finish() {
+        if (more()) fail("unexpected '" + std::string(tokens[next]) + "'");
+    }
+
+    std::string resolve_path(const std::string& path) const {
+        if (path.empty() || path[0] == '/' || base_dir.empty())
+            return path;
+        auto local = base_dir + path;
+        std::ifstream probe(local);
+        return probe.is_open() ? local : path;
+    }
+
+    // Named lookups
+
+    shared_ptr<texture> find_texture(const std::string& name) {
+        auto it = textures.find(name);
+        if (it == textures.end()) fail("unknown texture '" + name + "'");
+        return it->second;
+    }
+
+    shared_ptr<material> find_material(const std::string& name) {
+        auto it = materials.find(name);
+        if (it == materials.end()) fail("unknown material '" + name + "'");
+        return it->second;
+    }
+
+    shared_ptr<hittable> find_object(const std::string& name) {
+        auto it = objects.find(name);
+        if (it == objects.end()) fail("unknown object '" + name + "'");
+        return it->second;
+    }
+
+    shared_ptr<texture> color_or_texture(const char* what) {
+        if (peek_number())
+            return arena->make<solid_color>(triple(what));
+        return find_texture(word(what));
+    }
+
+    // Statements
+
+    void statement(scene& result) {
+        auto keyword = word("statement");
+
+        if (keyword == "render") return render_settings(result.cam);
+        if (keyword == "camera") return camera_settings(result.cam);
+        if (keyword == "texture") return texture_statement();
+        if (keyword == "material") return material_statement();
+        if (keyword == "environment") return environment_statement(result);
+
+        if (keyword == "group") {
+            auto name = word("group name");
+            finish();
+            groups.push_back({ name, arena->make<hittable_list>() });
+            return;
+        }
+
+        if (keyword == "end") {
+            finish();
+            if (groups.size() < 2) fail("'end' without 'group'");
+            objects[groups.back().name] = groups.back().objects;
+            groups.pop_back();
+            return;
+        }
+
+        if (keyword == "define") {
+            auto name = word("object name");
+            top_level = false;
+            objects[name] = geometry(word("geometry statement"));
+            finish();
+            return;
+        }
+
+        if (keyword == "animate") return animate_statement(result);
+
+        top_level = groups.size() == 1;
+        groups.back().objects->add(geometry(keyword));
+        finish();
+    }
+
+    void render_settings(camera& cam) {
+        while (more()) {
+            auto key = word("render setting");
+            if (!render_setting(cam, key)) fail("unknown render setting '" + key + "'");
+        }
+    }
+
+    void camera_settings(camera& cam) {
+        while (more()) {
+            auto key = word("camera setting");
+            if (!camera_setting(cam, key)) fail("unknown camera setting '" + key + "'");
+        }
+    }
+
+    bool render_setting(camera& cam, const std::string& key) {
+        if      (key == "width")      cam.image_width = integer("width");
+        else if (key == "aspect")     cam.aspect_ratio = ratio("aspect ratio");
+        else if (key == "spp")        cam.samples_per_pixel = integer("samples per pixel");
+        else if (key == "depth")      cam.max_depth = integer("depth");
+        else if (key == "background") cam.background = triple("background color");
+        else if (key == "window")     cam.window = rect("window");
+        else if (key == "region")     cam.regions.push_back(rect("region"));
+        else if (key == "tile") {
+            cam.tile_size = integer("tile size");
+            if (cam.tile_size < 1) fail("tile size must be positive");
+        }
+        else return false;
+        return true;
+    }
+
+    bool camera_setting(camera& cam, const std::string& key) {
+        if      (key == "vfov")          cam.vfov = number("vfov");
+        else if (key == "lookfrom")      cam.lookfrom = triple("lookfrom");
+        else if (key == "lookat")        cam.lookat = triple("lookat");
+        else if (key == "vup")           cam.vup = triple("vup");
+        else if (key == "defocus_angle") cam.defocus_angle = number("defocus angle");
+        else if (key == "focus_dist")    cam.focus_dist = number("focus distance");
+        else return false;
+        return true;
+    }
+
+    void animate_statement(scene& result) {
+        if (groups.size() > 1) fail("'animate' places objects only in the world, not in a group");
+
+        auto object = find_object(word("object name"));
+        std::vector<animation_step> steps;
+        while (more()) {
+            auto transform = word("transform");
+            animation_step step;
+            step.animated = transform == "spin" || transform == "move";
+            if (transform == "rotate_y" || transform == "spin") {
+                step.rotate = true;
+                step.angle = number("angle");
+            } else if (transform == "translate" || transform == "move") {
+                step.offset = triple("offset");
+            } else {
+                fail("unknown transform '" + transform + "'");
+            }
+            steps.push_back(step);
+        }
+
+        result.animations.emplace_back(object, steps, arena);
+        groups.back().objects->add(result.animations.back().root());
+    }
+
+    void environment_statement(scene& result) {
+        auto path = rtw_image::locate(resolve_path(word("environment image")).c_str());
+        auto intensity = more() ? number("intensity") : 1.0;
+        finish();
+
+        try {
+            result.cam.environment = arena->make<environment_light>(path, intensity);
+        } catch (const std::exception& e) {
+            fail(e.what());
+        }
+        lights->set_environment(result.cam.environment.get());
+    }
+
+    void texture_statement() {
+        auto name = word("texture name");
+        auto type = word("texture type");
+        shared_ptr<texture> tex;
+
+        if (type == "solid") {
+            tex = arena->make<solid_color>(triple("color"));
+        } else if (type == "checker") {
+            auto scale = number("checker scale");
+            auto even = triple("even color");
+            auto odd = triple("odd color");
+            tex = arena->make<checker_texture>(scale, even, odd);
+        } else if (type == "image") {
+            tex = arena->make<image_texture>(resolve_path(word("image file")).c_str());
+            filtered_textures = true;
+        } else if (type == "tiled_image") {
+            auto path = resolve_path(word("image file"));
+            try {
+                tex = arena->make<tiled_image_texture>(path.c_str());
+                filtered_textures = true;
+            } catch (const std::exception& e) {
+                fail("cannot load tiled image '" + path + "': " + e.what());
+            }
+        } else if (type == "noise") {
+            auto scale = number("noise scale");
+            if (more()) {
+                if (word("baked") != "baked") fail("expected 'baked' after the noise scale");
+                auto resolution = integer("bake resolution");
+                if (resolution < 1) fail("bake resolution must be at least 1");
+                auto min = triple("bake box corner");
+                auto max = triple("opposite bake box corner");
+                tex = arena->make<noise_texture>(scale, min, max, resolution);
+            } else {
+                tex = arena->make<noise_texture>(scale);
+            }
+        } else {
+            fail("unknown texture type '" + type + "'");
+        }
+
+        finish();
+        textures[name] = tex;
+    }
+
+    void material_statement() {
+        auto name = word("material name");
+        auto type = word("material type");
+        shared_ptr<material> mat;
+
+        if (type == "lambertian") {
+            mat = arena->make<lambertian>(color_or_texture("albedo"));
+        } else if (type == "metal") {
+            auto albedo = triple("albedo");
+            mat = arena->make<metal>(albedo, number("fuzz"));
+        } else if (type == "dielectric") {
+            mat = arena->make<dielectric>(number("refraction index"));
+        } else if (type == "diffuse_light") {
+            mat = arena->make<diffuse_light>(color_or_texture("emission"));
+        } else if (type == "isotropic") {
+            mat = arena->make<isotropic>(color_or_texture("albedo"));
+        } else {
+            fail("unknown material type '" + type + "'");
+        }
+
+        finish();
+        materials[name] = mat;
+    }
+
+    bool is_light(const shared_ptr<material>& mat) const {
+        return top_level && std::dynamic_pointer_cast<diffuse_light>(mat);
+    }
+
+    shared_ptr<hittable> geometry(const std::string& keyword) {
+        if (keyword == "sphere") {
+            auto mat = find_material(word("material"));
+            auto center = triple("center");
+            auto radius = number("radius");
+            if (is_light(mat)) {
+                auto light = lights->add_sphere(center, std::fmax(0, radius), mat);
+                if (light >= 0)
+                    mat = arena->make<sampled_light>(mat, light);
+            }
+            return arena->make<sphere>(center, radius, mat);
+        }
+
+        if (keyword == "moving_sphere") {
+            auto mat = find_material(word("material"));
+            auto center1 = triple("start center");
+            auto center2 = triple("end center");
+            moving_objects = true;
+            return arena->make<moving_sphere>(center1, center2, number("radius"), mat);
+        }
+
+        if (keyword == "quad" || keyword == "triangle") {
+            auto mat = find_material(word("material"));
+            auto Q = triple("corner");
+            auto u = triple("u edge");
+            auto v = triple("v edge");
+            if (keyword == "triangle")
+                return arena->make<triangle>(Q, u, v, mat);
+            if (is_light(mat)) {
+                auto light = lights->add_quad(Q, u, v, mat);
+                if (light >= 0)
+                    mat = arena->make<sampled_light>(mat, light);
+            }
+            return arena->make<quad>(Q, u, v, mat);
+        }
+
+        if (keyword == "box") {
+            auto mat = find_material(word("material"));
+            auto a = triple("corner");
+            auto b = triple("opposite corner");
+            return box(a, b, mat, arena);
+        }
+
+        if (keyword == "mesh") {
+            auto mat = find_material(word("material"));
+            auto path = resolve_path(word("mesh file"));
+            try {
+                return load_mesh(path.c_str(), mat);
+            } catch (const std::exception& e) {
+                fail("cannot load mesh '" + path + "': " + e.what());
+            }
+        }
+
+        if (keyword == "instance") {
+            auto object = find_object(word("object name"));
+            while (more()) {
+                auto transform = word("transform");
+                if (transform == "rotate_y")
+                    object = arena->make<rotate_y>(object, number("angle"));
+                else if (transform == "translate")
+                    object = arena->make<translate>(object, triple("offset"));
+                else
+                    fail("unknown transform '" + transform + "'");
+            }
+            return object;
+        }
+
+        if (keyword == "medium") {
+            auto boundary = find_object(word("boundary object"));
+            auto density = number("density");
+            return arena->make<constant_medium>(boundary, density, color_or_texture("albedo"));
+        }
+
+        if (keyword == "volume") {
+            auto path = resolve_path(word("volume file"));
+            auto min = triple("corner");
+            auto max = triple("opposite corner");
+            auto density = number("density");
+            auto albedo = color_or_texture("albedo");
+            if (!(min.x() < max.x() && min.y() < max.y() && min.z() < max.z()))
+                fail("the second corner of a volume must be larger along every axis");
+            shared_ptr<density_grid> grid;
+            try {
+                grid = load_density_grid(path, min, max, density);
+            } catch (const std::exception& e) {
+                fail("cannot load volume '" + path + "': " + e.what());
+            }
+            return arena->make<constant_medium>(box(min, max, nullptr, arena), grid, albedo);
+        }
+
+        if (keyword == "bvh") {
+            auto name = word("group name");
+            auto list = std::dynamic_pointer_cast<hittable_list>(find_object(name));
+            if (!list) fail("'" + name + "' is not a group");
+            if (list->objects.empty()) fail("group '" + name + "' is empty");
+            return build_bvh(*list);
+        }
+
+        fail("unknown statement '" + keyword + "'");
+    }
+};
+
+inline scene load_scene(const std::string& filename) {
+    // Loads a scene description file. Throws std::runtime_error naming the file and line on
+    // any error.
+    return scene_loader().load(filename);
+}
+
+inline void apply_camera_settings(camera& cam, const std::string& settings,
+                                  const std::string& origin = "camera settings") {
+    // Applies render and camera settings written as in a scene file, such as
+    // "width 400 lookfrom 0 1 5 vfov 30", on top of those `cam` already has. Throws
+    // std::runtime_error naming `origin` on any error.
+    scene_loader().apply_settings(cam, settings, origin);
+}
+
+#endif
@@ -0,0 +1,246 @@
+#ifndef SOCKET_STREAM_H
+#define SOCKET_STREAM_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Stream sockets for the render server and its clients. An address of the form host:port
+// names a TCP socket; anything else is the path of a Unix domain socket. An empty host means
+// loopback: a listener binds 127.0.0.1, and a connection tries the local addresses. Listening
+// on any other interface takes its address, or 0.0.0.0 for all of them.
+
+namespace socket_detail {
+    inline bool is_tcp(const std::string& address, std::string& host, std::string& port) {
+        auto colon = address.find_last_of(':');
+        if (colon == std::string::npos || colon + 1 == address.size()
+            || address.find('/') != std::string::npos)
+            return false;
+        for (auto i = colon + 1; i < address.size(); i++)
+            if (address[i] < '0' || address[i] > '9')
+                return false;
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+        return true;
+    }
+
+    inline sockaddr_un unix_address(const std::string& path) {
+        sockaddr_un addr {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+            throw std::runtime_error("socket path '" + path + "' is too long");
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        return addr;
+    }
+
+    [[noreturn]] inline void fail(const std::string& what, const std::string& address) {
+        throw std::runtime_error(what + " '" + address + "': " + std::strerror(errno));
+    }
+
+    template <typename Use>
+    int tcp_socket(const std::string& host, const std::string& port, bool passive,
+                   const std::string& address, Use use) {
+        // Opens a socket for the first of the host's addresses that `use` accepts.
+        addrinfo hints {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+        addrinfo* found = nullptr;
+        auto status = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found);
+        if (status != 0)
+            throw std::runtime_error("cannot resolve '" + address + "': " + gai_strerror(status));
+
+        int fd = -1;
+        for (auto info = found; info && fd < 0; info = info->ai_next) {
+            fd = ::socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+            if (fd >= 0 && !use(fd, info)) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(found);
+        if (fd < 0)
+            fail(passive ? "cannot listen on" : "cannot connect to", address);
+        return fd;
+    }
+}
+
+// A connected socket, read a line or a block of bytes at a time through a buffer.
+class socket_stream {
+  public:
+    explicit socket_stream(int fd) : fd(fd) {}
+
+    ~socket_stream() {
+        if (fd >= 0) ::close(fd);
+    }
+
+    socket_stream(socket_stream&& other) noexcept
+      : fd(std::exchange(other.fd, -1)), buffer(std::move(other.buffer)) {}
+
+    socket_stream(const socket_stream&) = delete;
+    socket_stream& operator=(const socket_stream&) = delete;
+
+    static socket_stream connect(const std::string& address) {
+        // Throws std::runtime_error if the connection cannot be made.
+        std::string host, port;
+        if (socket_detail::is_tcp(address, host, port)) {
+            int fd = socket_detail::tcp_socket(host, port, false, address,
+                [](int fd, const addrinfo* info) {
+                    return ::connect(fd, info->ai_addr, info->ai_addrlen) == 0;
+                });
+            // Tile headers are small writes that should not wait for the data behind them.
+            int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return socket_stream(fd);
+        }
+
+        auto addr = socket_detail::unix_address(address);
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            if (fd >= 0) ::close(fd);
+            socket_detail::fail("cannot connect to", address);
+        }
+        return socket_stream(fd);
+    }
+
+    bool read_line(std::string& line) {
+        // Reads up to the next newline, which is dropped. Returns false at the end of the
+        // stream if no more lines remain.
+        for (;;) {
+            auto newline = buffer.find('\n');
+            if (newline != std::string::npos) {
+                line = buffer.substr(0, newline);
+                buffer.erase(0, newline + 1);
+                return true;
+            }
+            if (!fill()) {
+                line = std::exchange(buffer, std::string());
+                return !line.empty();
+            }
+        }
+    }
+
+    void read(void* data, size_t size) {
+        // Reads exactly `size` bytes. Throws std::runtime_error if the stream ends first.
+        auto out = static_cast<char*>(data);
+        while (size > 0) {
+            if (buffer.empty() && !fill())
+                throw std::runtime_error("connection closed in the middle of a message");
+            auto n = std::min(size, buffer.size());
+            std::memcpy(out, buffer.data(), n);
+            buffer.erase(0, n);
+            out += n;
+            size -= n;
+        }
+    }
+
+    void write(const void* data, size_t size) {
+        // Writes all `size` bytes. Throws std::runtime_error if the peer has gone away.
+        auto in = static_cast<const char*>(data);
+        while (size > 0) {
+            auto n = ::send(fd, in, size, send_flags);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                throw std::runtime_error(std::string("cannot send: ") + std::strerror(errno));
+            in += n;
+            size -= size_t(n);
+        }
+    }
+
+    void write(const std::string& text) { write(text.data(), text.size()); }
+
+  private:
+#ifdef MSG_NOSIGNAL
+    static constexpr int send_flags = MSG_NOSIGNAL;  // Report a closed peer as an error, not SIGPIPE
+#else
+    static constexpr int send_flags = 0;
+#endif
+
+    int fd = -1;
+    std::string buffer;  // Received bytes not yet read
+
+    bool fill() {
+        char chunk[65536];
+        for (;;) {
+            auto n = ::recv(fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            buffer.append(chunk, size_t(n));
+            return true;
+        }
+    }
+};
+
+// A socket accepting connections. A Unix domain socket's file is replaced if it already
+// exists, and removed again when the listener is destroyed.
+class socket_listener {
+  public:
+    explicit socket_listener(const std::string& address) : address(address) {
+        // Throws std::runtime_error if the address cannot be bound.
+        std::string host, port;
+        if (socket_detail::is_tcp(address, host, port)) {
+            if (host.empty())
+                host = "127.0.0.1";
+            fd = socket_detail::tcp_socket(host, port, true, address,
+                [](int fd, const addrinfo* info) {
+                    int one = 1;
+                    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                    return ::bind(fd, info->ai_addr, info->ai_addrlen) == 0 && ::listen(fd, 16) == 0;
+                });
+            return;
+        }
+
+        auto addr = socket_detail::unix_address(address);
+        ::unlink(address.c_str());
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+            || ::listen(fd, 16) != 0) {
+            if (fd >= 0) ::close(fd);
+            socket_detail::fail("cannot listen on", address);
+        }
+        unix_path = address;
+    }
+
+    ~socket_listener() {
+        ::close(fd);
+        if (!unix_path.empty()) ::unlink(unix_path.c_str());
+    }
+
+    socket_listener(const socket_listener&) = delete;
+    socket_listener& operator=(const socket_listener&) = delete;
+
+    socket_stream accept() {
+        // Waits for the next connection. Throws std::runtime_error if accepting fails.
+        for (;;) {
+            int client = ::accept(fd, nullptr, nullptr);
+            if (client >= 0) {
+                int one = 1;
+                ::setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                return socket_stream(client);
+            }
+            if (errno != EINTR && errno != ECONNABORTED)
+                socket_detail::fail("cannot accept on", address);
+        }
+    }
+
+  private:
+    std::string address;
+    std::string unix_path;
+    int fd = -1;
+};
+
+#endif
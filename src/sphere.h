@@ -3,27 +3,46 @@
 
 #include "hittable.h"
 
-class sphere : public hittable {
+#include <type_traits>
+
+namespace sphere_detail {
+    struct no_motion {};
+}
+
+// A sphere, either static or moving in a straight line over the shutter interval, from its
+// center at time 0 to another at time 1. The two are separate types, `sphere` and
+// `moving_sphere`, so that static spheres, by far the more common, neither store a motion nor
+// evaluate one for every ray they are tested against.
+template <bool Moving>
+class basic_sphere : public hittable {
   public:
-    sphere(const point3& static_center, double radius, shared_ptr<material> mat)
-      : center_ray(static_center, vec3(0,0,0)), radius(std::fmax(0,radius)), mat(mat)
+    basic_sphere(const point3& static_center, double radius, shared_ptr<material> mat)
+      requires (!Moving)
+      : start_center(static_center), radius(std::fmax(0,radius)), mat(mat)
     {
-        auto rvec = vec3(radius, radius, radius);
-        bbox = aabb(static_center - rvec, static_center + rvec);
+        update_bounds();
     }
 
-    sphere(const point3& center1, const point3& center2, double radius,
-           shared_ptr<material> mat)
-      : center_ray(center1, center2 - center1), radius(std::fmax(0,radius)), mat(mat)
+    basic_sphere(const point3& center1, const point3& center2, double radius,
+                 shared_ptr<material> mat)
+      requires Moving
+      : start_center(center1), motion(center2 - center1), radius(std::fmax(0,radius)), mat(mat)
     {
-        auto rvec = vec3(radius, radius, radius);
-        aabb box1(center_ray.at(0) - rvec, center_ray.at(0) + rvec);
-        aabb box2(center_ray.at(1) - rvec, center_ray.at(1) + rvec);
-        bbox = aabb(box1, box2);
+        update_bounds();
     }
 
+    void set_center(const point3& center) {
+        // Moves the sphere so that it starts the shutter interval at `center`, keeping any
+        // motion it makes during the interval.
+        start_center = center;
+        update_bounds();
+    }
+
+    point3 center() const { return start_center; }
+
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        point3 sphere_center = center_ray.at(r.time());
+        RTW_COUNT(primitives_tested);
+        point3 sphere_center = center_at(r.time());
         vec3 oc = sphere_center - r.origin();
         auto a = r.direction().length_squared();
         auto half_b = dot(r.direction(), oc);
@@ -47,15 +66,89 @@ class sphere : public hittable {
         vec3 outward_normal = (rec.p - sphere_center) / radius;
         rec.set_face_normal(r, outward_normal);
         get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.set_footprint(r, uv_length());
         rec.mat = mat;
+        RTW_COUNT(hits);
 
         return true;
     }
 
+    bool occluded(const ray& r, interval ray_t) const override {
+        // The roots of hit, without the hit point, normal or texture coordinates.
+        RTW_COUNT(primitives_tested);
+        point3 sphere_center = center_at(r.time());
+        vec3 oc = sphere_center - r.origin();
+        auto a = r.direction().length_squared();
+        auto half_b = dot(r.direction(), oc);
+        auto c = oc.length_squared() - radius*radius;
+
+        auto discriminant = half_b*half_b - a*c;
+        if (discriminant < 0)
+            return false;
+
+        auto sqrtd = std::sqrt(discriminant);
+        if (!ray_t.surrounds((half_b - sqrtd) / a) && !ray_t.surrounds((half_b + sqrtd) / a))
+            return false;
+
+        RTW_COUNT(hits);
+        return true;
+    }
+
+    bool hit_span(const ray& r, interval& span) const override {
+        // Both roots of the same quadratic, so the line is tested once.
+        RTW_COUNT(primitives_tested);
+        point3 sphere_center = center_at(r.time());
+        vec3 oc = sphere_center - r.origin();
+        auto a = r.direction().length_squared();
+        auto half_b = dot(r.direction(), oc);
+        auto c = oc.length_squared() - radius*radius;
+
+        auto discriminant = half_b*half_b - a*c;
+        if (discriminant < 0)
+            return false;
+
+        auto sqrtd = std::sqrt(discriminant);
+        auto entry = (half_b - sqrtd) / a;
+        auto exit = (half_b + sqrtd) / a;
+
+        // Tangent lines touch the sphere without passing through it.
+        if (!(exit > entry + 0.0001))
+            return false;
+
+        span = interval(entry, exit);
+        RTW_COUNT(hits);
+        return true;
+    }
+
     aabb bounding_box() const override { return bbox; }
 
+    aabb bounding_box_at(double time) const override {
+        auto rvec = vec3(radius, radius, radius);
+        auto center = center_at(time);
+        return aabb(center - rvec, center + rvec);
+    }
+
   private:
-    ray center_ray;
+    point3 start_center;
+    [[no_unique_address]] std::conditional_t<Moving, vec3, sphere_detail::no_motion> motion;
+
+    point3 center_at(double time) const {
+        if constexpr (Moving)
+            return start_center + time * motion;
+        else
+            return start_center;
+    }
+
+    void update_bounds() {
+        bbox = Moving ? aabb(bounding_box_at(0), bounding_box_at(1)) : bounding_box_at(0);
+    }
+
+    double uv_length() const {
+        // u runs around the equator (2 pi r) and v pole to pole (pi r). Images mapped onto
+        // spheres are usually twice as wide as tall, so their pixels are square at 2 pi r.
+        return 2 * pi * radius;
+    }
+
     double radius;
     shared_ptr<material> mat;
     aabb bbox;
@@ -68,4 +161,7 @@ class sphere : public hittable {
     }
 };
 
+using sphere = basic_sphere<false>;
+using moving_sphere = basic_sphere<true>;
+
 #endif
\ No newline at end of file
@@ -2,7 +2,7 @@
 #define TEXTURE_H
 #include "color.h"
 #include "vec3.h"
-#include "rtw_stb_image.h"
+#include "texture_manager.h"
 #include "perlin.h"
 
 class texture {
@@ -10,6 +10,12 @@ public:
     virtual ~texture() = default;
 
     virtual color value(double u, double v, const point3& p) const = 0;
+
+    virtual color value(double u, double v, const point3& p, double footprint) const {
+        // Returns the texture averaged over a footprint `footprint` wide in texture coordinates,
+        // as seen by a ray cone. Textures without filtering ignore the footprint.
+        return value(u, v, p);
+    }
 };
 
 class solid_color : public texture {
@@ -35,58 +41,156 @@ class checker_texture : public texture {
       : checker_texture(scale, make_shared<solid_color>(c1), make_shared<solid_color>(c2)) {}
 
      color value(double u, double v, const point3& p) const override {
-        int xComp = int(std::floor(inv_scale * p.x()));
-        int yComp = int(std::floor(inv_scale * p.y()));
-        int zComp = int(std::floor(inv_scale * p.z()));
-
-        bool is_even = (xComp + yComp + zComp) % 2 == 0;
-
-        if (is_even) {
+        if (is_even(p)) {
             return even->value(u, v, p);
         }
         return odd->value(u, v, p);
     }
+
+    color value(double u, double v, const point3& p, double footprint) const override {
+        auto& tex = is_even(p) ? even : odd;
+        return tex->value(u, v, p, footprint);
+    }
 private:
     double inv_scale;
     shared_ptr<texture> even;
     shared_ptr<texture> odd;
+
+    bool is_even(const point3& p) const {
+        int xComp = int(std::floor(inv_scale * p.x()));
+        int yComp = int(std::floor(inv_scale * p.y()));
+        int zComp = int(std::floor(inv_scale * p.z()));
+
+        return (xComp + yComp + zComp) % 2 == 0;
+    }
 };
 
+namespace texture_detail {
+    template <typename Texel>
+    color bilinear(double u, double v, int width, int height, Texel texel) {
+        // Blend the four texels around image coordinates u,v in [0,1] of an image of the given
+        // size. texel(i, j) returns the address of the RGB bytes of texel i,j, clamped to the
+        // image edges.
+        auto x = u * width - 0.5;
+        auto y = v * height - 0.5;
+        auto x0 = std::floor(x);
+        auto y0 = std::floor(y);
+        auto fx = x - x0;
+        auto fy = y - y0;
+        int i = int(x0), j = int(y0);
+
+        auto fetch = [&](int di, int dj) {
+            auto pixel = texel(i + di, j + dj);
+            return color(pixel[0], pixel[1], pixel[2]);
+        };
+
+        auto color_scale = 1.0 / 255.0;
+        return color_scale * ((1-fy) * ((1-fx) * fetch(0,0) + fx * fetch(1,0))
+                              + fy   * ((1-fx) * fetch(0,1) + fx * fetch(1,1)));
+    }
+
+    template <typename Level>
+    color trilinear(double footprint, int width, int height, int levels, Level level_color) {
+        // Pick the mip level whose texels match the footprint in size, and blend the colors
+        // level_color(level) returns for the two nearest levels.
+        auto texels = footprint * std::max(width, height);
+        if (texels <= 1)
+            return level_color(0);
+
+        auto lod = std::fmin(std::log2(texels), levels - 1);
+        int level = int(lod);
+        auto blend = lod - level;
+        if (blend <= 0 || level + 1 >= levels)
+            return level_color(level);
+
+        return (1 - blend) * level_color(level) + blend * level_color(level + 1);
+    }
+}
+
 class image_texture : public texture {
 public:
-    image_texture(const char* filename) : image(filename) {}
+    // Images are shared through the texture manager, so textures of the same file share one
+    // copy of it.
+    image_texture(const char* filename) : image(texture_manager::load(filename)) {}
 
     color value(double u, double v, const point3& p) const override {
+        // Bilinear lookup in the full-resolution image.
+        return value(u, v, p, 0);
+    }
+
+    color value(double u, double v, const point3& p, double footprint) const override {
+        // Trilinear lookup, filtered to the footprint.
+
         // If we have no texture data, then return solid cyan as a debugging aid.
-        if (image.height() <= 0) return color(0,1,1);
+        if (image->height() <= 0) return color(0,1,1);
 
         // Clamp input texture coordinates to [0,1] x [1,0]
         u = interval(0,1).clamp(u);
         v = 1.0 - interval(0,1).clamp(v);  // Flip V to image coordinates
 
-        auto i = int(u * image.width());
-        auto j = int(v * image.height());
-        auto pixel = image.pixel_data(i,j);
+        return texture_detail::trilinear(footprint, image->width(), image->height(), image->levels(),
+            [&](int level) {
+                return texture_detail::bilinear(u, v, image->width(level), image->height(level),
+                    [&](int i, int j) { return image->pixel_data(i, j, level); });
+            });
+    }
+
+private:
+    shared_ptr<const rtw_image> image;
+};
 
-        auto color_scale = 1.0 / 255.0;
-        return color(color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2]);
+class tiled_image_texture : public texture {
+public:
+    // Samples an image through the tile cache, reading only the tiles that rays touch. Throws
+    // std::runtime_error if the image's tile file can be neither opened nor built.
+    tiled_image_texture(const char* filename) : image(texture_manager::load_tiled(filename)) {}
+
+    color value(double u, double v, const point3& p) const override {
+        return value(u, v, p, 0);
     }
+
+    color value(double u, double v, const point3& p, double footprint) const override {
+        u = interval(0,1).clamp(u);
+        v = 1.0 - interval(0,1).clamp(v);  // Flip V to image coordinates
+
+        // Each render thread keeps its cursors from one lookup to the next, so lookups that
+        // land in the tiles of the last one skip the shared cache and its locks. Trilinear
+        // lookups read two neighbouring levels, which get a cursor each.
+        static thread_local tiled_image::cursor cursors[2];
+        return texture_detail::trilinear(footprint, image->width(0), image->height(0), image->levels(),
+            [&](int level) {
+                auto& at = cursors[level % 2];
+                return texture_detail::bilinear(u, v, image->width(level), image->height(level),
+                    [&](int i, int j) { return image->texel(i, j, level, at); });
+            });
+    }
+
 private:
-    rtw_image image;
+    shared_ptr<const tiled_image> image;
 };
 
 class noise_texture : public texture {
 public:
     noise_texture(double scale) : scale(scale) {}
 
+    // Bakes the turbulence over the box from `min` to `max` at `resolution` cells along its
+    // longest side. Points inside the box use the baked grid; points outside evaluate it.
+    noise_texture(double scale, const point3& min, const point3& max, int resolution)
+      : scale(scale), baked(make_shared<baked_turbulence>(noise, min, max, resolution, octaves)) {}
+
     color value(double u, double v, const point3& p) const override {
         //return color(1,1,1) * noise.turb(p, 7);
-        return color(.5, .5, .5) * (1 + std::sin(scale * p.z() + 10 * noise.turbulence(p, 7)));
+        double turbulence;
+        if (!baked || !baked->lookup(p, turbulence))
+            turbulence = noise.turbulence(p, octaves);
+        return color(.5, .5, .5) * (1 + std::sin(scale * p.z() + 10 * turbulence));
     }
 
 private:
+    static constexpr int octaves = 7;
     perlin noise;
     double scale;
+    shared_ptr<baked_turbulence> baked;
 };
 
 #endif
\ No newline at end of file
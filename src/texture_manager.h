@@ -0,0 +1,100 @@
+#ifndef TEXTURE_MANAGER_H
+#define TEXTURE_MANAGER_H
+
+#include "rtw_stb_image.h"
+#include "tiled_image.h"
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Shares loaded images between every texture that uses them. Images are keyed by the path
+// they were found at, loaded on first use, and released when the last texture holding them
+// goes away. Tiled images are shared the same way; their pixels live in the tile cache and
+// are not counted here.
+class texture_manager {
+  public:
+    static shared_ptr<const rtw_image> load(const char* image_filename) {
+        // Returns the image for the given file name, found as rtw_image::locate finds it,
+        // loading it if no texture holds it yet.
+        auto key = canonical_path(rtw_image::locate(image_filename));
+
+        auto& state = shared();
+        std::lock_guard<std::mutex> lock(state.mutex);
+
+        auto& entry = state.images[key];
+        if (auto image = entry.lock())
+            return image;
+
+        auto image = make_shared<const rtw_image>(key.c_str());
+        entry = image;
+        return image;
+    }
+
+    static shared_ptr<const tiled_image> load_tiled(const char* image_filename) {
+        // Returns the tiled form of the given image (see open_tiled_image), opening it if no
+        // texture holds it yet. Throws std::runtime_error if it cannot be opened or built.
+        auto key = canonical_path(rtw_image::locate(image_filename));
+
+        auto& state = shared();
+        std::lock_guard<std::mutex> lock(state.mutex);
+
+        auto& entry = state.tiled_images[key];
+        if (auto image = entry.lock())
+            return image;
+
+        auto image = open_tiled_image(key);
+        entry = image;
+        return image;
+    }
+
+    static size_t image_count() {
+        // Number of images currently loaded.
+        size_t count = 0;
+        for_each_image([&](const rtw_image&) { count++; });
+        return count;
+    }
+
+    static size_t resident_bytes() {
+        // Memory held by the pixel data of every image currently loaded.
+        size_t bytes = 0;
+        for_each_image([&](const rtw_image& image) { bytes += image.resident_bytes(); });
+        return bytes;
+    }
+
+  private:
+    struct state {
+        std::mutex mutex;
+        std::map<std::string, std::weak_ptr<const rtw_image>> images;
+        std::map<std::string, std::weak_ptr<const tiled_image>> tiled_images;
+    };
+
+    static state& shared() {
+        static state instance;
+        return instance;
+    }
+
+    static std::string canonical_path(const std::string& path) {
+        std::error_code error;
+        auto canonical = std::filesystem::weakly_canonical(path, error);
+        return error ? path : canonical.string();
+    }
+
+    template <typename Visit>
+    static void for_each_image(Visit visit) {
+        auto& state = shared();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        for (auto it = state.images.begin(); it != state.images.end(); ) {
+            if (auto image = it->second.lock()) {
+                visit(*image);
+                ++it;
+            } else {
+                it = state.images.erase(it);
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,289 @@
+#ifndef TILE_COORDINATOR_H
+#define TILE_COORDINATOR_H
+
+#include "render_service.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Renders one image across several render servers (see render_service.h) acting as workers,
+// possibly on other machines. The coordinator splits the image into square tiles and hands
+// them out one at a time, each as a job for its window of the image, so fast workers take more
+// tiles than slow ones. The float tiles the workers return are handed on as they arrive, so
+// the coordinator never holds the whole image; the caller decides where they go.
+//
+// A worker that fails, by dropping its connection or refusing to connect, loses the tile it
+// was rendering back to the queue for the others to take. It is tried again after a pause, up
+// to `retries` times in a row, before it is given up on. The render fails only if every worker
+// has been given up on, if a worker reports an error in the job itself, such as a missing
+// scene file, which every other worker would report too, or if the tiles cannot be handed on.
+//
+// Tiles are whole packet blocks on a side, so every pixel keeps the random sequence of a local
+// render and the image does not depend on which worker rendered what.
+//
+// Tile costs can differ a hundredfold across an image, and a worker that takes an expensive
+// tile last holds up the whole render while the others sit idle. So, unless `by_cost` is
+// false, the first worker to connect runs the camera's cost prepass over the tiles, and the
+// tiles are handed out most expensive first. Tiles predicted to cost more than a quarter of
+// a worker's fair share are split into strips, so the last tiles handed out are all cheap.
+class tile_coordinator {
+  public:
+    tile_coordinator(std::vector<std::string> workers, int tile_size, int retries = 3,
+                     bool by_cost = true)
+      : workers(std::move(workers)), retries(retries), by_cost(by_cost)
+    {
+        const int block = ray_packet::width;
+        this->tile_size = std::max(block, (tile_size + block - 1) / block * block);
+    }
+
+    using size_callback = std::function<void(int width, int height)>;
+
+    void render(const render_job& job, const size_callback& on_size, const tile_callback& on_tile) {
+        // Renders `job` on the workers. `on_size` is called with the size of the image once it
+        // is known, and then `on_tile` with each tile once all of it has arrived, one call at
+        // a time, from the worker threads. Throws std::runtime_error if the image cannot be
+        // finished, or if either callback throws.
+        if (workers.empty())
+            throw std::runtime_error("no workers to render on");
+
+        state = shared_state();
+        state.workers_left = int(workers.size());
+        timings.clear();
+        this->on_size = on_size;
+        this->on_tile = on_tile;
+        auto start_time = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> threads;
+        for (const auto& address : workers)
+            threads.emplace_back([this, &job, address] { work(job, address); });
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return finished(); });
+        }
+        for (auto& t : threads)
+            t.join();
+
+        if (!state.error.empty())
+            throw std::runtime_error(state.error);
+        if (!state.sized || !state.pending.empty())
+            throw std::runtime_error("every worker was lost before the image was finished");
+
+        auto end_time = std::chrono::steady_clock::now();
+        seconds = std::chrono::duration<double>(end_time - start_time).count();
+        tail_seconds = std::chrono::duration<double>(end_time - state.handed_out).count();
+    }
+
+    // The predicted cost and measured time, including the transfer, of each tile of the most
+    // recent render, in the order the tiles were finished.
+    const std::vector<tile_timing>& tile_timings() const { return timings; }
+
+    double seconds = 0;       // Wall time of the most recent render
+    double tail_seconds = 0;  // Of which after the last tile was handed out
+
+  private:
+    struct shared_state {
+        bool                    sized = false;  // The image size and tiles are known
+        bool                    predicting = false;  // A worker is running the cost prepass
+        int                     width = 0, height = 0;
+        std::deque<tile_timing> pending;        // Tiles no worker has finished or is rendering
+        int                     in_flight = 0;  // Tiles being rendered
+        int                     workers_left = 0;
+        std::string             error;          // Set by a job or output error, which ends the render
+        std::chrono::steady_clock::time_point handed_out;  // When the queue last ran empty
+    };
+
+    std::vector<std::string> workers;
+    int tile_size;
+    int retries;
+    bool by_cost;
+    std::vector<tile_timing> timings;
+    size_callback on_size;
+    tile_callback on_tile;
+    std::mutex output_mutex;          // Held for each call of on_tile
+    std::mutex mutex;                 // Guards `state`
+    std::condition_variable changed;  // Signalled whenever `state` changes
+    shared_state state;
+
+    bool finished() const {
+        // Called with the mutex held.
+        return !state.error.empty() || state.workers_left == 0
+            || (state.sized && state.pending.empty() && state.in_flight == 0);
+    }
+
+    void set_size(int width, int height, std::vector<tile_timing> costs) {
+        // Called with the mutex held, by the first worker to report the image size, with the
+        // predicted tile costs if it ran the prepass.
+        state.sized = true;
+        state.width = width;
+        state.height = height;
+        try {
+            if (on_size)
+                on_size(width, height);
+        } catch (const std::exception& e) {
+            state.error = e.what();
+            return;
+        }
+        if (costs.empty()) {
+            for (int y = 0; y < height; y += tile_size)
+                for (int x = 0; x < width; x += tile_size)
+                    state.pending.push_back({ { x, y, std::min(tile_size, width - x), std::min(tile_size, height - y) } });
+            return;
+        }
+
+        double total_cost = 0;
+        for (const auto& tile : costs)
+            total_cost += tile.predicted;
+        std::stable_sort(costs.begin(), costs.end(), [](const tile_timing& a, const tile_timing& b) {
+            return a.predicted > b.predicted;
+        });
+
+        // Strips are whole blocks high, so they keep the random sequences of the render.
+        const int block = ray_packet::width;
+        auto strip_cost = total_cost / (4.0 * workers.size());
+        for (const auto& tile : costs) {
+            int block_rows = (tile.rect.height + block - 1) / block;
+            int strips = strip_cost > 0 ? int(std::ceil(tile.predicted / strip_cost)) : 1;
+            strips = std::clamp(strips, 1, block_rows);
+            for (int s = 0; s < strips; s++) {
+                int y0 = tile.rect.y + s * block_rows / strips * block;
+                int y1 = std::min(tile.rect.y + (s + 1) * block_rows / strips * block,
+                                  tile.rect.y + tile.rect.height);
+                state.pending.push_back({ { tile.rect.x, y0, tile.rect.width, y1 - y0 },
+                                          tile.predicted / strips });
+            }
+        }
+    }
+
+    void work(const render_job& job, const std::string& address) {
+        int failures = 0;
+        for (;;) {
+            tile_timing tile;
+            bool have_tile = false;
+            bool predicting = false;
+            try {
+                render_client client(address);
+
+                // Asking for the size, or for the tile costs, also loads the scene on the
+                // worker before any tile needs it. Only one worker runs the prepass; the
+                // others wait for its costs, unless it fails and another takes over.
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    predicting = by_cost && !state.sized && !state.predicting;
+                    state.predicting = state.predicting || predicting;
+                }
+                int width, height;
+                std::vector<tile_timing> costs;
+                if (predicting) {
+                    auto cost_job = job;
+                    cost_job.settings += " tile " + std::to_string(tile_size);
+                    costs = client.predict_costs(cost_job, width, height);
+                } else {
+                    auto size_job = job;
+                    size_job.kind = render_job::size;
+                    client.render(size_job, width, height, nullptr);
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!state.sized && (predicting || !by_cost))
+                        set_size(width, height, std::move(costs));
+                    changed.notify_all();
+                }
+
+                for (;;) {
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        // A worker left waiting on a prepass that failed reconnects to run it.
+                        auto orphaned = [this] { return !state.sized && !state.predicting; };
+                        changed.wait(lock, [&] { return finished() || !state.pending.empty() || orphaned(); });
+                        if (finished())
+                            return;
+                        if (orphaned())
+                            break;
+                        tile = state.pending.front();
+                        state.pending.pop_front();
+                        state.in_flight++;
+                        have_tile = true;
+                        if (state.pending.empty())
+                            state.handed_out = std::chrono::steady_clock::now();
+                    }
+
+                    auto tile_start = std::chrono::steady_clock::now();
+                    const auto& rect = tile.rect;
+                    auto tile_job = job;
+                    tile_job.settings += " window " + std::to_string(rect.x) + " " + std::to_string(rect.y)
+                                       + " " + std::to_string(rect.width) + " " + std::to_string(rect.height);
+
+                    // Pieces are only handed on once the whole tile has arrived, so a tile lost
+                    // halfway is rendered again from scratch.
+                    std::vector<image_tile> pieces;
+                    client.render(tile_job, width, height, [&](const image_tile& piece) {
+                        pieces.push_back(piece);
+                    });
+
+                    std::string output_error;
+                    {
+                        std::lock_guard<std::mutex> output_lock(output_mutex);
+                        try {
+                            for (const auto& piece : pieces)
+                                if (on_tile)
+                                    on_tile(piece);
+                        } catch (const std::exception& e) {
+                            output_error = e.what();
+                        }
+                    }
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!output_error.empty()) {
+                        state.error = output_error;
+                        changed.notify_all();
+                        return;
+                    }
+                    tile.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tile_start).count();
+                    timings.push_back(tile);
+                    state.in_flight--;
+                    have_tile = false;
+                    failures = 0;
+                    std::clog << "\rTiles remaining: " << state.pending.size() + state.in_flight << "   " << std::flush;
+                    changed.notify_all();
+                }
+            } catch (const render_server_error& e) {
+                std::lock_guard<std::mutex> lock(mutex);
+                state.error = e.what();
+                changed.notify_all();
+                return;
+            } catch (const std::exception& e) {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (predicting && !state.sized)
+                    state.predicting = false;
+                if (have_tile) {
+                    state.pending.push_front(tile);
+                    state.in_flight--;
+                }
+                if (++failures > retries) {
+                    std::clog << "\nWorker " << address << " lost: " << e.what() << "\n";
+                    state.workers_left--;
+                    changed.notify_all();
+                    return;
+                }
+                std::clog << "\nWorker " << address << " failed, retrying: " << e.what() << "\n";
+                changed.notify_all();
+
+                // Wait before reconnecting, unless the image is finished in the meantime.
+                changed.wait_for(lock, std::chrono::milliseconds(250 << failures),
+                                       [this] { return finished(); });
+                if (finished())
+                    return;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,319 @@
+#ifndef TILE_OUTPUT_H
+#define TILE_OUTPUT_H
+
+#include "camera.h"
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Output of finished tiles while the rest of the image is still rendering. Render threads
+// hand each tile to a tile_writer, whose own thread encodes it and writes it out to any
+// number of sinks, so render threads never wait on a file or pipe:
+//
+//   tile_stream_sink         The tiles as a stream of float records, in the order they were
+//                            finished, to a file or a pipe. The records are those a render
+//                            server sends (see render_service.h):
+//
+//                              image <width> <height>
+//                              tile <x> <y> <width> <height>   then width * height * 3 floats
+//                              done
+//
+//   mapped_framebuffer_sink  The whole image as a PFM file of linear floats, mapped into
+//                            memory and filled in tile by tile, so other programs can watch
+//                            the image appear as it renders.
+//
+// Neither holds the image in memory as 8-bit colors, or at all in the case of the stream.
+
+namespace tile_output_detail {
+    inline std::string encode_tile(const image_tile& tile) {
+        // The tile's record in a tile stream: its header line, then its pixels as floats.
+        auto header = "tile " + std::to_string(tile.x) + " " + std::to_string(tile.y) + " "
+                    + std::to_string(tile.width) + " " + std::to_string(tile.height) + "\n";
+
+        std::string record(header.size() + tile.pixels.size() * 3 * sizeof(float), '\0');
+        std::memcpy(record.data(), header.data(), header.size());
+        auto out = record.data() + header.size();
+        for (const auto& pixel : tile.pixels) {
+            float rgb[3] = { float(pixel.x()), float(pixel.y()), float(pixel.z()) };
+            std::memcpy(out, rgb, sizeof(rgb));
+            out += sizeof(rgb);
+        }
+        return record;
+    }
+
+    [[noreturn]] inline void fail(const std::string& what, const std::string& filename) {
+        throw std::runtime_error(what + " '" + filename + "': " + std::strerror(errno));
+    }
+}
+
+// A destination for finished tiles. begin is called before the first tile and finish after
+// the last; all three are called from one thread at a time, and throw std::runtime_error if
+// the output fails.
+class tile_sink {
+  public:
+    virtual ~tile_sink() = default;
+
+    virtual void begin(int width, int height) = 0;
+    virtual void write(const image_tile& tile) = 0;
+    virtual void finish() = 0;
+};
+
+// Writes a tile stream to a file, or to standard output for a filename of "-". A named pipe
+// can be given as the file, for another program to read the tiles as they arrive.
+class tile_stream_sink : public tile_sink {
+  public:
+    explicit tile_stream_sink(std::string filename) : filename(std::move(filename)) {}
+
+    ~tile_stream_sink() override { close(); }
+
+    void begin(int width, int height) override {
+        if (filename == "-") {
+            fd = STDOUT_FILENO;
+        } else {
+            fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                tile_output_detail::fail("Cannot open output file", filename);
+        }
+        put("image " + std::to_string(width) + " " + std::to_string(height) + "\n");
+    }
+
+    void write(const image_tile& tile) override { put(tile_output_detail::encode_tile(tile)); }
+
+    void finish() override {
+        put("done\n");
+        close();
+    }
+
+  private:
+    std::string filename;
+    int fd = -1;
+
+    void put(const std::string& bytes) {
+        // Each record goes out with a single write where the destination allows it, so a
+        // reader never waits on a buffer holding half a tile.
+        auto in = bytes.data();
+        auto size = bytes.size();
+        while (size > 0) {
+            auto n = ::write(fd, in, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                tile_output_detail::fail("Cannot write to", filename);
+            in += n;
+            size -= size_t(n);
+        }
+    }
+
+    void close() {
+        if (fd >= 0 && fd != STDOUT_FILENO)
+            ::close(fd);
+        fd = -1;
+    }
+};
+
+// Writes the image to a PFM file mapped into memory. The file is sized for the whole image
+// up front, black until each tile is copied into place, and flushed to disk at the end.
+class mapped_framebuffer_sink : public tile_sink {
+  public:
+    explicit mapped_framebuffer_sink(std::string filename) : filename(std::move(filename)) {}
+
+    ~mapped_framebuffer_sink() override { unmap(); }
+
+    void begin(int width, int height) override {
+        // PFM stores rows bottom to top, with a negative scale for little-endian floats.
+        const std::uint16_t probe = 1;
+        bool little_endian = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+        auto header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n"
+                    + (little_endian ? "-1.0\n" : "1.0\n");
+
+        image_width = width;
+        image_height = height;
+        pixels_offset = header.size();
+        length = header.size() + size_t(width) * height * 3 * sizeof(float);
+
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            tile_output_detail::fail("Cannot open output file", filename);
+        if (::ftruncate(fd, off_t(length)) != 0)
+            tile_output_detail::fail("Cannot size output file", filename);
+        void* addr = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED)
+            tile_output_detail::fail("Cannot map output file", filename);
+        bytes = static_cast<char*>(addr);
+        std::memcpy(bytes, header.data(), header.size());
+    }
+
+    void write(const image_tile& tile) override {
+        for (int j = 0; j < tile.height; j++) {
+            auto row = size_t(image_height - 1 - (tile.y + j));
+            auto out = bytes + pixels_offset + (row * image_width + tile.x) * 3 * sizeof(float);
+            for (int i = 0; i < tile.width; i++) {
+                const auto& pixel = tile.pixels[size_t(j) * tile.width + i];
+                float rgb[3] = { float(pixel.x()), float(pixel.y()), float(pixel.z()) };
+                std::memcpy(out, rgb, sizeof(rgb));
+                out += sizeof(rgb);
+            }
+        }
+    }
+
+    void finish() override {
+        if (::msync(bytes, length, MS_SYNC) != 0)
+            tile_output_detail::fail("Cannot flush output file", filename);
+        unmap();
+    }
+
+  private:
+    std::string filename;
+    int    fd = -1;
+    char*  bytes = nullptr;
+    size_t length = 0;
+    size_t pixels_offset = 0;
+    int    image_width = 0, image_height = 0;
+
+    void unmap() {
+        if (bytes != nullptr) ::munmap(bytes, length);
+        if (fd >= 0) ::close(fd);
+        bytes = nullptr;
+        fd = -1;
+    }
+};
+
+// Counters from one image written by a tile_writer.
+struct tile_writer_stats {
+    int    tiles         = 0;  // Tiles written
+    size_t peak_queue    = 0;  // Most tiles waiting to be written at once
+    double wait_seconds  = 0;  // Time render threads spent waiting for room in the queue
+    double write_seconds = 0;  // Time the writer thread spent encoding and writing
+};
+
+// Writes tiles to its sinks from a thread of its own. Render threads push finished tiles
+// into a queue and go straight back to rendering; the writer thread takes them out in order.
+//
+// The queue holds at most `capacity` tiles, which bounds the memory held for output. A push
+// only waits if the queue is full, that is if the sinks cannot keep up with the renderer,
+// and then only the thread that pushed waits: the camera hands tiles on outside any lock,
+// so the other render threads carry on until they too have a tile to push.
+// stats().wait_seconds tells whether that happened. If a sink fails, the rest of the tiles
+// are dropped, so the render can finish, and finish() reports the error.
+class tile_writer {
+  public:
+    explicit tile_writer(std::vector<std::unique_ptr<tile_sink>> sinks, size_t capacity = 64)
+      : sinks(std::move(sinks)), capacity(std::max<size_t>(1, capacity)) {}
+
+    ~tile_writer() {
+        if (thread.joinable()) {
+            try { finish(); } catch (const std::exception&) {}
+        }
+    }
+
+    tile_writer(const tile_writer&) = delete;
+    tile_writer& operator=(const tile_writer&) = delete;
+
+    void begin(int width, int height) {
+        // Opens the sinks for a width by height image and starts the writer thread. Throws
+        // std::runtime_error if a sink cannot be opened.
+        for (auto& sink : sinks)
+            sink->begin(width, height);
+        counts = tile_writer_stats();
+        closing = false;
+        error = nullptr;
+        thread = std::thread([this] { run(); });
+    }
+
+    void push(const image_tile& tile) {
+        // Queues a finished tile, waiting for room if the queue is full. Safe to call from
+        // any thread.
+        std::unique_lock<std::mutex> lock(mutex);
+        if (queue.size() >= capacity) {
+            auto start = std::chrono::steady_clock::now();
+            room.wait(lock, [this] { return queue.size() < capacity; });
+            counts.wait_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        queue.push_back(tile);
+        counts.peak_queue = std::max(counts.peak_queue, queue.size());
+        ready.notify_one();
+    }
+
+    void finish() {
+        // Waits for the queued tiles to be written, then finishes the sinks. Throws
+        // std::runtime_error if any of the output failed.
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        ready.notify_one();
+        thread.join();
+
+        if (!error) {
+            try {
+                for (auto& sink : sinks)
+                    sink->finish();
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    const tile_writer_stats& stats() const { return counts; }
+
+  private:
+    std::vector<std::unique_ptr<tile_sink>> sinks;
+    size_t capacity;
+    std::thread thread;
+    std::mutex mutex;                // Guards the queue, `closing` and the counters
+    std::condition_variable ready;   // Signalled when a tile is queued, or at the end
+    std::condition_variable room;    // Signalled when a tile leaves the queue
+    std::deque<image_tile> queue;
+    bool closing = false;
+    std::exception_ptr error;        // The first failure of a sink, set by the writer thread
+    tile_writer_stats counts;
+
+    void run() {
+        for (;;) {
+            image_tile tile;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this] { return closing || !queue.empty(); });
+                if (queue.empty())
+                    return;
+                tile = std::move(queue.front());
+                queue.pop_front();
+            }
+            room.notify_one();
+
+            if (error)
+                continue;
+            auto start = std::chrono::steady_clock::now();
+            try {
+                for (auto& sink : sinks)
+                    sink->write(tile);
+            } catch (...) {
+                error = std::current_exception();
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            counts.tiles++;
+            counts.write_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+};
+
+#endif
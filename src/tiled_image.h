@@ -0,0 +1,397 @@
+#ifndef TILED_IMAGE_H
+#define TILED_IMAGE_H
+
+#include "rtw_stb_image.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Tiled texture files
+//
+// A tile file holds a tile_file_header, one tile_file_level per mip level, and then every
+// level cut into tile_size x tile_size tiles of linear RGB bytes. Tiles are stored level by
+// level in row-major order, each starting on a 4 KiB boundary so one tile read touches as few
+// pages as possible. Tiles on the right and bottom edges repeat the last row and column of the
+// image. The header's key is a hash of the source image's size and modification time; a tile
+// file whose key does not match its source is rebuilt.
+
+struct tile_file_header {
+    char          magic[8];
+    std::uint32_t version;
+    std::uint32_t tile_size;
+    std::uint64_t key;
+    std::uint32_t width;
+    std::uint32_t height;
+    std::uint32_t levels;
+    std::uint32_t reserved;
+    std::uint64_t tiles_offset;
+    std::uint64_t tile_stride;
+};
+
+struct tile_file_level {
+    std::uint32_t width;
+    std::uint32_t height;
+    std::uint32_t tiles_x;
+    std::uint32_t tiles_y;
+    std::uint64_t first_tile;
+};
+
+using texture_tile = std::vector<unsigned char>;
+
+struct tile_cache_stats {
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t evictions = 0;
+    size_t        resident_bytes = 0;
+    size_t        capacity_bytes = 0;
+};
+
+// Bounded cache of texture tiles shared by every tiled image. The cache is split into shards
+// with their own lock and LRU list, so threads faulting in different tiles rarely wait on
+// each other. Tiles are handed out as shared_ptrs: an evicted tile stays alive until the last
+// sampler holding it lets go.
+class tile_cache {
+  public:
+    static tile_cache& global() {
+        static tile_cache cache;
+        return cache;
+    }
+
+    void set_capacity(size_t bytes) {
+        capacity.store(bytes);
+        for (auto& s : shards) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            evict(s);
+        }
+    }
+
+    template <typename Load>
+    shared_ptr<const texture_tile> fetch(std::uint64_t key, Load load) {
+        // Returns the tile stored under `key`, calling load() to read it on a miss. The read
+        // happens outside the shard lock; if two threads miss on the same tile, the first
+        // one to finish wins.
+        auto& s = shards[(key * 0x9e3779b97f4a7c15ULL) >> 60];
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            auto it = s.index.find(key);
+            if (it != s.index.end()) {
+                s.lru.splice(s.lru.begin(), s.lru, it->second);
+                hits.fetch_add(1, std::memory_order_relaxed);
+                return it->second->tile;
+            }
+        }
+
+        misses.fetch_add(1, std::memory_order_relaxed);
+        shared_ptr<const texture_tile> tile = load();
+
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.index.find(key);
+        if (it != s.index.end())
+            return it->second->tile;
+
+        s.lru.push_front({ key, tile });
+        s.index[key] = s.lru.begin();
+        s.bytes += tile->size();
+        evict(s);
+        return tile;
+    }
+
+    tile_cache_stats stats() {
+        tile_cache_stats result;
+        result.hits = hits.load();
+        result.misses = misses.load();
+        result.evictions = evictions.load();
+        result.capacity_bytes = capacity.load();
+        for (auto& s : shards) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            result.resident_bytes += s.bytes;
+        }
+        return result;
+    }
+
+  private:
+    static const int shard_count = 16;
+
+    struct entry {
+        std::uint64_t                  key;
+        shared_ptr<const texture_tile> tile;
+    };
+
+    struct shard {
+        std::mutex mutex;
+        std::list<entry> lru;  // Most recently used first
+        std::unordered_map<std::uint64_t, std::list<entry>::iterator> index;
+        size_t bytes = 0;
+    };
+
+    shard shards[shard_count];
+    std::atomic<size_t> capacity{ size_t(1) << 30 };
+    std::atomic<std::uint64_t> hits{0}, misses{0}, evictions{0};
+
+    void evict(shard& s) {
+        // Drop least recently used tiles until the shard fits its share of the capacity. The
+        // newest tile always stays, so a tiny cap still makes progress.
+        size_t limit = capacity.load() / shard_count;
+        while (s.bytes > limit && s.lru.size() > 1) {
+            auto& victim = s.lru.back();
+            s.bytes -= victim.tile->size();
+            s.index.erase(victim.key);
+            s.lru.pop_back();
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+};
+
+// Reads tiles of a tile file on demand through the global tile cache.
+class tiled_image {
+  public:
+    // Remembers the last tile a sampler read from, so that neighbouring texels in the same
+    // tile skip the cache lookup. A cursor may be used with any number of tiled images.
+    struct cursor {
+        std::uint64_t                  key = ~std::uint64_t(0);  // Cache key of `tile`
+        shared_ptr<const texture_tile> tile;
+    };
+
+    explicit tiled_image(const std::string& tile_path, std::uint64_t expected_key = 0) {
+        // Opens a tile file. Throws std::runtime_error if it is missing or malformed, or if
+        // `expected_key` is not zero and the file's key differs from it.
+        fd = ::open(tile_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::runtime_error("Cannot open tile file '" + tile_path + "'");
+
+        try {
+            read_exact(0, &header, sizeof(header));
+            if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version
+                || header.tile_size == 0 || header.levels == 0 || header.levels > 32)
+                throw std::runtime_error("Not a tile file: '" + tile_path + "'");
+            if (expected_key != 0 && header.key != expected_key)
+                throw std::runtime_error("Stale tile file '" + tile_path + "'");
+
+            level_info.resize(header.levels);
+            read_exact(sizeof(header), level_info.data(), level_info.size() * sizeof(tile_file_level));
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+
+        static std::atomic<std::uint64_t> next_id{1};
+        id = next_id++;
+    }
+
+    tiled_image(const tiled_image&) = delete;
+    tiled_image& operator=(const tiled_image&) = delete;
+
+    ~tiled_image() { ::close(fd); }
+
+    int levels() const { return int(header.levels); }
+    int width(int level) const  { return int(level_info[level].width); }
+    int height(int level) const { return int(level_info[level].height); }
+
+    const unsigned char* texel(int x, int y, int level, cursor& at) const {
+        // Return the address of the three RGB bytes of the texel at x,y of the given level,
+        // clamping x,y to the level's edges. The address stays valid while `at` holds its
+        // tile.
+        const auto& info = level_info[level];
+        x = std::clamp(x, 0, int(info.width) - 1);
+        y = std::clamp(y, 0, int(info.height) - 1);
+
+        int size = int(header.tile_size);
+        std::uint64_t index = info.first_tile + std::uint64_t(y / size) * info.tiles_x + x / size;
+        std::uint64_t key = (id << 32) | index;
+        if (key != at.key) {
+            at.tile = tile_cache::global().fetch(key, [&] { return read_tile(index); });
+            at.key = key;
+        }
+
+        return at.tile->data() + (size_t(y % size) * size + x % size) * 3;
+    }
+
+    static std::uint64_t source_key(const std::string& filename) {
+        // Hash the source image's size and modification time with the format version.
+        struct stat st;
+        if (::stat(filename.c_str(), &st) != 0)
+            return 0;
+
+        std::uint64_t values[3] = {
+            std::uint64_t(st.st_size),
+            std::uint64_t(st.st_mtim.tv_sec) * 1000000000 + std::uint64_t(st.st_mtim.tv_nsec),
+            version,
+        };
+        std::uint64_t hash = 14695981039346656037ull;
+        auto bytes = reinterpret_cast<const unsigned char*>(values);
+        for (size_t i = 0; i < sizeof(values); i++) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+        return hash == 0 ? 1 : hash;
+    }
+
+    static bool write_tile_file(
+        const rtw_image& image, const std::string& tile_path, std::uint64_t key,
+        int tile_size = 64
+    ) {
+        // Cut every mip level of the image into tiles and write them as a tile file. Writes to
+        // a temporary file and renames it into place, so concurrent renders never open a
+        // half-written file.
+        if (image.width() <= 0)
+            return false;
+
+        tile_file_header out_header{};
+        std::memcpy(out_header.magic, magic, sizeof(magic));
+        out_header.version = version;
+        out_header.tile_size = std::uint32_t(tile_size);
+        out_header.key = key;
+        out_header.width = std::uint32_t(image.width());
+        out_header.height = std::uint32_t(image.height());
+        out_header.levels = std::uint32_t(image.levels());
+        out_header.tile_stride = align(std::uint64_t(tile_size) * tile_size * 3);
+
+        std::vector<tile_file_level> out_levels(image.levels());
+        std::uint64_t tile_count = 0;
+        for (int level = 0; level < image.levels(); level++) {
+            auto& info = out_levels[level];
+            info.width = std::uint32_t(image.width(level));
+            info.height = std::uint32_t(image.height(level));
+            info.tiles_x = (info.width + tile_size - 1) / tile_size;
+            info.tiles_y = (info.height + tile_size - 1) / tile_size;
+            info.first_tile = tile_count;
+            tile_count += std::uint64_t(info.tiles_x) * info.tiles_y;
+        }
+        out_header.tiles_offset = align(sizeof(out_header) + out_levels.size() * sizeof(tile_file_level));
+
+        auto temp_path = tile_path + ".tmp" + std::to_string(::getpid());
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        if (!out.is_open())
+            return false;
+
+        out.write(reinterpret_cast<const char*>(&out_header), sizeof(out_header));
+        out.write(reinterpret_cast<const char*>(out_levels.data()),
+                  std::streamsize(out_levels.size() * sizeof(tile_file_level)));
+
+        std::vector<char> tile(out_header.tile_stride);
+        out.write(tile.data(), std::streamsize(out_header.tiles_offset - std::uint64_t(out.tellp())));
+
+        for (int level = 0; level < image.levels(); level++) {
+            const auto& info = out_levels[level];
+            for (std::uint32_t ty = 0; ty < info.tiles_y; ty++) {
+                for (std::uint32_t tx = 0; tx < info.tiles_x; tx++) {
+                    for (int y = 0; y < tile_size; y++) {
+                        for (int x = 0; x < tile_size; x++) {
+                            auto pixel = image.pixel_data(int(tx)*tile_size + x, int(ty)*tile_size + y, level);
+                            std::memcpy(&tile[(size_t(y) * tile_size + x) * 3], pixel, 3);
+                        }
+                    }
+                    out.write(tile.data(), std::streamsize(tile.size()));
+                }
+            }
+        }
+        out.close();
+
+        if (!out || std::rename(temp_path.c_str(), tile_path.c_str()) != 0) {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+  private:
+    static constexpr char          magic[8] = { 'R', 'T', 'W', 'T', 'I', 'L', 'E', '\0' };
+    static constexpr std::uint32_t version = 1;
+    static constexpr std::uint64_t alignment = 4096;
+
+    int fd = -1;
+    std::uint64_t id = 0;  // Distinguishes this file's tiles in the shared cache
+    tile_file_header header{};
+    std::vector<tile_file_level> level_info;
+
+    static std::uint64_t align(std::uint64_t offset) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    void read_exact(std::uint64_t offset, void* data, size_t size) const {
+        auto bytes = static_cast<char*>(data);
+        while (size > 0) {
+            auto n = ::pread(fd, bytes, size, off_t(offset));
+            if (n <= 0)
+                throw std::runtime_error("Truncated tile file");
+            bytes += n;
+            offset += std::uint64_t(n);
+            size -= size_t(n);
+        }
+    }
+
+    shared_ptr<const texture_tile> read_tile(std::uint64_t index) const {
+        // Read one tile. A tile that cannot be read comes back magenta, like missing pixel
+        // data in rtw_image, rather than failing the render thread.
+        size_t size = size_t(header.tile_size) * header.tile_size * 3;
+        auto tile = make_shared<texture_tile>(size);
+        try {
+            read_exact(header.tiles_offset + index * header.tile_stride, tile->data(), size);
+        } catch (const std::exception&) {
+            for (size_t i = 0; i < size; i += 3) {
+                (*tile)[i] = 255;
+                (*tile)[i+1] = 0;
+                (*tile)[i+2] = 255;
+            }
+        }
+        return tile;
+    }
+};
+
+inline shared_ptr<const tiled_image> open_tiled_image(const std::string& filename) {
+    // Opens the tiled form of an image. A .rtwtiles file is opened as it is; any other image
+    // goes through the tile file stored next to it as <filename>.rtwtiles, which is built
+    // from the image if it is missing or older than the image. If the tile file cannot be
+    // written there, it is built in the temporary directory instead (TMPDIR, or /tmp) and
+    // removed as soon as it is open, so it lasts only as long as the render. Throws
+    // std::runtime_error if none of this works.
+    const std::string extension = ".rtwtiles";
+    if (filename.size() >= extension.size()
+        && filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0)
+        return make_shared<const tiled_image>(filename);
+
+    auto tile_path = filename + extension;
+    auto key = tiled_image::source_key(filename);
+    if (key == 0)
+        throw std::runtime_error("Cannot open image file '" + filename + "'");
+
+    try {
+        return make_shared<const tiled_image>(tile_path, key);
+    } catch (const std::exception&) {
+    }
+
+    rtw_image image(filename.c_str());
+    if (tiled_image::write_tile_file(image, tile_path, key))
+        return make_shared<const tiled_image>(tile_path, key);
+
+    static std::atomic<int> next_temp{0};
+    std::error_code error;
+    auto temp_dir = std::filesystem::temp_directory_path(error);
+    auto temp_path = (temp_dir / ("rtw-" + std::to_string(::getpid()) + "-"
+                                  + std::to_string(next_temp++) + extension)).string();
+    if (error || !tiled_image::write_tile_file(image, temp_path, key))
+        throw std::runtime_error("Cannot write tile file '" + tile_path + "'");
+
+    std::clog << "Could not write tile file '" << tile_path << "', using a temporary one\n";
+    auto tiled = make_shared<const tiled_image>(temp_path, key);
+    std::remove(temp_path.c_str());
+    return tiled;
+}
+
+#endif
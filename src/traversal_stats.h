@@ -0,0 +1,154 @@
+#ifndef TRAVERSAL_STATS_H
+#define TRAVERSAL_STATS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Counters of the work done tracing rays. Building with RTW_TRAVERSAL_STATS defined turns on
+// the RTW_COUNT calls in the BVHs, primitives and camera; without it they compile to nothing.
+struct traversal_counts {
+    std::uint64_t nodes_visited     = 0;  // BVH nodes whose box the ray entered
+    std::uint64_t boxes_tested      = 0;  // Ray-box tests against BVH node bounds
+    std::uint64_t primitives_tested = 0;  // Ray-primitive intersection tests
+    std::uint64_t hits              = 0;  // Primitive tests that found a closer hit
+    std::uint64_t path_length       = 0;  // Ray segments traced along camera paths
+
+    traversal_counts operator-(const traversal_counts& other) const {
+        traversal_counts d;
+        d.nodes_visited     = nodes_visited - other.nodes_visited;
+        d.boxes_tested      = boxes_tested - other.boxes_tested;
+        d.primitives_tested = primitives_tested - other.primitives_tested;
+        d.hits              = hits - other.hits;
+        d.path_length       = path_length - other.path_length;
+        return d;
+    }
+};
+
+#ifdef RTW_TRAVERSAL_STATS
+constexpr bool traversal_stats_enabled = true;
+#define RTW_COUNT(counter) (++traversal_counters().counter)
+#else
+constexpr bool traversal_stats_enabled = false;
+#define RTW_COUNT(counter) ((void)0)
+#endif
+
+inline traversal_counts& traversal_counters() {
+    // Counters of the calling thread.
+    thread_local traversal_counts counts;
+    return counts;
+}
+
+// The counters a heatmap can show, with the file name suffix used for each.
+struct traversal_field {
+    const char* name;
+    const char* label;
+    std::uint64_t traversal_counts::* counter;
+};
+
+inline const traversal_field traversal_fields[] = {
+    { "nodes", "BVH nodes visited",          &traversal_counts::nodes_visited },
+    { "boxes", "ray-box tests",              &traversal_counts::boxes_tested },
+    { "prims", "primitive tests",            &traversal_counts::primitives_tested },
+    { "hits",  "primitive hits",             &traversal_counts::hits },
+    { "path",  "path length (ray segments)", &traversal_counts::path_length },
+};
+
+namespace traversal_detail {
+    inline std::vector<double> per_sample(
+        const std::vector<traversal_counts>& pixels, const traversal_field& field, int samples
+    ) {
+        std::vector<double> values(pixels.size());
+        for (size_t i = 0; i < pixels.size(); i++)
+            values[i] = double(pixels[i].*field.counter) / samples;
+        return values;
+    }
+
+    inline double percentile(std::vector<double> values, double fraction) {
+        if (values.empty())
+            return 0;
+        auto k = size_t(fraction * double(values.size() - 1));
+        std::nth_element(values.begin(), values.begin() + k, values.end());
+        return values[k];
+    }
+
+    inline void false_color(double x, int rgb[3]) {
+        // Maps x in [0,1] along dark blue, blue, cyan, yellow, red.
+        static const double stops[5][3] = {
+            { 0, 0, 0.3 }, { 0, 0, 1 }, { 0, 1, 1 }, { 1, 1, 0 }, { 1, 0, 0 },
+        };
+        x = std::clamp(x, 0.0, 1.0) * 4;
+        int i = std::min(int(x), 3);
+        double f = x - i;
+        for (int c = 0; c < 3; c++)
+            rgb[c] = int(255.999 * ((1 - f) * stops[i][c] + f * stops[i+1][c]));
+    }
+}
+
+inline double write_heatmap(
+    std::ostream& out, const std::vector<traversal_counts>& pixels, int width,
+    const traversal_field& field, int samples
+) {
+    // Writes one counter, averaged per sample, as a false-color PPM image. Colors are scaled
+    // to the 99th percentile so a few outlying pixels do not wash out the rest; returns that
+    // scale.
+    auto values = traversal_detail::per_sample(pixels, field, samples);
+    double scale = std::max(traversal_detail::percentile(values, 0.99), 1e-9);
+
+    int height = width > 0 ? int(pixels.size() / size_t(width)) : 0;
+    out << "P3\n" << width << ' ' << height << "\n255\n";
+    for (double value : values) {
+        int rgb[3];
+        traversal_detail::false_color(value / scale, rgb);
+        out << rgb[0] << ' ' << rgb[1] << ' ' << rgb[2] << '\n';
+    }
+    return scale;
+}
+
+inline void write_traversal_histograms(
+    std::ostream& out, const std::vector<traversal_counts>& pixels, int samples
+) {
+    // Writes the totals of every counter and a histogram of its per-pixel average per sample,
+    // in power-of-two buckets.
+    for (const auto& field : traversal_fields) {
+        auto values = traversal_detail::per_sample(pixels, field, samples);
+
+        std::uint64_t total = 0;
+        for (const auto& p : pixels)
+            total += p.*field.counter;
+        double mean = pixels.empty() ? 0 : double(total) / samples / double(pixels.size());
+
+        out << field.label << " per sample: total " << total
+            << ", mean " << mean
+            << ", p50 " << traversal_detail::percentile(values, 0.5)
+            << ", p99 " << traversal_detail::percentile(values, 0.99)
+            << ", max " << (values.empty() ? 0 : *std::max_element(values.begin(), values.end()))
+            << "\n";
+
+        std::vector<size_t> buckets;
+        for (double value : values) {
+            size_t bucket = 0;
+            for (double edge = 1; value >= edge; edge *= 2)
+                bucket++;
+            if (bucket >= buckets.size())
+                buckets.resize(bucket + 1);
+            buckets[bucket]++;
+        }
+
+        size_t largest = buckets.empty() ? 1 : *std::max_element(buckets.begin(), buckets.end());
+        for (size_t b = 0; b < buckets.size(); b++) {
+            double lo = b == 0 ? 0 : double(std::uint64_t(1) << (b - 1));
+            double hi = double(std::uint64_t(1) << b);
+            auto bar = std::string(size_t(50.0 * double(buckets[b]) / double(largest)), '#');
+            char line[96];
+            std::snprintf(line, sizeof(line), "  [%8.0f, %8.0f) %9zu  ", lo, hi, buckets[b]);
+            out << line << bar << "\n";
+        }
+        out << "\n";
+    }
+}
+
+#endif
@@ -0,0 +1,21 @@
+# Renders two frames of an animation with only a tile stream as output, and checks that the
+# stream files are written and that no image files appear beside them.
+#
+#   cmake -DRENDERER=<path> -DSCENE=<path> -DWORK_DIR=<path> -P frames_stream_only.cmake
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+execute_process(
+        COMMAND "${RENDERER}" "${SCENE}" --frames 2 --width 32 --spp 1 --depth 2 --stream s.bin
+        WORKING_DIRECTORY "${WORK_DIR}"
+        RESULT_VARIABLE result)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "renderer failed: ${result}")
+endif()
+
+file(GLOB written RELATIVE "${WORK_DIR}" "${WORK_DIR}/*")
+list(SORT written)
+if (NOT written STREQUAL "s_0000.bin;s_0001.bin")
+    message(FATAL_ERROR "expected only s_0000.bin and s_0001.bin, found: ${written}")
+endif()